@@ -0,0 +1,85 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__CLOUD_COMPRESSION_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__CLOUD_COMPRESSION_HPP_
+
+#include <point_cloud_interfaces/msg/compressed_point_cloud2.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <zstd.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Compresses clouds the way the zstd plugin of point_cloud_transport does, so
+// its subscribers (and republishers) decode them: the layout of the cloud as it
+// is, and its data compressed with zstd. The context and the output buffer are
+// kept from frame to frame. Errors throw std::runtime_error.
+class ZstdCloudCompressor
+{
+public:
+  // level trades bandwidth for CPU: negative levels are the fastest, 1 to 3 still
+  // compress at several hundred MB/s, up to ZSTD_maxCLevel() get the smallest
+  explicit ZstdCloudCompressor(int level)
+  : level_(level), context_(ZSTD_createCCtx())
+  {
+    if (context_ == nullptr) {
+      throw std::runtime_error("Cannot create a zstd context");
+    }
+  }
+
+  ~ZstdCloudCompressor()
+  {
+    ZSTD_freeCCtx(context_);
+  }
+
+  ZstdCloudCompressor(const ZstdCloudCompressor &) = delete;
+  ZstdCloudCompressor & operator=(const ZstdCloudCompressor &) = delete;
+
+  void compress(
+    const sensor_msgs::msg::PointCloud2 & cloud,
+    point_cloud_interfaces::msg::CompressedPointCloud2 & compressed)
+  {
+    compressed.header = cloud.header;
+    compressed.height = cloud.height;
+    compressed.width = cloud.width;
+    compressed.fields = cloud.fields;
+    compressed.is_bigendian = cloud.is_bigendian;
+    compressed.point_step = cloud.point_step;
+    compressed.row_step = cloud.row_step;
+    compressed.is_dense = cloud.is_dense;
+    compressed.format = "zstd";
+
+    compressed.compressed_data.resize(ZSTD_compressBound(cloud.data.size()));
+    const size_t size = ZSTD_compressCCtx(
+      context_, compressed.compressed_data.data(), compressed.compressed_data.size(),
+      cloud.data.data(), cloud.data.size(), level_);
+    if (ZSTD_isError(size)) {
+      throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(size));
+    }
+    compressed.compressed_data.resize(size);
+  }
+
+private:
+  const int level_;
+  ZSTD_CCtx * const context_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__CLOUD_COMPRESSION_HPP_
@@ -0,0 +1,94 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__CLOUD_POOL_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__CLOUD_POOL_HPP_
+
+#include "depthimage_to_pointcloud2/point_formats.hpp"
+
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Sets up cloud_msg for width x height points of Format, as convert<T, Format>()
+// expects. The fields are only rebuilt if they are not right already, and the data
+// buffer keeps its capacity, so a recycled cloud of the same size is not written
+// to at all; convert<T, Format>() overwrites every byte of it anyway.
+template<typename Format = PointXYZRGB>
+inline void prepareCloud(sensor_msgs::msg::PointCloud2 & cloud_msg, uint32_t width, uint32_t height)
+{
+  cloud_msg.height = height;
+  cloud_msg.width = width;
+  cloud_msg.is_dense = false;
+  cloud_msg.is_bigendian = false;
+
+  if (!Format::hasFields(cloud_msg)) {
+    Format::setFields(cloud_msg);
+  } else {
+    // PointCloud2Modifier::resize() would flatten the cloud to a single row
+    cloud_msg.row_step = width * cloud_msg.point_step;
+    cloud_msg.data.resize(static_cast<size_t>(cloud_msg.row_step) * height);
+  }
+}
+
+// Clouds that have been published and can be filled again. Only clouds whose
+// ownership comes back after publishing (i.e. not ones handed to intra-process
+// subscribers) can be recycled; acquire() allocates when the pool is empty.
+class CloudPool
+{
+public:
+  explicit CloudPool(size_t max_size = 4)
+  : max_size_(max_size)
+  {
+  }
+
+  std::unique_ptr<sensor_msgs::msg::PointCloud2> acquire()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        std::unique_ptr<sensor_msgs::msg::PointCloud2> cloud_msg = std::move(free_.back());
+        free_.pop_back();
+        return cloud_msg;
+      }
+    }
+    return std::make_unique<sensor_msgs::msg::PointCloud2>();
+  }
+
+  void release(std::unique_ptr<sensor_msgs::msg::PointCloud2> cloud_msg)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cloud_msg != nullptr && free_.size() < max_size_) {
+      free_.push_back(std::move(cloud_msg));
+    }
+  }
+
+private:
+  const size_t max_size_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<sensor_msgs::msg::PointCloud2>> free_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__CLOUD_POOL_HPP_
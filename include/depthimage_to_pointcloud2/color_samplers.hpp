@@ -0,0 +1,238 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__COLOR_SAMPLERS_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__COLOR_SAMPLERS_HPP_
+
+#include "depthimage_to_pointcloud2/registration.hpp"
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+
+#include <sensor_msgs/image_encodings.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <cv_bridge/cv_bridge.h>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Byte layouts of the 8 bit color images points can be colored from
+enum class ColorLayout
+{
+  NONE,  // not supported, points are left without color
+  GRAY,
+  BGR,
+  RGB,
+  BGRA,
+  RGBA,
+};
+
+// Layout of a color image from its encoding where that tells the channel order,
+// and from its OpenCV type otherwise (assuming the BGR order of OpenCV)
+inline ColorLayout colorLayout(const std::string & encoding, int cv_type)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  switch (cv_type) {
+    case CV_8UC1:
+      return ColorLayout::GRAY;
+    case CV_8UC3:
+      return encoding == enc::RGB8 ? ColorLayout::RGB : ColorLayout::BGR;
+    case CV_8UC4:
+      return encoding == enc::RGBA8 ? ColorLayout::RGBA : ColorLayout::BGRA;
+    default:
+      return ColorLayout::NONE;
+  }
+}
+
+// A pixel of Channels bytes, with red, green and blue at the given byte indices,
+// as the value of the rgb field
+template<int Channels, int R, int G, int B>
+inline uint32_t packColor(const uint8_t * pixel)
+{
+  return (static_cast<uint32_t>(pixel[R]) << 16) | (static_cast<uint32_t>(pixel[G]) << 8) |
+         pixel[B];
+}
+
+// Fills the rgb field of the good points among count points in the kernel layout
+// (see kPointStep) from a row of color pixels. Point i takes its color from
+// pixel i * stride of color_row. Bad points keep the NaN the row kernel wrote.
+typedef void (* ColorSampler)(const uint8_t * color_row, int count, int stride, uint8_t * out);
+
+template<int Channels, int R, int G, int B>
+inline void sampleColorRow(const uint8_t * color_row, int count, int stride, uint8_t * out)
+{
+  const int pixel_step = stride * Channels;
+  for (int i = 0; i < count; ++i, out += kPointStep, color_row += pixel_step) {
+    if (std::isnan(reinterpret_cast<const float *>(out)[2])) {
+      continue;
+    }
+    const uint32_t rgb = packColor<Channels, R, G, B>(color_row);
+    std::memcpy(out + kRgbOffset, &rgb, sizeof(rgb));
+  }
+}
+
+// Like ColorSampler, but each good point takes its color from wherever it
+// projects to in the color image through registration (see ColorRegistration),
+// rays being the registration's row for the points. Points that project outside
+// the image or behind the color camera are left uncolored.
+typedef void (* RegisteredColorSampler)(
+  const cv::Mat & image, const ColorRegistration & registration, const float * rays,
+  int count, uint8_t * out);
+
+template<int Channels, int R, int G, int B>
+inline void sampleRegisteredColorRow(
+  const cv::Mat & image, const ColorRegistration & registration, const float * rays,
+  int count, uint8_t * out)
+{
+  const float max_u = image.cols - 0.5f;
+  const float max_v = image.rows - 0.5f;
+  for (int i = 0; i < count; ++i, out += kPointStep, rays += 3) {
+    const float z = reinterpret_cast<const float *>(out)[2];
+    if (std::isnan(z)) {
+      continue;
+    }
+    const float color_z = z * rays[2] + registration.tz();
+    if (!(color_z > 0.0f)) {
+      continue;
+    }
+    const float inv_z = 1.0f / color_z;
+    const float u = registration.fx() * (z * rays[0] + registration.tx()) * inv_z +
+      registration.cx();
+    const float v = registration.fy() * (z * rays[1] + registration.ty()) * inv_z +
+      registration.cy();
+    if (!(u >= -0.5f && u < max_u && v >= -0.5f && v < max_v)) {
+      continue;
+    }
+    // Nearest pixel; u + 0.5 and v + 0.5 are not negative so truncation rounds down
+    const uint8_t * pixel = image.ptr<uint8_t>(static_cast<int>(v + 0.5f)) +
+      static_cast<int>(u + 0.5f) * Channels;
+    const uint32_t rgb = packColor<Channels, R, G, B>(pixel);
+    std::memcpy(out + kRgbOffset, &rgb, sizeof(rgb));
+  }
+}
+
+// The samplers for a layout, picked once per frame
+inline ColorSampler selectColorSampler(ColorLayout layout)
+{
+  switch (layout) {
+    case ColorLayout::GRAY:
+      return &sampleColorRow<1, 0, 0, 0>;
+    case ColorLayout::BGR:
+      return &sampleColorRow<3, 2, 1, 0>;
+    case ColorLayout::RGB:
+      return &sampleColorRow<3, 0, 1, 2>;
+    case ColorLayout::BGRA:
+      return &sampleColorRow<4, 2, 1, 0>;
+    case ColorLayout::RGBA:
+      return &sampleColorRow<4, 0, 1, 2>;
+    default:
+      return nullptr;
+  }
+}
+
+inline RegisteredColorSampler selectRegisteredColorSampler(ColorLayout layout)
+{
+  switch (layout) {
+    case ColorLayout::GRAY:
+      return &sampleRegisteredColorRow<1, 0, 0, 0>;
+    case ColorLayout::BGR:
+      return &sampleRegisteredColorRow<3, 2, 1, 0>;
+    case ColorLayout::RGB:
+      return &sampleRegisteredColorRow<3, 0, 1, 2>;
+    case ColorLayout::BGRA:
+      return &sampleRegisteredColorRow<4, 2, 1, 0>;
+    case ColorLayout::RGBA:
+      return &sampleRegisteredColorRow<4, 0, 1, 2>;
+    default:
+      return nullptr;
+  }
+}
+
+// A color image and the sampler for it, set up once per frame. Without a
+// registration the image has to be pixel-aligned with the depth image.
+class ColorSource
+{
+public:
+  ColorSource() = default;
+
+  explicit ColorSource(const cv_bridge::CvImageConstPtr & cv_ptr)
+  {
+    if (cv_ptr != nullptr && !cv_ptr->image.empty()) {
+      sampler_ = selectColorSampler(colorLayout(cv_ptr->encoding, cv_ptr->image.type()));
+      image_ = cv_ptr;
+    }
+  }
+
+  // registration has to be built from the ProjectionCache the points are
+  // converted with
+  ColorSource(
+    const cv_bridge::CvImageConstPtr & cv_ptr,
+    std::shared_ptr<const ColorRegistration> registration)
+  {
+    if (cv_ptr != nullptr && !cv_ptr->image.empty() && registration != nullptr) {
+      registered_sampler_ = selectRegisteredColorSampler(
+        colorLayout(cv_ptr->encoding, cv_ptr->image.type()));
+      image_ = cv_ptr;
+      registration_ = std::move(registration);
+    }
+  }
+
+  explicit operator bool() const
+  {
+    return sampler_ != nullptr || registered_sampler_ != nullptr;
+  }
+
+  // Colors the width points of output row v, from column u on. Without a
+  // registration, point i takes its color from pixel ((u + i) * stride + offset,
+  // v * stride + offset), i.e. stride and offset describe the decimation of the
+  // depth image. Points that fall outside the image are left uncolored.
+  void colorizeRow(int v, int width, uint8_t * out, int stride = 1, int offset = 0, int u = 0) const
+  {
+    const cv::Mat & image = image_->image;
+    if (registered_sampler_ != nullptr) {
+      if (static_cast<uint32_t>(v) < registration_->height() &&
+        static_cast<uint32_t>(u) < registration_->width())
+      {
+        const int count = std::min(width, static_cast<int>(registration_->width()) - u);
+        registered_sampler_(
+          image, *registration_, registration_->rays(static_cast<uint32_t>(v)) + 3 * u, count,
+          out);
+      }
+      return;
+    }
+    const int color_v = v * stride + offset;
+    const int color_u = u * stride + offset;
+    if (color_v >= image.rows || color_u >= image.cols) {
+      return;
+    }
+    const int count = std::min(width, (image.cols - color_u + stride - 1) / stride);
+    sampler_(image.ptr<uint8_t>(color_v) + color_u * image.elemSize(), count, stride, out);
+  }
+
+private:
+  cv_bridge::CvImageConstPtr image_;
+  ColorSampler sampler_ = nullptr;
+  RegisteredColorSampler registered_sampler_ = nullptr;
+  std::shared_ptr<const ColorRegistration> registration_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__COLOR_SAMPLERS_HPP_
@@ -0,0 +1,213 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__COMPRESSED_DEPTH_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__COMPRESSED_DEPTH_HPP_
+
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/compressed_image.hpp>
+#include <sensor_msgs/msg/image.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Decodes count pixels of the RVL codec (Wilson, "Fast Lossless Depth Image
+// Compression", 2017) from size bytes at input: runs of zeros and of non-zero
+// pixels alternate, the non-zero ones as zigzag encoded deltas to the previous
+// one, all numbers in 3 bit nibbles with a continuation bit, filled into 32 bit
+// words from the top. Throws std::runtime_error if the input ends early.
+inline void decodeRvl(const uint8_t * input, size_t size, uint16_t * output, size_t count)
+{
+  const size_t words = size / sizeof(uint32_t);
+  size_t next_word = 0;
+  uint32_t word = 0;
+  int nibbles_left = 0;
+  auto decode_vle = [&]() {
+      uint32_t value = 0;
+      int bits = 29;
+      uint32_t nibble;
+      do {
+        if (nibbles_left == 0) {
+          if (next_word == words) {
+            throw std::runtime_error("RVL data ends early");
+          }
+          std::memcpy(&word, input + next_word * sizeof(uint32_t), sizeof(uint32_t));
+          ++next_word;
+          nibbles_left = 8;
+        }
+        nibble = word & 0xf0000000u;
+        if (bits >= 0) {
+          value |= (nibble << 1) >> bits;
+        }
+        word <<= 4;
+        --nibbles_left;
+        bits -= 3;
+      } while (nibble & 0x80000000u);
+      return value;
+    };
+
+  uint16_t previous = 0;
+  size_t left = count;
+  while (left > 0) {
+    size_t zeros = decode_vle();
+    if (zeros > left) {
+      throw std::runtime_error("RVL data has more pixels than the image");
+    }
+    std::memset(output, 0, zeros * sizeof(uint16_t));
+    output += zeros;
+    left -= zeros;
+    size_t nonzeros = decode_vle();
+    if (nonzeros > left) {
+      throw std::runtime_error("RVL data has more pixels than the image");
+    }
+    left -= nonzeros;
+    for (; nonzeros > 0; --nonzeros) {
+      const uint32_t positive = decode_vle();
+      const int32_t delta =
+        static_cast<int32_t>(positive >> 1) ^ -static_cast<int32_t>(positive & 1);
+      previous = static_cast<uint16_t>(previous + delta);
+      *output++ = previous;
+    }
+  }
+}
+
+// Turns the compressedDepth messages of compressed_depth_image_transport (the
+// depth/compressedDepth topic of image_transport) back into depth images: PNG or
+// RVL compressed 16UC1 depths, or 32FC1 depths quantized to 16 bit inverse depths
+// first. The pixels are decoded straight into the data of the image passed in,
+// which keeps its capacity from frame to frame, so a stream of frames of one size
+// decodes without allocating. Errors throw std::runtime_error.
+class CompressedDepthDecoder
+{
+public:
+  // Larger images are taken for corrupt data rather than allocated for
+  static constexpr uint32_t kMaxSide = 16384;
+
+  void decode(const sensor_msgs::msg::CompressedImage & message, sensor_msgs::msg::Image & image)
+  {
+    // "16UC1; compressedDepth png", "32FC1; compressedDepth rvl", or without the
+    // codec from before RVL was added
+    const std::string & format = message.format;
+    const std::string encoding = format.substr(0, format.find(';'));
+    if (format.find("compressedDepth") == std::string::npos) {
+      throw std::runtime_error("Not a compressedDepth image [" + format + "]");
+    }
+    const bool rvl = format.find("rvl") != std::string::npos;
+    const bool float_depth = encoding == sensor_msgs::image_encodings::TYPE_32FC1;
+    if (!float_depth && encoding != sensor_msgs::image_encodings::TYPE_16UC1) {
+      throw std::runtime_error("Unsupported compressedDepth encoding [" + encoding + "]");
+    }
+
+    // compression_common.h: the format of the depths (int32), then the two
+    // quantization parameters of 32FC1 depths (float)
+    constexpr size_t kConfigHeaderSize = sizeof(int32_t) + 2 * sizeof(float);
+    if (message.data.size() < kConfigHeaderSize) {
+      throw std::runtime_error("compressedDepth image has no header");
+    }
+    float quantization[2];
+    std::memcpy(quantization, message.data.data() + sizeof(int32_t), sizeof(quantization));
+    const uint8_t * data = message.data.data() + kConfigHeaderSize;
+    const size_t size = message.data.size() - kConfigHeaderSize;
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    if (rvl) {
+      if (size < 2 * sizeof(uint32_t)) {
+        throw std::runtime_error("RVL image has no size");
+      }
+      std::memcpy(&width, data, sizeof(uint32_t));
+      std::memcpy(&height, data + sizeof(uint32_t), sizeof(uint32_t));
+    } else {
+      pngSize(data, size, width, height);
+    }
+    if (width == 0 || height == 0 || width > kMaxSide || height > kMaxSide) {
+      throw std::runtime_error("compressedDepth image has an implausible size");
+    }
+
+    image.header = message.header;
+    image.encoding = encoding;
+    image.is_bigendian = false;
+    image.width = width;
+    image.height = height;
+    image.step = width * (float_depth ? sizeof(float) : sizeof(uint16_t));
+    image.data.resize(static_cast<size_t>(image.step) * height);
+
+    // 16 bit depths go right into the image, inverse depths are dequantized from
+    // a buffer of their own
+    const size_t count = static_cast<size_t>(width) * height;
+    uint16_t * decoded = reinterpret_cast<uint16_t *>(image.data.data());
+    if (float_depth) {
+      inverse_depth_.resize(count);
+      decoded = inverse_depth_.data();
+    }
+    if (rvl) {
+      decodeRvl(data + 2 * sizeof(uint32_t), size - 2 * sizeof(uint32_t), decoded, count);
+    } else {
+      cv::Mat mat(static_cast<int>(height), static_cast<int>(width), CV_16UC1, decoded);
+      const cv::Mat buffer(1, static_cast<int>(size), CV_8UC1, const_cast<uint8_t *>(data));
+      cv::imdecode(buffer, cv::IMREAD_UNCHANGED, &mat);
+      // imdecode() only writes into mat if the PNG has its size and type
+      if (mat.data != reinterpret_cast<uint8_t *>(decoded)) {
+        throw std::runtime_error("compressedDepth PNG is not a 16 bit image of its size");
+      }
+    }
+
+    if (float_depth) {
+      // depth = a / (inverse - b), 0 for no depth
+      const float a = quantization[0];
+      const float b = quantization[1];
+      const float bad_point = std::numeric_limits<float>::quiet_NaN();
+      float * depth = reinterpret_cast<float *>(image.data.data());
+      for (size_t i = 0; i < count; ++i) {
+        const uint16_t inverse = inverse_depth_[i];
+        depth[i] = inverse != 0 ? a / (static_cast<float>(inverse) - b) : bad_point;
+      }
+    }
+  }
+
+private:
+  // From the IHDR chunk, which PNG requires to come first
+  static void pngSize(const uint8_t * data, size_t size, uint32_t & width, uint32_t & height)
+  {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (size < 24 || std::memcmp(data, signature, sizeof(signature)) != 0 ||
+      std::memcmp(data + 12, "IHDR", 4) != 0)
+    {
+      throw std::runtime_error("compressedDepth image is not a PNG");
+    }
+    auto big_endian = [](const uint8_t * bytes) {
+        return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) |
+               (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+      };
+    width = big_endian(data + 16);
+    height = big_endian(data + 20);
+  }
+
+  std::vector<uint16_t> inverse_depth_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__COMPRESSED_DEPTH_HPP_
@@ -0,0 +1,337 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__CONVERSION_STATS_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__CONVERSION_STATS_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Buckets of a LatencyHistogram: values below kSubBuckets have a bucket each,
+// above that every power of two is split into kSubBuckets buckets, so a bucket
+// is at most 1 / kSubBuckets of its values wide.
+constexpr int kSubBucketBits = 3;
+constexpr int kSubBuckets = 1 << kSubBucketBits;
+// Up to 2^42 ns, more than an hour
+constexpr int kHistogramBuckets = (42 - kSubBucketBits + 1) * kSubBuckets;
+
+inline int histogramBucket(uint64_t value)
+{
+  if (value < static_cast<uint64_t>(kSubBuckets)) {
+    return static_cast<int>(value);
+  }
+#if defined(__GNUC__)
+  const int msb = 63 - __builtin_clzll(value);
+#else
+  int msb = kSubBucketBits;
+  while (value >> (msb + 1)) {
+    ++msb;
+  }
+#endif
+  const int bucket = (msb - kSubBucketBits + 1) * kSubBuckets +
+    static_cast<int>((value >> (msb - kSubBucketBits)) & (kSubBuckets - 1));
+  return std::min(bucket, kHistogramBuckets - 1);
+}
+
+// Smallest value that goes into bucket, and the number of values that do
+inline uint64_t histogramBucketLower(int bucket)
+{
+  if (bucket < kSubBuckets) {
+    return static_cast<uint64_t>(bucket);
+  }
+  const int octave = bucket / kSubBuckets;
+  return static_cast<uint64_t>(kSubBuckets + bucket % kSubBuckets) << (octave - 1);
+}
+
+inline uint64_t histogramBucketWidth(int bucket)
+{
+  return bucket < kSubBuckets ? 1 : uint64_t(1) << (bucket / kSubBuckets - 1);
+}
+
+// The values recorded into a LatencyHistogram over one window
+struct HistogramSnapshot
+{
+  std::array<uint64_t, kHistogramBuckets> buckets{};
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = 0;
+  uint64_t max = 0;
+
+  double mean() const
+  {
+    return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+  }
+
+  // The value below which a fraction p of the values are, to within the width
+  // of a bucket
+  double percentile(double p) const
+  {
+    if (count == 0) {
+      return 0.0;
+    }
+    const uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(p * static_cast<double>(count))));
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        const double middle = histogramBucketLower(i) + 0.5 * (histogramBucketWidth(i) - 1);
+        return std::min(std::max(middle, static_cast<double>(min)), static_cast<double>(max));
+      }
+    }
+    return static_cast<double>(max);
+  }
+
+  // Standard deviation from the bucket middles
+  double stddev() const
+  {
+    if (count < 2) {
+      return 0.0;
+    }
+    const double m = mean();
+    double sum_squares = 0.0;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+      if (buckets[i] != 0) {
+        const double d = histogramBucketLower(i) + 0.5 * (histogramBucketWidth(i) - 1) - m;
+        sum_squares += d * d * buckets[i];
+      }
+    }
+    return std::sqrt(sum_squares / count);
+  }
+};
+
+// Histogram of durations in nanoseconds that any number of threads record into
+// without locking. take() reads and clears it; a value recorded at the same time
+// may be counted partly in the old window and partly in the new one.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram()
+  {
+    clear();
+  }
+
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram & operator=(const LatencyHistogram &) = delete;
+
+  void record(uint64_t value)
+  {
+    buckets_[histogramBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t min = min_.load(std::memory_order_relaxed);
+    while (value < min && !min_.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+    }
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  HistogramSnapshot take()
+  {
+    HistogramSnapshot snapshot;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+      snapshot.buckets[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+    }
+    snapshot.count = count_.exchange(0, std::memory_order_relaxed);
+    snapshot.sum = sum_.exchange(0, std::memory_order_relaxed);
+    snapshot.min = min_.exchange(
+      std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    snapshot.max = max_.exchange(0, std::memory_order_relaxed);
+    if (snapshot.count == 0) {
+      snapshot.min = 0;
+    }
+    return snapshot;
+  }
+
+private:
+  void clear()
+  {
+    for (std::atomic<uint64_t> & bucket : buckets_) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<uint64_t>, kHistogramBuckets> buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> min_;
+  std::atomic<uint64_t> max_;
+};
+
+// The stages a depth image goes through, each timed separately
+enum class Stage
+{
+  DECODE,       // decoding a compressed depth image
+  CAMERA_INFO,  // checking the calibration and rebuilding the ray tables
+  TRANSFORM,    // looking up the transform to target_frame
+  COLOR,        // setting up the color image, including registration
+  CONVERT,      // filling the cloud
+  COMPRESS,     // compressing and publishing the compressed cloud
+  PUBLISH,      // publish()
+  CALLBACK,     // the whole callback, from receiving the depth image
+  LATENCY,      // from the depth image's stamp to after publishing
+  COUNT,
+};
+
+// Why depth images were not converted
+enum class Drop
+{
+  NO_CAMERA_INFO,
+  UNSUPPORTED_ENCODING,
+  NO_TRANSFORM,
+  BAD_COLOR_IMAGE,
+  SUPERSEDED,     // a newer one arrived before it was converted or published
+  TOO_OLD,        // older than max_age
+  PIPELINE_FULL,  // the pipeline was full (pipeline_overflow drop_newest)
+  BAD_COMPRESSED_DEPTH,
+  COUNT,
+};
+
+constexpr size_t kStageCount = static_cast<size_t>(Stage::COUNT);
+constexpr size_t kDropCount = static_cast<size_t>(Drop::COUNT);
+
+inline const char * stageName(Stage stage)
+{
+  static const char * const names[kStageCount] = {
+    "decode", "camera_info", "transform", "color", "convert", "compress", "publish", "callback",
+    "latency"};
+  return names[static_cast<size_t>(stage)];
+}
+
+inline const char * dropName(Drop drop)
+{
+  static const char * const names[kDropCount] = {
+    "no_camera_info", "unsupported_encoding", "no_transform", "bad_color_image", "superseded",
+    "too_old", "pipeline_full", "bad_compressed_depth"};
+  return names[static_cast<size_t>(drop)];
+}
+
+// Timings and drop counts of the conversion, recorded from any thread and read
+// out once per reporting window
+class ConversionStats
+{
+public:
+  struct Snapshot
+  {
+    std::array<HistogramSnapshot, kStageCount> stages;
+    std::array<uint64_t, kDropCount> drops{};
+    // Depth images not converted because nothing subscribed to the cloud
+    uint64_t skipped = 0;
+    std::chrono::steady_clock::duration window{};
+
+    const HistogramSnapshot & stage(Stage s) const {return stages[static_cast<size_t>(s)];}
+
+    uint64_t dropped() const
+    {
+      uint64_t total = 0;
+      for (uint64_t count : drops) {
+        total += count;
+      }
+      return total;
+    }
+  };
+
+  ConversionStats()
+  : window_start_(std::chrono::steady_clock::now())
+  {
+    for (std::atomic<uint64_t> & count : drops_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    skipped_.store(0, std::memory_order_relaxed);
+  }
+
+  void record(Stage stage, std::chrono::nanoseconds duration)
+  {
+    stages_[static_cast<size_t>(stage)].record(
+      duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0);
+  }
+
+  void drop(Drop drop)
+  {
+    drops_[static_cast<size_t>(drop)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void skip()
+  {
+    skipped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Reads and clears everything recorded since the last call. Only one thread
+  // may call it.
+  Snapshot take()
+  {
+    Snapshot snapshot;
+    for (size_t i = 0; i < kStageCount; ++i) {
+      snapshot.stages[i] = stages_[i].take();
+    }
+    for (size_t i = 0; i < kDropCount; ++i) {
+      snapshot.drops[i] = drops_[i].exchange(0, std::memory_order_relaxed);
+    }
+    snapshot.skipped = skipped_.exchange(0, std::memory_order_relaxed);
+    const auto now = std::chrono::steady_clock::now();
+    snapshot.window = now - window_start_;
+    window_start_ = now;
+    return snapshot;
+  }
+
+private:
+  std::array<LatencyHistogram, kStageCount> stages_;
+  std::array<std::atomic<uint64_t>, kDropCount> drops_;
+  std::atomic<uint64_t> skipped_;
+  std::chrono::steady_clock::time_point window_start_;
+};
+
+// Records the time from its construction, or the last record(), into a stage
+class StageTimer
+{
+public:
+  explicit StageTimer(ConversionStats & stats)
+  : stats_(stats), start_(std::chrono::steady_clock::now())
+  {
+  }
+
+  StageTimer(ConversionStats & stats, std::chrono::steady_clock::time_point start)
+  : stats_(stats), start_(start)
+  {
+  }
+
+  void record(Stage stage)
+  {
+    const auto now = std::chrono::steady_clock::now();
+    stats_.record(stage, now - start_);
+    start_ = now;
+  }
+
+private:
+  ConversionStats & stats_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__CONVERSION_STATS_HPP_
@@ -0,0 +1,129 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__DECIMATION_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__DECIMATION_HPP_
+
+#include "depthimage_to_pointcloud2/depth_traits.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// How a factor x factor block of depth pixels is reduced to one
+enum class DecimationMode
+{
+  STRIDE,        // keep the top left pixel of the block
+  BLOCK_MIN,     // closest good depth in the block
+  BLOCK_MEDIAN,  // median of the good depths in the block
+};
+
+// Parses "stride", "min" or "median"; returns false for anything else
+inline bool decimationModeFromString(const std::string & name, DecimationMode & mode)
+{
+  if (name == "stride") {
+    mode = DecimationMode::STRIDE;
+  } else if (name == "min") {
+    mode = DecimationMode::BLOCK_MIN;
+  } else if (name == "median") {
+    mode = DecimationMode::BLOCK_MEDIAN;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Whether the rays and colors of a reduced pixel come from the block center
+// rather than its top left pixel
+inline bool decimationSamplesBlockCenter(DecimationMode mode)
+{
+  return mode != DecimationMode::STRIDE;
+}
+
+// Reduces the depth rows [out_v * factor, (out_v + 1) * factor) into out_width
+// depths. Blocks without any good depth produce an invalid one, which the row
+// kernels treat like any other missing pixel.
+template<typename T>
+inline void decimateRow(
+  const uint8_t * depth_data, size_t depth_step, uint32_t out_v, uint32_t out_width,
+  uint32_t factor, DecimationMode mode, T * out)
+{
+  auto source_row = [&](uint32_t dv) {
+      return reinterpret_cast<const T *>(depth_data + (out_v * factor + dv) * depth_step);
+    };
+
+  if (mode == DecimationMode::STRIDE) {
+    const T * row = source_row(0);
+    for (uint32_t u = 0; u < out_width; ++u) {
+      out[u] = row[u * factor];
+    }
+    return;
+  }
+
+  if (mode == DecimationMode::BLOCK_MIN) {
+    // Start from the top row of each block, then fold in the others one source
+    // row at a time so memory is read sequentially
+    const T * row = source_row(0);
+    for (uint32_t u = 0; u < out_width; ++u) {
+      out[u] = row[u * factor];
+    }
+    for (uint32_t dv = 0; dv < factor; ++dv) {
+      row = source_row(dv);
+      for (uint32_t u = 0; u < out_width; ++u) {
+        const T * block = row + u * factor;
+        for (uint32_t du = 0; du < factor; ++du) {
+          T depth = block[du];
+          if (DepthTraits<T>::valid(depth) &&
+            (!DepthTraits<T>::valid(out[u]) || depth < out[u]))
+          {
+            out[u] = depth;
+          }
+        }
+      }
+    }
+    return;
+  }
+
+  thread_local std::vector<T> samples;
+  samples.resize(static_cast<size_t>(factor) * factor);
+  for (uint32_t u = 0; u < out_width; ++u) {
+    size_t count = 0;
+    T fallback = source_row(0)[u * factor];
+    for (uint32_t dv = 0; dv < factor; ++dv) {
+      const T * block = source_row(dv) + u * factor;
+      for (uint32_t du = 0; du < factor; ++du) {
+        if (DepthTraits<T>::valid(block[du])) {
+          samples[count++] = block[du];
+        }
+      }
+    }
+    if (count == 0) {
+      out[u] = fallback;  // not valid either
+      continue;
+    }
+    // Lower median, so the result is always one of the measured depths
+    auto middle = samples.begin() + (count - 1) / 2;
+    std::nth_element(samples.begin(), middle, samples.begin() + count);
+    out[u] = *middle;
+  }
+}
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__DECIMATION_HPP_
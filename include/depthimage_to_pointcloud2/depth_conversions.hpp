@@ -36,13 +36,33 @@
 #ifndef DEPTHIMAGE_TO_POINTCLOUD2__DEPTH_CONVERSIONS_HPP_
 #define DEPTHIMAGE_TO_POINTCLOUD2__DEPTH_CONVERSIONS_HPP_
 
+#include "depthimage_to_pointcloud2/color_samplers.hpp"
+#include "depthimage_to_pointcloud2/decimation.hpp"
+#include "depthimage_to_pointcloud2/depth_filters.hpp"
 #include "depthimage_to_pointcloud2/depth_traits.hpp"
+#include "depthimage_to_pointcloud2/point_formats.hpp"
+#include "depthimage_to_pointcloud2/projection_cache.hpp"
+#include "depthimage_to_pointcloud2/region_of_interest.hpp"
+#include "depthimage_to_pointcloud2/rigid_transform.hpp"
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+#include "depthimage_to_pointcloud2/surface_normals.hpp"
+#include "depthimage_to_pointcloud2/voxel_grid.hpp"
+#include "depthimage_to_pointcloud2/worker_pool.hpp"
 
 #include <image_geometry/pinhole_camera_model.h>
 #include <sensor_msgs/msg/image.hpp>
 #include <sensor_msgs/point_cloud2_iterator.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
 #include <limits>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -50,84 +70,483 @@
 namespace depthimage_to_pointcloud2
 {
 
-// Handles float or uint16 depths
-template<typename T>
+// Packs the good points of a projected row to out, returns how many were written
+template<typename Format>
+inline uint32_t compactRow(
+  const uint8_t * row, uint32_t width, uint32_t max_points,
+  const typename Format::Packer & pack, uint8_t * out)
+{
+  uint32_t count = 0;
+  for (uint32_t u = 0; u < width && count < max_points; ++u, row += kPointStep) {
+    if (!std::isnan(reinterpret_cast<const float *>(row)[2])) {
+      pack(row, out + count * Format::point_step);
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Packs all count points in the kernel layout at points to out
+template<typename Format>
+inline void packPoints(
+  const uint8_t * points, uint32_t count, const typename Format::Packer & pack, uint8_t * out)
+{
+  for (uint32_t i = 0; i < count; ++i, points += kPointStep, out += Format::point_step) {
+    pack(points, out);
+  }
+}
+
+struct ConversionOptions
+{
+  // Multiplies the unit of the depth type, see RowLimits
+  double depth_scale = 1.0;
+  double range_max = 0.0;
+  bool use_quiet_nan = false;
+  // Only write the good points, as a single row cloud (height 1, is_dense true)
+  bool output_dense = false;
+  // Reduce each decimation x decimation block of depth pixels to one point
+  uint32_t decimation = 1;
+  DecimationMode decimation_mode = DecimationMode::STRIDE;
+  // If > 0, publish one centroid per occupied voxel of this size (in meters)
+  // instead of the points themselves; the cloud is a single row like output_dense
+  float voxel_size = 0.0f;
+  // Only the depth pixels in roi are converted, and the organized cloud has its size
+  PixelRoi roi;
+  // Points nearer than this (z in the depth image's frame, in meters) are invalid
+  double range_min = 0.0;
+  // Points outside this box, in the frame of the cloud (after transform), are invalid
+  CropBox crop_box;
+  // If set, the depths are filtered row by row right before they are projected,
+  // see DepthFilter. Not owned; its temporal state is updated.
+  DepthFilter * filter = nullptr;
+  // For formats with normals: neighbors farther from a point than this times its
+  // distance to the camera are not used for its normal, see NormalEstimator
+  float normal_max_depth_change = 0.05f;
+  // Meters per count of the PointXYZQuantized format
+  float quantization_scale = 0.001f;
+  // If set, points are moved by transform (from the depth image's frame to the
+  // frame the cloud is published in) right after being projected and colored
+  bool transform_points = false;
+  RigidTransform transform;
+};
+
+// Handles depths of any type with DepthTraits. cloud_msg must have been set up with
+// Format::setFields() (see prepareCloud()) for the projection's output size; in
+// output_dense mode it is shrunk to the number of good points, or with voxel_size
+// to the number of voxels. With roi, range_min or crop_box only a window of the
+// projection's grid is converted (see pixelWindow()), and the organized cloud has
+// its size. With a filter the depths are filtered as they are read. With
+// decimation the depth image is first reduced
+// into a small buffer, which projection must have been decimated() for.
+// Formats with normals get them from the rows above and below, projected into a
+// sliding window of three rows; they cannot be combined with voxel_size.
+// The points are always projected in the PointXYZRGB layout; other formats are
+// packed from a row buffer while it is still in cache.
+// Each row goes through the fastest row kernel the CPU supports, see row_kernels.hpp.
+// If a pool is given the rows are split into one band per pool thread; the output
+// is the same either way.
+// Points are colored from color if it has an image, see ColorSource.
+template<typename T, typename Format = PointXYZRGB>
 void convert(
   const sensor_msgs::msg::Image::ConstSharedPtr & depth_msg,
-  sensor_msgs::msg::PointCloud2::SharedPtr & cloud_msg,
-  const image_geometry::PinholeCameraModel & model,
-  double range_max = 0.0,
-  bool use_quiet_nan = false,
- cv_bridge::CvImageConstPtr cv_ptr = nullptr)
+  sensor_msgs::msg::PointCloud2 & cloud_msg,
+  const ProjectionCache & projection,
+  const ConversionOptions & options,
+  const ColorSource & color_source,
+  WorkerPool * pool = nullptr)
 {
-  // Use correct principal point from calibration
-  float center_x = model.cx();
-  float center_y = model.cy();
-
-  // Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
-  double unit_scaling = DepthTraits<T>::toMeters(T(1) );
-  float constant_x = unit_scaling / model.fx();
-  float constant_y = unit_scaling / model.fy();
-  float bad_point = std::numeric_limits<float>::quiet_NaN();
-
-  sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_msg, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(*cloud_msg, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(*cloud_msg, "z");
-  sensor_msgs::PointCloud2Iterator<float> iter_rgb(*cloud_msg, "rgb");
-  const T * depth_row = reinterpret_cast<const T *>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-  for (int v = 0; v < static_cast<int>(cloud_msg->height); ++v, depth_row += row_step) {
-    for (int u = 0; u < static_cast<int>(cloud_msg->width); ++u, ++iter_x, ++iter_y, ++iter_z, ++iter_rgb) {
-      T depth = depth_row[u];
-
-      // Missing points denoted by NaNs
-      if (!DepthTraits<T>::valid(depth)) {
-        if (range_max != 0.0 && !use_quiet_nan) {
-          depth = DepthTraits<T>::fromMeters(range_max);
-        } else {
-          *iter_x = *iter_y = *iter_z = *iter_rgb = bad_point;
-          continue;
+  if (!Format::hasFields(cloud_msg)) {
+    throw std::runtime_error("Point cloud does not have the fields of the point format");
+  }
+  if (Format::has_normals && options.voxel_size > 0.0f) {
+    throw std::runtime_error("Voxel centroids have no normals");
+  }
+  setQuantizationScale<Format>(cloud_msg, options.quantization_scale);
+
+  const uint32_t decimation = std::max<uint32_t>(options.decimation, 1);
+  if (projection.sourceWidth() != depth_msg->width ||
+    projection.sourceHeight() != depth_msg->height ||
+    projection.decimation() != decimation)
+  {
+    throw std::runtime_error("Projection tables do not match the depth image");
+  }
+
+  static const RowKernel<T> project_row = selectRowKernel<T>(detectSimdLevel());
+  static const RectifiedRowKernel<T> project_rectified_row =
+    selectRectifiedRowKernel<T>(detectSimdLevel());
+  const RowLimits limits = RowLimits::make<T>(
+    options.range_max, options.use_quiet_nan, options.depth_scale);
+  const typename Format::Packer pack(options.quantization_scale);
+  const ColorSource color = Format::has_rgb ? color_source : ColorSource();
+  const PointTransformer transformer(options.transform);
+
+  // range_min clips in the frame of the depth image, crop_box in the frame of
+  // the cloud. Rows and columns that can have no point in either are skipped.
+  CropBox near_box;
+  near_box.min[2] = static_cast<float>(options.range_min);
+  const bool clip_near = options.range_min > 0.0;
+  const bool clip_box = options.crop_box.bounded();
+  const BoxClipper near_clipper(near_box);
+  const BoxClipper box_clipper(options.crop_box);
+  const CropBox camera_box = near_box.intersected(
+    options.transform_points ?
+    options.crop_box.transformed(options.transform.inverse()) : options.crop_box);
+  const PixelWindow window = pixelWindow(projection, options.roi, camera_box);
+  const uint32_t width = window.width();
+  const uint32_t height = window.height();
+  const float * ray_x = projection.rayX() + window.u_begin;
+
+  auto run_rows = [pool](size_t rows, const WorkerPool::BandFunction & fn) {
+      if (pool != nullptr) {
+        pool->parallelFor(0, rows, fn);
+      } else {
+        fn(0, rows);
+      }
+    };
+  // Bands whose results are used after run_rows() returns keep them in slots of
+  // buffers the calling thread owns, never in storage of the pool's threads: the
+  // pool may be shared by several cameras, and its threads go on to another
+  // convert() as soon as parallelFor() returns. The bands are merged in the order
+  // of their first rows, whichever claimed its slot first.
+  const size_t max_bands = pool != nullptr ? pool->size() : 1;
+  std::mutex bands_mutex;
+  std::vector<std::pair<size_t, size_t>> bands;  // first row, slot
+  auto claim_band = [&](size_t v_begin) {
+      std::lock_guard<std::mutex> lock(bands_mutex);
+      bands.emplace_back(v_begin, bands.size());
+      return bands.back().second;
+    };
+
+  // Rows are numbered from the top of the window from here on
+  const uint8_t * depth_data = &depth_msg->data[0] +
+    static_cast<size_t>(window.v_begin) * decimation * depth_msg->step +
+    static_cast<size_t>(window.u_begin) * decimation * sizeof(T);
+  size_t depth_step = depth_msg->step;
+  int color_stride = 1;
+  int color_offset = 0;
+  if (decimation > 1 && !window.empty()) {
+    // Reduce the window into a width x height buffer up front, so the passes
+    // below never touch the full resolution depth image again
+    thread_local std::vector<T> decimated;
+    decimated.resize(static_cast<size_t>(width) * height);
+    T * decimated_data = decimated.data();
+    run_rows(height, [&](size_t v_begin, size_t v_end) {
+        for (size_t v = v_begin; v < v_end; ++v) {
+          decimateRow(
+            depth_data, depth_step, static_cast<uint32_t>(v), width, decimation,
+            options.decimation_mode, decimated_data + v * width);
         }
-      } else if (range_max != 0.0) {
-        T depth_max = DepthTraits<T>::fromMeters(range_max);
-        if (depth > depth_max) {
-          if (use_quiet_nan) {
-            *iter_x = *iter_y = *iter_z = *iter_rgb = bad_point;
-            continue;
-          } else {
-            depth = depth_max;
-          }
+      });
+    depth_data = reinterpret_cast<const uint8_t *>(decimated_data);
+    depth_step = width * sizeof(T);
+    color_stride = static_cast<int>(decimation);
+    color_offset = decimationSamplesBlockCenter(options.decimation_mode) ? color_stride / 2 : 0;
+  }
+  auto depth_row = [&](size_t v) {
+      return reinterpret_cast<const T *>(depth_data + v * depth_step);
+    };
+  DepthFilter * const filter = options.filter;
+  // The filter that project() runs on every row it reads
+  DepthFilter * row_filter = filter;
+  if (filter != nullptr) {
+    filter->beginFrame(projection.width(), projection.height());
+  }
+  if (Format::has_normals && filter != nullptr && !window.empty()) {
+    // The bands of formats with normals also project the row above them, which the
+    // band above has already projected; filtering it twice would update its
+    // temporal state twice, from two threads. So here the window is filtered
+    // once up front, every row by one band, and projected from that buffer.
+    thread_local std::vector<T> filtered_image;
+    filtered_image.resize(static_cast<size_t>(width) * height);
+    T * filtered_data = filtered_image.data();
+    run_rows(height, [&](size_t v_begin, size_t v_end) {
+        for (size_t v = v_begin; v < v_end; ++v) {
+          filter->filterRow<T>(
+            v > 0 ? depth_row(v - 1) : nullptr, depth_row(v),
+            v + 1 < height ? depth_row(v + 1) : nullptr, width, window.u_begin,
+            window.v_begin + static_cast<uint32_t>(v), filtered_data + v * width);
+        }
+      });
+    depth_data = reinterpret_cast<const uint8_t *>(filtered_data);
+    depth_step = width * sizeof(T);
+    row_filter = nullptr;
+  }
+  // Filters, projects, colors, transforms and clips row v of the window into out
+  auto project = [&](size_t v, uint8_t * out) {
+      const uint32_t grid_v = window.v_begin + static_cast<uint32_t>(v);
+      const T * depth = depth_row(v);
+      if (row_filter != nullptr) {
+        // The neighboring rows were just read for the rows before and after
+        thread_local std::vector<T> filtered;
+        filtered.resize(width);
+        row_filter->filterRow<T>(
+          v > 0 ? depth_row(v - 1) : nullptr, depth, v + 1 < height ? depth_row(v + 1) : nullptr,
+          width, window.u_begin, grid_v, filtered.data());
+        depth = filtered.data();
+      }
+      if (projection.rectified()) {
+        project_rectified_row(
+          depth, projection.rayX(grid_v) + window.u_begin,
+          projection.rayYRow(grid_v) + window.u_begin, width, limits, out);
+      } else {
+        project_row(depth, ray_x, projection.rayY(grid_v), width, limits, out);
+      }
+      if (color) {
+        color.colorizeRow(
+          static_cast<int>(grid_v), static_cast<int>(width), out, color_stride, color_offset,
+          static_cast<int>(window.u_begin));
+      }
+      if (clip_near) {
+        near_clipper.clipRow(out, width);
+      }
+      if (options.transform_points) {
+        transformer.transformRow(out, width);
+      }
+      if (clip_box) {
+        box_clipper.clipRow(out, width);
+      }
+    };
 
+  // The camera, in the frame of the cloud, which the normals face
+  std::array<float, 3> viewpoint = {{0.0f, 0.0f, 0.0f}};
+  if (options.transform_points) {
+    for (int i = 0; i < 3; ++i) {
+      viewpoint[i] = static_cast<float>(options.transform.translation[i]);
+    }
+  }
+  const NormalEstimator normals(viewpoint, options.normal_max_depth_change);
+  // Projects row v into buffer and returns the points, bands calling it for their
+  // rows in order, first for the first one. Formats with normals instead keep the
+  // last three rows of the band in a window, so row v gets its normals from the
+  // row before and the one after; across the edge of a band a row is projected
+  // twice, from depths that were filtered once.
+  auto project_points = [&](size_t v, uint8_t * buffer, bool first) -> const uint8_t * {
+      if (!Format::has_normals) {
+        project(v, buffer);
+        return buffer;
+      }
+      const size_t row_size = static_cast<size_t>(width) * kPointStep;
+      thread_local std::vector<uint8_t> rows;
+      rows.resize(3 * row_size);
+      auto slot = [&](size_t row) {return rows.data() + (row % 3) * row_size;};
+      if (first) {
+        if (v > 0) {
+          project(v - 1, slot(v - 1));
         }
+        project(v, slot(v));
       }
+      if (v + 1 < height) {
+        project(v + 1, slot(v + 1));
+      }
+      normals.estimateRow(
+        v > 0 ? slot(v - 1) : nullptr, slot(v), v + 1 < height ? slot(v + 1) : nullptr, width);
+      return slot(v);
+    };
+
+  if (options.voxel_size > 0.0f) {
+    // Every band bins its points into its own grid straight from the row buffer,
+    // the grids are then merged in band order
+    thread_local std::vector<VoxelGrid> band_grids;
+    band_grids.resize(std::max(band_grids.size(), max_bands));
+    VoxelGrid * const grids = band_grids.data();
+    run_rows(height, [&](size_t v_begin, size_t v_end) {
+        thread_local std::vector<uint8_t> row_buffer;
+        VoxelGrid & band_grid = grids[claim_band(v_begin)];
+        row_buffer.resize(static_cast<size_t>(width) * kPointStep);
+        band_grid.reset(options.voxel_size);
+        for (size_t v = v_begin; v < v_end; ++v) {
+          project(v, row_buffer.data());
+          const uint8_t * point = row_buffer.data();
+          for (uint32_t u = 0; u < width; ++u, point += kPointStep) {
+            if (!std::isnan(reinterpret_cast<const float *>(point)[2])) {
+              band_grid.add(point);
+            }
+          }
+        }
+      });
+    std::sort(bands.begin(), bands.end());
+
+    thread_local VoxelGrid grid;
+    grid.reset(options.voxel_size);
+    for (const auto & band : bands) {
+      grid.merge(grids[band.second]);
+    }
+
+    cloud_msg.height = 1;
+    cloud_msg.width = static_cast<uint32_t>(grid.size());
+    cloud_msg.is_dense = true;
+    cloud_msg.row_step = cloud_msg.width * Format::point_step;
+    cloud_msg.data.resize(static_cast<size_t>(cloud_msg.row_step));
+    if (grid.size() == 0) {
+      return;
+    }
+    if (Format::is_kernel_layout) {
+      grid.writeCentroids(&cloud_msg.data[0]);
+    } else {
+      thread_local std::vector<uint8_t> centroids;
+      centroids.resize(grid.size() * kPointStep);
+      grid.writeCentroids(centroids.data());
+      packPoints<Format>(centroids.data(), cloud_msg.width, pack, &cloud_msg.data[0]);
+    }
+    return;
+  }
 
-      // Fill in XYZ
-      *iter_x = (u - center_x) * depth * constant_x;
-      *iter_y = (v - center_y) * depth * constant_y;
-      *iter_z = DepthTraits<T>::toMeters(depth);
-      
-      // and RGB
-      int rgb = 0x000000;
-      if (cv_ptr != nullptr) {
-        if (cv_ptr->image.type()==CV_8UC1) {
-          //grayscale
-          rgb &= cv_ptr->image.at<uchar>(v,u);
-        } else if(cv_ptr->image.type()==CV_8UC3) {
-          //RGB
-          rgb = (int)cv_ptr->image.at<cv::Vec3b>(0, 0)[0];
-          
-        } else if(cv_ptr->image.type()==CV_8UC3 || cv_ptr->image.type()==CV_8UC4) {
-          //RGB or RGBA
-          if (cv_ptr->image.rows > v && cv_ptr->image.cols > u){
-            rgb |= ((int)cv_ptr->image.at<cv::Vec4b>(v, u)[2]) << 16;
-            rgb |= ((int)cv_ptr->image.at<cv::Vec4b>(v, u)[1]) << 8;
-            rgb |= ((int)cv_ptr->image.at<cv::Vec4b>(v, u)[0]);
+  if (!options.output_dense) {
+    // The organized cloud has the size of the window
+    cloud_msg.height = height;
+    cloud_msg.width = width;
+    cloud_msg.row_step = width * Format::point_step;
+    cloud_msg.data.resize(static_cast<size_t>(cloud_msg.row_step) * height);
+    if (window.empty()) {
+      return;
+    }
+    uint8_t * cloud_data = &cloud_msg.data[0];
+    const size_t cloud_step = cloud_msg.row_step;
+    run_rows(height, [&](size_t v_begin, size_t v_end) {
+        thread_local std::vector<uint8_t> row_buffer;
+        if (!Format::is_kernel_layout) {
+          row_buffer.resize(static_cast<size_t>(width) * kPointStep);
+        }
+        for (size_t v = v_begin; v < v_end; ++v) {
+          uint8_t * out = cloud_data + v * cloud_step;
+          const uint8_t * points =
+            project_points(v, Format::is_kernel_layout ? out : row_buffer.data(), v == v_begin);
+          if (!Format::is_kernel_layout) {
+            packPoints<Format>(points, width, pack, out);
           }
         }
+      });
+    return;
+  }
+
+  cloud_msg.height = 1;
+  cloud_msg.is_dense = true;
+  if (clip_near || clip_box || filter != nullptr) {
+    // Which points survive clipping and filtering is only known after
+    // projecting, so every band compacts its rows into a buffer of its own,
+    // which are then copied into the cloud in band order
+    thread_local std::vector<std::vector<uint8_t>> band_points;
+    band_points.resize(std::max(band_points.size(), max_bands));
+    std::vector<uint8_t> * const band_buffers = band_points.data();
+    run_rows(height, [&](size_t v_begin, size_t v_end) {
+        thread_local std::vector<uint8_t> row_buffer;
+        std::vector<uint8_t> & points = band_buffers[claim_band(v_begin)];
+        row_buffer.resize(static_cast<size_t>(width) * kPointStep);
+        points.resize((v_end - v_begin) * width * Format::point_step);
+        size_t count = 0;
+        for (size_t v = v_begin; v < v_end; ++v) {
+          count += compactRow<Format>(
+            project_points(v, row_buffer.data(), v == v_begin), width, width, pack,
+            points.data() + count * Format::point_step);
+        }
+        points.resize(count * Format::point_step);
+      });
+    std::sort(bands.begin(), bands.end());
+
+    size_t size = 0;
+    for (const auto & band : bands) {
+      size += band_buffers[band.second].size();
+    }
+    cloud_msg.width = static_cast<uint32_t>(size / Format::point_step);
+    cloud_msg.row_step = static_cast<uint32_t>(size);
+    cloud_msg.data.resize(size);
+    size_t offset = 0;
+    for (const auto & band : bands) {
+      const std::vector<uint8_t> & points = band_buffers[band.second];
+      if (!points.empty()) {
+        std::memcpy(&cloud_msg.data[offset], points.data(), points.size());
+        offset += points.size();
       }
-      *iter_rgb = *reinterpret_cast<float*>(&rgb);
     }
+    return;
+  }
+
+  // Dense output in two passes: count the good points of every row, so that each
+  // row knows where its points go, then project and compact the rows in parallel.
+  std::vector<uint32_t> row_offsets(height + 1, 0);
+  run_rows(height, [&](size_t v_begin, size_t v_end) {
+      for (size_t v = v_begin; v < v_end; ++v) {
+        row_offsets[v + 1] = countGoodPoints(depth_row(v), width, limits);
+      }
+    });
+  std::partial_sum(row_offsets.begin(), row_offsets.end(), row_offsets.begin());
+  const uint32_t num_points = row_offsets[height];
+
+  cloud_msg.width = num_points;
+  cloud_msg.row_step = num_points * Format::point_step;
+  cloud_msg.data.resize(static_cast<size_t>(cloud_msg.row_step));
+  if (num_points == 0) {
+    return;
   }
+
+  uint8_t * cloud_data = &cloud_msg.data[0];
+  run_rows(height, [&](size_t v_begin, size_t v_end) {
+      thread_local std::vector<uint8_t> row_buffer;
+      row_buffer.resize(static_cast<size_t>(width) * kPointStep);
+      for (size_t v = v_begin; v < v_end; ++v) {
+        compactRow<Format>(
+          project_points(v, row_buffer.data(), v == v_begin), width,
+          row_offsets[v + 1] - row_offsets[v], pack,
+          cloud_data + static_cast<size_t>(row_offsets[v]) * Format::point_step);
+      }
+    });
+}
+
+// Colors the points from a color image pixel-aligned with the depth image
+template<typename T, typename Format = PointXYZRGB>
+void convert(
+  const sensor_msgs::msg::Image::ConstSharedPtr & depth_msg,
+  sensor_msgs::msg::PointCloud2 & cloud_msg,
+  const ProjectionCache & projection,
+  const ConversionOptions & options,
+  const cv_bridge::CvImageConstPtr & cv_ptr = nullptr,
+  WorkerPool * pool = nullptr)
+{
+  convert<T, Format>(depth_msg, cloud_msg, projection, options, ColorSource(cv_ptr), pool);
+}
+
+template<typename T>
+void convert(
+  const sensor_msgs::msg::Image::ConstSharedPtr & depth_msg,
+  sensor_msgs::msg::PointCloud2 & cloud_msg,
+  const ProjectionCache & projection,
+  double range_max = 0.0,
+  bool use_quiet_nan = false,
+  cv_bridge::CvImageConstPtr cv_ptr = nullptr,
+  WorkerPool * pool = nullptr)
+{
+  ConversionOptions options;
+  options.range_max = range_max;
+  options.use_quiet_nan = use_quiet_nan;
+  convert<T>(depth_msg, cloud_msg, projection, options, cv_ptr, pool);
+}
+
+template<typename T>
+void convert(
+  const sensor_msgs::msg::Image::ConstSharedPtr & depth_msg,
+  sensor_msgs::msg::PointCloud2::SharedPtr & cloud_msg,
+  const ProjectionCache & projection,
+  double range_max = 0.0,
+  bool use_quiet_nan = false,
+  cv_bridge::CvImageConstPtr cv_ptr = nullptr,
+  WorkerPool * pool = nullptr)
+{
+  convert<T>(depth_msg, *cloud_msg, projection, range_max, use_quiet_nan, cv_ptr, pool);
+}
+
+// Convenience overload that derives the ray tables from model on every call.
+// Prefer keeping a ProjectionCache around when converting a stream of images.
+template<typename T>
+void convert(
+  const sensor_msgs::msg::Image::ConstSharedPtr & depth_msg,
+  sensor_msgs::msg::PointCloud2::SharedPtr & cloud_msg,
+  const image_geometry::PinholeCameraModel & model,
+  double range_max = 0.0,
+  bool use_quiet_nan = false,
+  cv_bridge::CvImageConstPtr cv_ptr = nullptr)
+{
+  ProjectionCache projection(model, cloud_msg->width, cloud_msg->height);
+  convert<T>(depth_msg, *cloud_msg, projection, range_max, use_quiet_nan, cv_ptr);
 }
 
 }  // namespace depthimage_to_pointcloud2
@@ -0,0 +1,253 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__DEPTH_FILTERS_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__DEPTH_FILTERS_HPP_
+
+#include "depthimage_to_pointcloud2/depth_traits.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// All thresholds are relative to the depth of the pixel being filtered, so they
+// hold for any depth type and scale
+struct DepthFilterOptions
+{
+  // Edge-preserving smoothing: each depth becomes the mean of itself and those of
+  // its 3x3 neighbors within spatial_delta of it (e.g. 0.02 for 2 %), so edges
+  // are not blurred into the background. 0 disables it.
+  float spatial_delta = 0.0f;
+  // Flying pixels, the depths ToF cameras mix from both sides of an edge, have
+  // fewer than two of their 8 neighbors within flying_pixel_threshold of them
+  // and are removed. 0 disables it.
+  float flying_pixel_threshold = 0.0f;
+  // Exponential smoothing over frames: state += temporal_alpha * (depth - state).
+  // A depth more than temporal_delta off the state restarts it, so moving things
+  // do not leave trails. 1 disables it.
+  float temporal_alpha = 1.0f;
+  float temporal_delta = 0.05f;
+
+  bool spatial() const {return spatial_delta > 0.0f;}
+  bool flyingPixels() const {return flying_pixel_threshold > 0.0f;}
+  bool temporal() const {return temporal_alpha < 1.0f;}
+  bool enabled() const {return spatial() || flyingPixels() || temporal();}
+};
+
+// Filters depth rows right before they are projected, from the row and its two
+// neighbors, which the conversion sweep has just read anyway; the image is only
+// filtered as a pass of its own for formats with normals, which project some
+// rows twice. Keeps the temporal state, one depth per pixel of the projection
+// grid, from frame to frame; every row must be filtered once per frame.
+class DepthFilter
+{
+public:
+  explicit DepthFilter(const DepthFilterOptions & options)
+  : options_(options) {}
+
+  const DepthFilterOptions & options() const {return options_;}
+
+  // Before every frame, with the size of the projection grid. The temporal state
+  // restarts whenever it changes.
+  void beginFrame(uint32_t grid_width, uint32_t grid_height)
+  {
+    if (!options_.temporal()) {
+      return;
+    }
+    if (grid_width != grid_width_ || grid_height != grid_height_) {
+      grid_width_ = grid_width;
+      grid_height_ = grid_height;
+      state_.assign(
+        static_cast<size_t>(grid_width) * grid_height, std::numeric_limits<float>::quiet_NaN());
+    }
+  }
+
+  // Filters the width depths of row into out. above and below are the rows next
+  // to it, nullptr at the edge of what is converted; (grid_u, grid_v) is where
+  // the row starts on the projection grid. Different rows may be filtered in
+  // parallel.
+  template<typename T>
+  void filterRow(
+    const T * above, const T * row, const T * below, uint32_t width,
+    uint32_t grid_u, uint32_t grid_v, T * out)
+  {
+    // The rows as floats, NaN where there is no depth, which then fails every
+    // comparison by itself; the loops below have no branches on the depths, which
+    // are noise as far as the branch predictor is concerned
+    thread_local std::vector<float> rows;
+    thread_local std::vector<float> values;
+    rows.resize(3 * static_cast<size_t>(width));
+    values.resize(width);
+    float * const above_depths = above != nullptr ? rows.data() : nullptr;
+    float * const depths = rows.data() + width;
+    float * const below_depths = below != nullptr ? rows.data() + 2 * width : nullptr;
+    toFloat(row, width, depths);
+    if (!options_.spatial() && !options_.flyingPixels()) {
+      std::copy(depths, depths + width, values.data());
+    } else {
+      if (above_depths != nullptr) {
+        toFloat(above, width, above_depths);
+      }
+      if (below_depths != nullptr) {
+        toFloat(below, width, below_depths);
+      }
+      filterPixels(above_depths, depths, below_depths, width, values.data());
+    }
+
+    const T invalid = std::numeric_limits<T>::quiet_NaN();  // 0 for integers
+    if (!options_.temporal()) {
+      for (uint32_t u = 0; u < width; ++u) {
+        out[u] = std::isnan(values[u]) ? invalid : fromFloat<T>(values[u]);
+      }
+      return;
+    }
+    float * state = state_.data() + static_cast<size_t>(grid_v) * grid_width_ + grid_u;
+    const float alpha = options_.temporal_alpha;
+    const float delta = options_.temporal_delta;
+    for (uint32_t u = 0; u < width; ++u) {
+      float value = values[u];
+      const float previous = state[u];
+      // NaN, i.e. no depth or no state, fails the comparison too
+      if (std::fabs(value - previous) <= delta * previous) {
+        value = previous + alpha * (value - previous);
+      }
+      state[u] = value;
+      out[u] = std::isnan(value) ? invalid : fromFloat<T>(value);
+    }
+  }
+
+private:
+  template<typename T>
+  static void toFloat(const T * depths, uint32_t width, float * out)
+  {
+    const float bad_point = std::numeric_limits<float>::quiet_NaN();
+    for (uint32_t u = 0; u < width; ++u) {
+      out[u] = DepthTraits<T>::valid(depths[u]) ? static_cast<float>(depths[u]) : bad_point;
+    }
+  }
+
+  // The spatial filter and the flying pixel check, NaN for pixels without a depth
+  // or removed
+  void filterPixels(
+    const float * above, const float * row, const float * below, uint32_t width,
+    float * values) const
+  {
+    if (!options_.flyingPixels()) {
+      filterPixels<true, false>(above, row, below, width, values);
+    } else if (!options_.spatial()) {
+      filterPixels<false, true>(above, row, below, width, values);
+    } else {
+      filterPixels<true, true>(above, row, below, width, values);
+    }
+  }
+
+  template<bool Spatial, bool FlyingPixels>
+  void filterPixels(
+    const float * above, const float * row, const float * below, uint32_t width,
+    float * values) const
+  {
+    const float spatial_delta = options_.spatial_delta;
+    const float flying_pixel_threshold = options_.flying_pixel_threshold;
+    const float bad_point = std::numeric_limits<float>::quiet_NaN();
+    // x != x only for NaN
+    auto pixel = [&](uint32_t u, float sum, float count, float close) {
+        const float value = Spatial ? sum / count : row[u];
+        const bool keep = (row[u] == row[u]) & (!FlyingPixels | (close >= 2.0f));
+        values[u] = keep ? value : bad_point;
+      };
+
+    // The inner pixels of inner rows have all 8 neighbors; with neither ifs nor
+    // short-circuits on the depths their loop vectorizes
+    const bool inner = above != nullptr && below != nullptr && width > 2;
+    if (inner) {
+      for (uint32_t u = 1; u + 1 < width; ++u) {
+        const float depth = row[u];
+        const float spatial_limit = spatial_delta * depth;
+        const float flying_limit = flying_pixel_threshold * depth;
+        float sum = depth;
+        float count = 1.0f;
+        float close = 0.0f;
+        auto add = [&](float neighbor) {
+            const float difference = std::fabs(neighbor - depth);
+            const bool similar = difference <= spatial_limit;
+            sum += similar ? neighbor : 0.0f;
+            count += similar ? 1.0f : 0.0f;
+            close += difference <= flying_limit ? 1.0f : 0.0f;
+          };
+        add(above[u - 1]);
+        add(above[u]);
+        add(above[u + 1]);
+        add(row[u - 1]);
+        add(row[u + 1]);
+        add(below[u - 1]);
+        add(below[u]);
+        add(below[u + 1]);
+        pixel(u, sum, count, close);
+      }
+    }
+    // The edges check which of their neighbors there are
+    for (uint32_t u = 0; u < width; u = (inner && u == 0) ? width - 1 : u + 1) {
+      const float depth = row[u];
+      float sum = depth;
+      float count = 1.0f;
+      float close = 0.0f;
+      const uint32_t u_begin = u > 0 ? u - 1 : 0;
+      const uint32_t u_end = u + 1 < width ? u + 2 : width;
+      for (const float * neighbors : {above, row, below}) {
+        for (uint32_t n = u_begin; neighbors != nullptr && n < u_end; ++n) {
+          if (neighbors == row && n == u) {
+            continue;
+          }
+          const float difference = std::fabs(neighbors[n] - depth);
+          if (difference <= spatial_delta * depth) {
+            sum += neighbors[n];
+            count += 1.0f;
+          }
+          if (difference <= flying_pixel_threshold * depth) {
+            close += 1.0f;
+          }
+        }
+      }
+      pixel(u, sum, count, close);
+    }
+  }
+
+  template<typename T>
+  static typename std::enable_if<std::is_integral<T>::value, T>::type fromFloat(float value)
+  {
+    return static_cast<T>(value + 0.5f);
+  }
+
+  template<typename T>
+  static typename std::enable_if<!std::is_integral<T>::value, T>::type fromFloat(float value)
+  {
+    return static_cast<T>(value);
+  }
+
+  const DepthFilterOptions options_;
+  std::vector<float> state_;
+  uint32_t grid_width_ = 0;
+  uint32_t grid_height_ = 0;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__DEPTH_FILTERS_HPP_
@@ -46,7 +46,9 @@
 namespace depthimage_to_pointcloud2
 {
 
-// Encapsulate differences between processing float and uint16_t depths
+// Encapsulate differences between processing float and integer depths. toMeters()
+// is the unit of the encoding when depth_scale is 1: millimeters for integers,
+// meters for floats.
 template<typename T>
 struct DepthTraits {};
 
@@ -59,6 +61,16 @@ struct DepthTraits<uint16_t>
   static inline void initializeBuffer(std::vector<uint8_t> &) {}  // Do nothing
 };
 
+// 32SC1, in millimeters like 16UC1; negative depths are invalid
+template<>
+struct DepthTraits<int32_t>
+{
+  static inline bool valid(int32_t depth) {return depth > 0;}
+  static inline float toMeters(int32_t depth) {return depth * 0.001f;}
+  static inline int32_t fromMeters(float depth) {return (depth * 1000.0f) + 0.5f;}
+  static inline void initializeBuffer(std::vector<uint8_t> &) {}  // Do nothing
+};
+
 template<>
 struct DepthTraits<float>
 {
@@ -74,6 +86,22 @@ struct DepthTraits<float>
   }
 };
 
+// 64FC1, projected in single precision like the other types
+template<>
+struct DepthTraits<double>
+{
+  static inline bool valid(double depth) {return std::isfinite(depth);}
+  static inline float toMeters(double depth) {return static_cast<float>(depth);}
+  static inline double fromMeters(float depth) {return depth;}
+
+  static inline void initializeBuffer(std::vector<uint8_t> & buffer)
+  {
+    double * start = reinterpret_cast<double *>(&buffer[0]);
+    double * end = reinterpret_cast<double *>(&buffer[0] + buffer.size());
+    std::fill(start, end, std::numeric_limits<double>::quiet_NaN());
+  }
+};
+
 }  // namespace depthimage_to_pointcloud2
 
 #endif  // DEPTHIMAGE_TO_POINTCLOUD2__DEPTH_TRAITS_HPP_
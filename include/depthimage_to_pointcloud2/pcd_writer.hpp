@@ -0,0 +1,174 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__PCD_WRITER_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__PCD_WRITER_HPP_
+
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <sensor_msgs/msg/point_field.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+namespace detail
+{
+
+// PCD TYPE and SIZE of a PointField datatype
+inline bool pcdType(uint8_t datatype, char & type, uint32_t & size)
+{
+  using sensor_msgs::msg::PointField;
+  switch (datatype) {
+    case PointField::INT8: type = 'I'; size = 1; return true;
+    case PointField::UINT8: type = 'U'; size = 1; return true;
+    case PointField::INT16: type = 'I'; size = 2; return true;
+    case PointField::UINT16: type = 'U'; size = 2; return true;
+    case PointField::INT32: type = 'I'; size = 4; return true;
+    case PointField::UINT32: type = 'U'; size = 4; return true;
+    case PointField::FLOAT32: type = 'F'; size = 4; return true;
+    case PointField::FLOAT64: type = 'F'; size = 8; return true;
+    default: return false;
+  }
+}
+
+}  // namespace detail
+
+// The header of a binary PCD (v0.7) file holding cloud as it is. Gaps between
+// the fields are "_" fields of bytes, the way PCL writes the padding of its own
+// point types, so the data is the cloud's byte for byte.
+inline std::string pcdHeader(const sensor_msgs::msg::PointCloud2 & cloud)
+{
+  if (cloud.is_bigendian) {
+    throw std::runtime_error("PCD files are little endian");
+  }
+  std::vector<sensor_msgs::msg::PointField> fields(cloud.fields.begin(), cloud.fields.end());
+  std::sort(
+    fields.begin(), fields.end(),
+    [](const sensor_msgs::msg::PointField & a, const sensor_msgs::msg::PointField & b)
+    {return a.offset < b.offset;});
+
+  std::ostringstream names;
+  std::ostringstream sizes;
+  std::ostringstream types;
+  std::ostringstream counts;
+  auto add = [&](const std::string & name, uint32_t size, char type, uint32_t count) {
+      names << ' ' << name;
+      sizes << ' ' << size;
+      types << ' ' << type;
+      counts << ' ' << count;
+    };
+  uint32_t offset = 0;
+  for (const auto & field : fields) {
+    if (field.count == 0) {
+      // Describes the cloud rather than holding data, like the scale of
+      // PointXYZQuantized
+      continue;
+    }
+    char type;
+    uint32_t size;
+    if (!detail::pcdType(field.datatype, type, size)) {
+      throw std::runtime_error("PCD files cannot hold field " + field.name);
+    }
+    if (field.offset < offset) {
+      throw std::runtime_error("Field " + field.name + " overlaps another one");
+    }
+    if (field.offset > offset) {
+      add("_", 1, 'U', field.offset - offset);
+    }
+    add(field.name, size, type, field.count);
+    offset = field.offset + size * field.count;
+  }
+  if (offset > cloud.point_step) {
+    throw std::runtime_error("Fields do not fit into point_step");
+  }
+  if (offset < cloud.point_step) {
+    add("_", 1, 'U', cloud.point_step - offset);
+  }
+
+  std::ostringstream header;
+  header << "# .PCD v0.7 - Point Cloud Data file format\n" <<
+    "VERSION 0.7\n" <<
+    "FIELDS" << names.str() << '\n' <<
+    "SIZE" << sizes.str() << '\n' <<
+    "TYPE" << types.str() << '\n' <<
+    "COUNT" << counts.str() << '\n' <<
+    "WIDTH " << cloud.width << '\n' <<
+    "HEIGHT " << cloud.height << '\n' <<
+    "VIEWPOINT 0 0 0 1 0 0 0\n" <<
+    "POINTS " << static_cast<uint64_t>(cloud.width) * cloud.height << '\n' <<
+    "DATA binary\n";
+  return header.str();
+}
+
+// Writes cloud to a binary PCD file at path. The file is allocated up front and
+// mapped, so the points are copied into the page cache once, without a write
+// buffer in between. Errors throw std::runtime_error.
+inline void writePcd(const sensor_msgs::msg::PointCloud2 & cloud, const std::string & path)
+{
+  const std::string header = pcdHeader(cloud);
+  const size_t row_size = static_cast<size_t>(cloud.width) * cloud.point_step;
+  if (cloud.height > 0 && (cloud.row_step < row_size ||
+    cloud.data.size() < static_cast<size_t>(cloud.row_step) * (cloud.height - 1) + row_size))
+  {
+    throw std::runtime_error("Point cloud data is smaller than its size");
+  }
+  const size_t size = header.size() + row_size * cloud.height;
+
+  auto fail = [&path](const char * what) {
+      throw std::runtime_error(std::string(what) + " " + path + ": " + std::strerror(errno));
+    };
+  const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fail("Cannot open");
+  }
+  // Allocated rather than only resized, so a full disk fails here instead of
+  // with a SIGBUS while copying
+  const int error = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+  if (error != 0) {
+    ::close(fd);
+    errno = error;
+    fail("Cannot allocate");
+  }
+  void * mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    ::close(fd);
+    fail("Cannot map");
+  }
+  ::close(fd);
+
+  uint8_t * out = static_cast<uint8_t *>(mapped);
+  std::memcpy(out, header.data(), header.size());
+  out += header.size();
+  for (uint32_t v = 0; v < cloud.height; ++v, out += row_size) {
+    std::memcpy(out, &cloud.data[static_cast<size_t>(v) * cloud.row_step], row_size);
+  }
+  if (::munmap(mapped, size) != 0) {
+    fail("Cannot unmap");
+  }
+}
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__PCD_WRITER_HPP_
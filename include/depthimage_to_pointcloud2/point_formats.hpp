@@ -0,0 +1,456 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__POINT_FORMATS_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__POINT_FORMATS_HPP_
+
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+#include "depthimage_to_pointcloud2/surface_normals.hpp"
+
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <sensor_msgs/msg/point_field.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Point layouts convert<T, Format>() can publish. The row kernels always write
+// the PointXYZRGB layout; any other format packs each of those points with its
+// Packer on the way into the cloud.
+//
+// Every format provides:
+//   point_step            bytes per point in the cloud
+//   has_rgb               whether the color is kept
+//   is_kernel_layout      whether kernel output can be written to the cloud as is
+//   has_normals           whether convert() estimates normals for it, see NormalEstimator
+//   setFields(cloud)      sets fields and point_step (and resizes the data)
+//   hasFields(cloud)      true if cloud already has exactly these fields
+//   Packer(scale)         converts one kernel point, see quantization_scale
+
+// True if cloud_msg has the "xyz" + "rgb" layout the row kernels write
+inline bool hasKernelLayout(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+{
+  if (cloud_msg.point_step != kPointStep || cloud_msg.fields.size() != 4) {
+    return false;
+  }
+  const char * names[] = {"x", "y", "z", "rgb"};
+  const uint32_t offsets[] = {0, 4, 8, kRgbOffset};
+  for (size_t i = 0; i < 4; ++i) {
+    if (cloud_msg.fields[i].name != names[i] || cloud_msg.fields[i].offset != offsets[i] ||
+      cloud_msg.fields[i].datatype != sensor_msgs::msg::PointField::FLOAT32)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace detail
+{
+
+// Three consecutive x, y, z fields of the given type
+inline void setXYZFields(sensor_msgs::msg::PointCloud2 & cloud_msg, uint8_t datatype)
+{
+  cloud_msg.fields.clear();
+  sensor_msgs::PointCloud2Modifier pcd_modifier(cloud_msg);
+  pcd_modifier.setPointCloud2Fields(3, "x", 1, datatype, "y", 1, datatype, "z", 1, datatype);
+}
+
+inline bool hasXYZFields(
+  const sensor_msgs::msg::PointCloud2 & cloud_msg, uint8_t datatype, uint32_t size)
+{
+  if (cloud_msg.point_step != 3 * size || cloud_msg.fields.size() != 3) {
+    return false;
+  }
+  const char * names[] = {"x", "y", "z"};
+  for (uint32_t i = 0; i < 3; ++i) {
+    const sensor_msgs::msg::PointField & field = cloud_msg.fields[i];
+    if (field.name != names[i] || field.offset != i * size || field.datatype != datatype ||
+      field.count != 1)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// IEEE 754 binary32 to binary16, rounding to nearest even
+inline uint16_t floatToHalf(float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = bits & 0x80000000u;
+  bits ^= sign;
+
+  uint32_t half;
+  if (bits >= (127u + 16u) << 23) {
+    // Too large for a half (or already infinite): infinity, NaN stays NaN
+    half = bits > 0x7f800000u ? 0x7e00u : 0x7c00u;
+  } else if (bits < 113u << 23) {
+    // Subnormal half or zero: adding 0.5 lines the 10 mantissa bits up at the
+    // bottom of the float, with the FPU doing the rounding
+    const uint32_t magic_bits = 126u << 23;
+    float magic;
+    float abs_value;
+    std::memcpy(&magic, &magic_bits, sizeof(magic));
+    std::memcpy(&abs_value, &bits, sizeof(abs_value));
+    abs_value += magic;
+    std::memcpy(&half, &abs_value, sizeof(half));
+    half -= magic_bits;
+  } else {
+    const uint32_t mantissa_odd = (bits >> 13) & 1u;
+    bits -= 112u << 23;  // rebias the exponent from 127 to 15
+    bits += 0xfffu + mantissa_odd;
+    half = bits >> 13;
+  }
+  return static_cast<uint16_t>(half | (sign >> 16));
+}
+
+// The fields of PointXYZQuantized
+// The fields of PointXYZQuantized, and the name its scale is carried in
+constexpr const char * kQuantizedPointNames[3] = {"x", "y", "z"};
+constexpr uint32_t kQuantizedPointOffsets[3] = {0, 2, 4};
+constexpr const char kScaleFieldPrefix[] = "scale=";
+
+// The fields of PointXYZRGBNormal
+constexpr const char * kNormalPointNames[8] = {
+  "x", "y", "z", "normal_x", "normal_y", "normal_z", "rgb", "curvature"};
+constexpr uint32_t kNormalPointOffsets[8] = {0, 4, 8, 16, 20, 24, 32, 36};
+
+}  // namespace detail
+
+// x, y, z and rgb as float32, padded to 32 bytes; what the kernels write
+struct PointXYZRGB
+{
+  static constexpr uint32_t point_step = kPointStep;
+  static constexpr bool has_rgb = true;
+  static constexpr bool is_kernel_layout = true;
+  static constexpr bool has_normals = false;
+
+  static void setFields(sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    cloud_msg.fields.clear();
+    cloud_msg.fields.reserve(4);
+    sensor_msgs::PointCloud2Modifier pcd_modifier(cloud_msg);
+    pcd_modifier.setPointCloud2FieldsByString(2, "xyz", "rgb");
+  }
+
+  static bool hasFields(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    return hasKernelLayout(cloud_msg);
+  }
+
+  struct Packer
+  {
+    explicit Packer(float) {}
+    void operator()(const uint8_t * point, uint8_t * out) const
+    {
+      std::memcpy(out, point, kPointStep);
+    }
+  };
+};
+
+// x, y, z as float32, 12 bytes
+struct PointXYZ
+{
+  static constexpr uint32_t point_step = 12;
+  static constexpr bool has_rgb = false;
+  static constexpr bool is_kernel_layout = false;
+  static constexpr bool has_normals = false;
+
+  static void setFields(sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    detail::setXYZFields(cloud_msg, sensor_msgs::msg::PointField::FLOAT32);
+  }
+
+  static bool hasFields(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    return detail::hasXYZFields(cloud_msg, sensor_msgs::msg::PointField::FLOAT32, 4);
+  }
+
+  struct Packer
+  {
+    explicit Packer(float) {}
+    void operator()(const uint8_t * point, uint8_t * out) const
+    {
+      std::memcpy(out, point, point_step);
+    }
+  };
+};
+
+// x, y, z as IEEE binary16, 6 bytes. PointField has no half float datatype, so
+// the fields are declared UINT16 and hold the binary16 bit patterns; consumers
+// have to know to decode them. Bad points are half NaNs.
+struct PointXYZHalf
+{
+  static constexpr uint32_t point_step = 6;
+  static constexpr bool has_rgb = false;
+  static constexpr bool is_kernel_layout = false;
+  static constexpr bool has_normals = false;
+
+  static void setFields(sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    detail::setXYZFields(cloud_msg, sensor_msgs::msg::PointField::UINT16);
+  }
+
+  static bool hasFields(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    return detail::hasXYZFields(cloud_msg, sensor_msgs::msg::PointField::UINT16, 2);
+  }
+
+  struct Packer
+  {
+    explicit Packer(float) {}
+    void operator()(const uint8_t * point, uint8_t * out) const
+    {
+      const float * xyz = reinterpret_cast<const float *>(point);
+      const uint16_t half[3] = {
+        detail::floatToHalf(xyz[0]), detail::floatToHalf(xyz[1]), detail::floatToHalf(xyz[2])};
+      std::memcpy(out, half, sizeof(half));
+    }
+  };
+};
+
+// x, y, z as int16 multiples of a scale in meters (by default millimeters,
+// i.e. +-32.767 m), 6 bytes. Bad points and coordinates out of range for the
+// scale are written as kInvalidQuantized. The scale is carried once per cloud,
+// in the name of a fourth field without any elements ("scale=0.001", count 0,
+// right after the point), so it costs no bytes per point; readers get it back
+// with quantizationScale() and tools that do not know it skip the field.
+struct PointXYZQuantized
+{
+  static constexpr uint32_t point_step = 6;
+  static constexpr bool has_rgb = false;
+  static constexpr bool is_kernel_layout = false;
+  static constexpr bool has_normals = false;
+  static constexpr int16_t kInvalidQuantized = std::numeric_limits<int16_t>::min();
+
+  // Sets the fields for the default scale, see setQuantizationScale()
+  static void setFields(sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    cloud_msg.fields.clear();
+    cloud_msg.fields.reserve(4);
+    for (size_t i = 0; i < 3; ++i) {
+      sensor_msgs::msg::PointField field;
+      field.name = detail::kQuantizedPointNames[i];
+      field.offset = detail::kQuantizedPointOffsets[i];
+      field.datatype = sensor_msgs::msg::PointField::INT16;
+      field.count = 1;
+      cloud_msg.fields.push_back(field);
+    }
+    sensor_msgs::msg::PointField scale_field;
+    scale_field.offset = point_step;
+    scale_field.datatype = sensor_msgs::msg::PointField::FLOAT32;
+    scale_field.count = 0;
+    cloud_msg.fields.push_back(scale_field);
+    setScale(cloud_msg, 0.001f);
+    cloud_msg.point_step = point_step;
+    cloud_msg.row_step = cloud_msg.width * point_step;
+    cloud_msg.data.resize(static_cast<size_t>(cloud_msg.row_step) * cloud_msg.height);
+  }
+
+  // Whatever the scale
+  static bool hasFields(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    if (cloud_msg.point_step != point_step || cloud_msg.fields.size() != 4) {
+      return false;
+    }
+    for (size_t i = 0; i < 3; ++i) {
+      const sensor_msgs::msg::PointField & field = cloud_msg.fields[i];
+      if (field.name != detail::kQuantizedPointNames[i] ||
+        field.offset != detail::kQuantizedPointOffsets[i] ||
+        field.datatype != sensor_msgs::msg::PointField::INT16 || field.count != 1)
+      {
+        return false;
+      }
+    }
+    const sensor_msgs::msg::PointField & scale_field = cloud_msg.fields[3];
+    return scale_field.name.compare(
+      0, sizeof(detail::kScaleFieldPrefix) - 1, detail::kScaleFieldPrefix) == 0 &&
+           scale_field.offset == point_step && scale_field.count == 0;
+  }
+
+  // Records scale in a cloud set up with setFields(); only renames the field when
+  // the scale changed, so recycled clouds do not allocate
+  static void setScale(sensor_msgs::msg::PointCloud2 & cloud_msg, float scale)
+  {
+    // The shortest decimal that reads back as scale
+    char name[32];
+    const size_t prefix_size = sizeof(detail::kScaleFieldPrefix) - 1;
+    for (int digits = 6; digits <= 9; ++digits) {
+      std::snprintf(name, sizeof(name), "%s%.*g", detail::kScaleFieldPrefix, digits, scale);
+      if (std::strtof(name + prefix_size, nullptr) == scale) {
+        break;
+      }
+    }
+    if (cloud_msg.fields[3].name != name) {
+      cloud_msg.fields[3].name = name;
+    }
+  }
+
+  struct Packer
+  {
+    explicit Packer(float scale)
+    : inv_scale(1.0f / scale) {}
+
+    void operator()(const uint8_t * point, uint8_t * out) const
+    {
+      const float * xyz = reinterpret_cast<const float *>(point);
+      int16_t quantized[3];
+      if (std::isnan(xyz[2])) {
+        quantized[0] = quantized[1] = quantized[2] = kInvalidQuantized;
+      } else {
+        for (int i = 0; i < 3; ++i) {
+          float value = std::round(xyz[i] * inv_scale);
+          quantized[i] = std::fabs(value) <= std::numeric_limits<int16_t>::max() ?
+            static_cast<int16_t>(value) : kInvalidQuantized;
+        }
+      }
+      std::memcpy(out, quantized, sizeof(quantized));
+    }
+
+    float inv_scale;
+  };
+};
+
+// Records the meters per count in clouds of formats that have one, see
+// PointXYZQuantized
+template<typename Format>
+inline void setQuantizationScale(sensor_msgs::msg::PointCloud2 &, float) {}
+
+template<>
+inline void setQuantizationScale<PointXYZQuantized>(
+  sensor_msgs::msg::PointCloud2 & cloud_msg, float scale)
+{
+  PointXYZQuantized::setScale(cloud_msg, scale);
+}
+
+// The meters per count of a PointXYZQuantized cloud, NaN if it has none
+inline float quantizationScale(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+{
+  const size_t prefix_size = sizeof(detail::kScaleFieldPrefix) - 1;
+  for (const sensor_msgs::msg::PointField & field : cloud_msg.fields) {
+    if (field.count == 0 && field.name.compare(0, prefix_size, detail::kScaleFieldPrefix) == 0) {
+      return std::strtof(field.name.c_str() + prefix_size, nullptr);
+    }
+  }
+  return std::numeric_limits<float>::quiet_NaN();
+}
+
+// x, y, z, normal_x, normal_y, normal_z, rgb and curvature as float32, padded to
+// 48 bytes like pcl::PointXYZRGBNormal. Points without a normal have NaN normals
+// and curvature.
+struct PointXYZRGBNormal
+{
+  static constexpr uint32_t point_step = 48;
+  static constexpr bool has_rgb = true;
+  static constexpr bool is_kernel_layout = false;
+  static constexpr bool has_normals = true;
+
+  static void setFields(sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    cloud_msg.fields.clear();
+    cloud_msg.fields.reserve(8);
+    for (size_t i = 0; i < 8; ++i) {
+      sensor_msgs::msg::PointField field;
+      field.name = detail::kNormalPointNames[i];
+      field.offset = detail::kNormalPointOffsets[i];
+      field.datatype = sensor_msgs::msg::PointField::FLOAT32;
+      field.count = 1;
+      cloud_msg.fields.push_back(field);
+    }
+    cloud_msg.point_step = point_step;
+    cloud_msg.row_step = cloud_msg.width * point_step;
+    cloud_msg.data.resize(static_cast<size_t>(cloud_msg.row_step) * cloud_msg.height);
+  }
+
+  static bool hasFields(const sensor_msgs::msg::PointCloud2 & cloud_msg)
+  {
+    if (cloud_msg.point_step != point_step || cloud_msg.fields.size() != 8) {
+      return false;
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      const sensor_msgs::msg::PointField & field = cloud_msg.fields[i];
+      if (field.name != detail::kNormalPointNames[i] ||
+        field.offset != detail::kNormalPointOffsets[i] ||
+        field.datatype != sensor_msgs::msg::PointField::FLOAT32 || field.count != 1)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  struct Packer
+  {
+    explicit Packer(float) {}
+    void operator()(const uint8_t * point, uint8_t * out) const
+    {
+      std::memset(out, 0, point_step);
+      std::memcpy(out, point, 3 * sizeof(float));
+      std::memcpy(out + detail::kNormalPointOffsets[3], point + kNormalOffset, 3 * sizeof(float));
+      std::memcpy(out + detail::kNormalPointOffsets[6], point + kRgbOffset, sizeof(float));
+      std::memcpy(out + detail::kNormalPointOffsets[7], point + kCurvatureOffset, sizeof(float));
+    }
+  };
+};
+
+// Runtime name of the formats above, for the node's point_format parameter
+enum class PointFormat
+{
+  XYZRGB,
+  XYZ,
+  XYZ_HALF,
+  XYZ_INT16,
+  XYZRGB_NORMAL,
+};
+
+// Parses "xyzrgb", "xyz", "xyz_half", "xyz_int16" or "xyzrgb_normal"; returns
+// false for anything else
+inline bool pointFormatFromString(const std::string & name, PointFormat & format)
+{
+  if (name == "xyzrgb") {
+    format = PointFormat::XYZRGB;
+  } else if (name == "xyz") {
+    format = PointFormat::XYZ;
+  } else if (name == "xyz_half") {
+    format = PointFormat::XYZ_HALF;
+  } else if (name == "xyz_int16") {
+    format = PointFormat::XYZ_INT16;
+  } else if (name == "xyzrgb_normal") {
+    format = PointFormat::XYZRGB_NORMAL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Whether format keeps the color, i.e. its has_rgb
+inline bool pointFormatHasRgb(PointFormat format)
+{
+  return format == PointFormat::XYZRGB || format == PointFormat::XYZRGB_NORMAL;
+}
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__POINT_FORMATS_HPP_
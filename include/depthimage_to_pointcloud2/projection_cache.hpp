@@ -0,0 +1,190 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__PROJECTION_CACHE_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__PROJECTION_CACHE_HPP_
+
+#include <image_geometry/pinhole_camera_model.h>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Per-column and per-row ray coefficients for a pinhole camera, so that a depth
+// pixel (u, v) with metric depth z projects to (ray_x[u] * z, ray_y[v] * z, z).
+// Built once from a CameraInfo and reused until the calibration changes.
+// Rectified tables instead hold a ray per pixel that also undoes the lens
+// distortion, for depth images that have not been rectified upstream.
+class ProjectionCache
+{
+public:
+  ProjectionCache(
+    const image_geometry::PinholeCameraModel & model,
+    uint32_t width, uint32_t height)
+  : width_(width), height_(height), source_width_(width), source_height_(height),
+    // Use correct principal point from calibration
+    center_x_(model.cx()), center_y_(model.cy()),
+    inv_fx_(1.0 / model.fx()), inv_fy_(1.0 / model.fy())
+  {
+    fillRays(1, 0.0);
+  }
+
+  // Builds the tables for an image of the given size from the calibration in info.
+  // With rectify the rays are undistorted with info's K and D; they stay in the
+  // frame of the (unrectified) depth image, i.e. R and P are not applied.
+  ProjectionCache(
+    const sensor_msgs::msg::CameraInfo & info,
+    uint32_t width, uint32_t height, bool rectify = false)
+  : ProjectionCache(modelFromCameraInfo(info), width, height)
+  {
+    info_ = info;
+    if (rectify) {
+      rectified_ = true;
+      fillRays(1, 0.0);
+    }
+  }
+
+  explicit ProjectionCache(const sensor_msgs::msg::CameraInfo & info)
+  : ProjectionCache(info, info.width, info.height)
+  {
+  }
+
+  // True if info carries the same calibration the tables were built from, i.e.
+  // the cache does not need to be rebuilt for it.
+  bool matches(const sensor_msgs::msg::CameraInfo & info) const
+  {
+    return info.width == info_.width && info.height == info_.height &&
+           info.k == info_.k && info.d == info_.d &&
+           info.r == info_.r && info.p == info_.p &&
+           info.binning_x == info_.binning_x && info.binning_y == info_.binning_y &&
+           info.roi == info_.roi && info.distortion_model == info_.distortion_model;
+  }
+
+  // Tables for the image reduced by factor in both directions, with each reduced
+  // pixel looking along the ray of its block's top left pixel or of its center
+  ProjectionCache decimated(uint32_t factor, bool block_center) const
+  {
+    ProjectionCache result(*this);
+    result.width_ = source_width_ / factor;
+    result.height_ = source_height_ / factor;
+    result.decimation_ = factor;
+    result.fillRays(factor, block_center ? (factor - 1) / 2.0 : 0.0);
+    return result;
+  }
+
+  // Size of the output (possibly decimated) grid the tables are for
+  uint32_t width() const {return width_;}
+  uint32_t height() const {return height_;}
+  // Size of the depth images the tables expect
+  uint32_t sourceWidth() const {return source_width_;}
+  uint32_t sourceHeight() const {return source_height_;}
+  uint32_t decimation() const {return decimation_;}
+  // Whether there is a ray per pixel (use rayX(v) and rayYRow(v)) rather than
+  // per column and per row (rayX() and rayY(v))
+  bool rectified() const {return rectified_;}
+
+  const float * rayX() const {return ray_x_.data();}
+  float rayY(uint32_t v) const {return ray_y_[v];}
+
+  // Rays of row v
+  const float * rayX(uint32_t v) const
+  {
+    return rectified_ ? ray_x_.data() + static_cast<size_t>(v) * width_ : ray_x_.data();
+  }
+  const float * rayYRow(uint32_t v) const {return ray_y_.data() + static_cast<size_t>(v) * width_;}
+
+private:
+  void fillRays(uint32_t factor, double offset)
+  {
+    if (rectified_) {
+      fillRectifiedRays(factor, offset);
+      return;
+    }
+    ray_x_.resize(width_);
+    ray_y_.resize(height_);
+    for (uint32_t u = 0; u < width_; ++u) {
+      ray_x_[u] = static_cast<float>((u * factor + offset - center_x_) * inv_fx_);
+    }
+    for (uint32_t v = 0; v < height_; ++v) {
+      ray_y_[v] = static_cast<float>((v * factor + offset - center_y_) * inv_fy_);
+    }
+  }
+
+  // Undistorts the center of every (decimated) pixel into normalized image
+  // coordinates, which are the x and y of its ray at z = 1
+  void fillRectifiedRays(uint32_t factor, double offset)
+  {
+    std::vector<cv::Point2f> pixels;
+    pixels.reserve(static_cast<size_t>(width_) * height_);
+    for (uint32_t v = 0; v < height_; ++v) {
+      for (uint32_t u = 0; u < width_; ++u) {
+        pixels.emplace_back(
+          static_cast<float>(u * factor + offset), static_cast<float>(v * factor + offset));
+      }
+    }
+
+    cv::Matx33d camera_matrix(
+      info_.k[0], info_.k[1], info_.k[2],
+      info_.k[3], info_.k[4], info_.k[5],
+      info_.k[6], info_.k[7], info_.k[8]);
+    cv::Mat distortion(1, static_cast<int>(info_.d.size()), CV_64F);
+    for (size_t i = 0; i < info_.d.size(); ++i) {
+      distortion.at<double>(0, static_cast<int>(i)) = info_.d[i];
+    }
+    std::vector<cv::Point2f> rays;
+    if (info_.distortion_model == "equidistant") {
+      cv::fisheye::undistortPoints(pixels, rays, camera_matrix, distortion);
+    } else {
+      cv::undistortPoints(pixels, rays, camera_matrix, distortion);
+    }
+
+    ray_x_.resize(rays.size());
+    ray_y_.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+      ray_x_[i] = rays[i].x;
+      ray_y_[i] = rays[i].y;
+    }
+  }
+
+  static image_geometry::PinholeCameraModel modelFromCameraInfo(
+    const sensor_msgs::msg::CameraInfo & info)
+  {
+    image_geometry::PinholeCameraModel model;
+    model.fromCameraInfo(info);
+    return model;
+  }
+
+  uint32_t width_;
+  uint32_t height_;
+  uint32_t source_width_;
+  uint32_t source_height_;
+  uint32_t decimation_ = 1;
+  bool rectified_ = false;
+  double center_x_;
+  double center_y_;
+  double inv_fx_;
+  double inv_fy_;
+  std::vector<float> ray_x_;
+  std::vector<float> ray_y_;
+  sensor_msgs::msg::CameraInfo info_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__PROJECTION_CACHE_HPP_
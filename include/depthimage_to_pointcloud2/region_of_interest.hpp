@@ -0,0 +1,219 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__REGION_OF_INTEREST_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__REGION_OF_INTEREST_HPP_
+
+#include "depthimage_to_pointcloud2/projection_cache.hpp"
+#include "depthimage_to_pointcloud2/rigid_transform.hpp"
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+namespace depthimage_to_pointcloud2
+{
+
+// A rectangle of the full resolution depth image, like sensor_msgs/RegionOfInterest.
+// A width or height of 0 reaches to the edge of the image.
+struct PixelRoi
+{
+  uint32_t x_offset = 0;
+  uint32_t y_offset = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+};
+
+// An axis-aligned box, unbounded by default
+struct CropBox
+{
+  std::array<float, 3> min = {{
+    -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+    -std::numeric_limits<float>::infinity()}};
+  std::array<float, 3> max = {{
+    std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
+    std::numeric_limits<float>::infinity()}};
+
+  bool bounded() const
+  {
+    for (int i = 0; i < 3; ++i) {
+      if (std::isfinite(min[i]) || std::isfinite(max[i])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  CropBox intersected(const CropBox & other) const
+  {
+    CropBox result;
+    for (int i = 0; i < 3; ++i) {
+      result.min[i] = std::max(min[i], other.min[i]);
+      result.max[i] = std::min(max[i], other.max[i]);
+    }
+    return result;
+  }
+
+  // The smallest box holding this one moved by transform. Works on the bounds
+  // as intervals, so unbounded sides stay unbounded rather than turning NaN.
+  CropBox transformed(const RigidTransform & transform) const
+  {
+    CropBox result;
+    for (int row = 0; row < 3; ++row) {
+      double lower = transform.translation[row];
+      double upper = transform.translation[row];
+      for (int col = 0; col < 3; ++col) {
+        const double r = transform.rotation[row * 3 + col];
+        if (r == 0.0) {
+          continue;
+        }
+        const double a = r * min[col];
+        const double b = r * max[col];
+        lower += std::min(a, b);
+        upper += std::max(a, b);
+      }
+      result.min[row] = static_cast<float>(lower);
+      result.max[row] = static_cast<float>(upper);
+    }
+    return result;
+  }
+};
+
+// Invalidates the points outside of a CropBox
+class BoxClipper
+{
+public:
+  explicit BoxClipper(const CropBox & box)
+  : box_(box) {}
+
+  // Sets x, y and z of the count points in the kernel layout that are outside
+  // the box to NaN; points that already are NaN fail every comparison and stay so
+  void clipRow(uint8_t * points, uint32_t count) const
+  {
+    const float bad_point = std::numeric_limits<float>::quiet_NaN();
+    for (uint32_t i = 0; i < count; ++i, points += kPointStep) {
+      float * point = reinterpret_cast<float *>(points);
+      if (!(point[0] >= box_.min[0] && point[0] <= box_.max[0] &&
+        point[1] >= box_.min[1] && point[1] <= box_.max[1] &&
+        point[2] >= box_.min[2] && point[2] <= box_.max[2]))
+      {
+        point[0] = point[1] = point[2] = bad_point;
+      }
+    }
+  }
+
+private:
+  CropBox box_;
+};
+
+// The part of a projection's (possibly decimated) grid that is converted: columns
+// u_begin to u_end and rows v_begin to v_end, both exclusive at the end
+struct PixelWindow
+{
+  uint32_t u_begin = 0;
+  uint32_t u_end = 0;
+  uint32_t v_begin = 0;
+  uint32_t v_end = 0;
+
+  uint32_t width() const {return u_end - u_begin;}
+  uint32_t height() const {return v_end - v_begin;}
+  bool empty() const {return u_end <= u_begin || v_end <= v_begin;}
+};
+
+// Whether some point at a depth in [z_min, z_max] along a ray with slope r has
+// its x (or y) in [lower, upper]
+inline bool rayMeetsInterval(float r, float z_min, float z_max, float lower, float upper)
+{
+  if (r == 0.0f) {
+    return lower <= 0.0f && upper >= 0.0f;
+  }
+  float a = r * z_min;
+  float b = r * z_max;
+  if (a > b) {
+    std::swap(a, b);
+  }
+  return a <= upper && b >= lower;
+}
+
+// The window of projection's grid covering roi, narrowed to the rows and columns
+// whose rays pass through camera_box (in the frame of the depth image). Rows and
+// columns outside of it cannot have a point in the box, so they are not
+// converted at all. Only separable, i.e. unrectified, tables are narrowed to the
+// box; with rectified ones the points still get clipped, but every row of roi is
+// converted.
+inline PixelWindow pixelWindow(
+  const ProjectionCache & projection, const PixelRoi & roi, const CropBox & camera_box)
+{
+  // roi is in full resolution pixels, the grid may be decimated
+  const uint32_t factor = projection.decimation();
+  PixelWindow window;
+  window.u_begin = std::min(roi.x_offset / factor, projection.width());
+  window.v_begin = std::min(roi.y_offset / factor, projection.height());
+  window.u_end = roi.width == 0 ? projection.width() :
+    std::min((roi.x_offset + roi.width + factor - 1) / factor, projection.width());
+  window.v_end = roi.height == 0 ? projection.height() :
+    std::min((roi.y_offset + roi.height + factor - 1) / factor, projection.height());
+  window.u_end = std::max(window.u_end, window.u_begin);
+  window.v_end = std::max(window.v_end, window.v_begin);
+  if (projection.rectified() || !camera_box.bounded() || window.empty()) {
+    return window;
+  }
+
+  // Valid depths are positive
+  const float z_min = std::max(camera_box.min[2], 0.0f);
+  const float z_max = camera_box.max[2];
+  if (!(z_max > z_min)) {
+    window.u_end = window.u_begin;
+    window.v_end = window.v_begin;
+    return window;
+  }
+  // The rays of the rows (and columns) are sorted, so the rows through the box
+  // are a single run
+  while (window.v_begin < window.v_end &&
+    !rayMeetsInterval(
+      projection.rayY(window.v_begin), z_min, z_max, camera_box.min[1], camera_box.max[1]))
+  {
+    ++window.v_begin;
+  }
+  while (window.v_end > window.v_begin &&
+    !rayMeetsInterval(
+      projection.rayY(window.v_end - 1), z_min, z_max, camera_box.min[1], camera_box.max[1]))
+  {
+    --window.v_end;
+  }
+  const float * ray_x = projection.rayX();
+  while (window.u_begin < window.u_end &&
+    !rayMeetsInterval(ray_x[window.u_begin], z_min, z_max, camera_box.min[0], camera_box.max[0]))
+  {
+    ++window.u_begin;
+  }
+  while (window.u_end > window.u_begin &&
+    !rayMeetsInterval(ray_x[window.u_end - 1], z_min, z_max, camera_box.min[0], camera_box.max[0]))
+  {
+    --window.u_end;
+  }
+  if (window.empty()) {
+    window.u_end = window.u_begin;
+    window.v_end = window.v_begin;
+  }
+  return window;
+}
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__REGION_OF_INTEREST_HPP_
@@ -0,0 +1,118 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__REGISTRATION_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__REGISTRATION_HPP_
+
+#include "depthimage_to_pointcloud2/projection_cache.hpp"
+#include "depthimage_to_pointcloud2/rigid_transform.hpp"
+
+#include <image_geometry/pinhole_camera_model.h>
+#include <sensor_msgs/msg/camera_info.hpp>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Tables for coloring the points of a depth camera from a separate color camera.
+// A depth pixel (u, v) with depth z is at z * ray(u, v) in the depth frame, so in
+// the color frame it is at z * (R * ray(u, v)) + t, with the extrinsic (R, t)
+// taking points from the depth camera's optical frame to the color camera's.
+// R * ray(u, v) is stored per pixel of the projection's (possibly decimated)
+// grid, which leaves three multiply-adds and a division per point to find its
+// color pixel.
+class ColorRegistration
+{
+public:
+  ColorRegistration(
+    const ProjectionCache & projection,
+    const sensor_msgs::msg::CameraInfo & color_info,
+    const RigidTransform & extrinsic)
+  : width_(projection.width()), height_(projection.height()),
+    color_info_(color_info), extrinsic_(extrinsic)
+  {
+    image_geometry::PinholeCameraModel model;
+    model.fromCameraInfo(color_info);
+    fx_ = static_cast<float>(model.fx());
+    fy_ = static_cast<float>(model.fy());
+    cx_ = static_cast<float>(model.cx());
+    cy_ = static_cast<float>(model.cy());
+    tx_ = static_cast<float>(extrinsic.translation[0]);
+    ty_ = static_cast<float>(extrinsic.translation[1]);
+    tz_ = static_cast<float>(extrinsic.translation[2]);
+
+    const std::array<double, 9> & r = extrinsic.rotation;
+    rays_.resize(static_cast<size_t>(width_) * height_ * 3);
+    float * ray = rays_.data();
+    for (uint32_t v = 0; v < height_; ++v) {
+      const float * ray_x = projection.rayX(v);
+      const float * ray_y_row = projection.rectified() ? projection.rayYRow(v) : nullptr;
+      for (uint32_t u = 0; u < width_; ++u, ray += 3) {
+        const double ray_y = ray_y_row != nullptr ? ray_y_row[u] : projection.rayY(v);
+        ray[0] = static_cast<float>(r[0] * ray_x[u] + r[1] * ray_y + r[2]);
+        ray[1] = static_cast<float>(r[3] * ray_x[u] + r[4] * ray_y + r[5]);
+        ray[2] = static_cast<float>(r[6] * ray_x[u] + r[7] * ray_y + r[8]);
+      }
+    }
+  }
+
+  // True if the tables were built from this color calibration and extrinsic.
+  // The depth side is not checked, the tables have to be rebuilt whenever the
+  // ProjectionCache they were built from is replaced.
+  bool matches(
+    const sensor_msgs::msg::CameraInfo & color_info, const RigidTransform & extrinsic) const
+  {
+    return extrinsic == extrinsic_ &&
+           color_info.width == color_info_.width && color_info.height == color_info_.height &&
+           color_info.k == color_info_.k && color_info.d == color_info_.d &&
+           color_info.r == color_info_.r && color_info.p == color_info_.p &&
+           color_info.binning_x == color_info_.binning_x &&
+           color_info.binning_y == color_info_.binning_y && color_info.roi == color_info_.roi;
+  }
+
+  uint32_t width() const {return width_;}
+  uint32_t height() const {return height_;}
+
+  // The rotated rays of row v, three floats per point
+  const float * rays(uint32_t v) const {return rays_.data() + static_cast<size_t>(v) * width_ * 3;}
+
+  float fx() const {return fx_;}
+  float fy() const {return fy_;}
+  float cx() const {return cx_;}
+  float cy() const {return cy_;}
+  float tx() const {return tx_;}
+  float ty() const {return ty_;}
+  float tz() const {return tz_;}
+
+private:
+  uint32_t width_;
+  uint32_t height_;
+  float fx_;
+  float fy_;
+  float cx_;
+  float cy_;
+  float tx_;
+  float ty_;
+  float tz_;
+  std::vector<float> rays_;
+  sensor_msgs::msg::CameraInfo color_info_;
+  RigidTransform extrinsic_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__REGISTRATION_HPP_
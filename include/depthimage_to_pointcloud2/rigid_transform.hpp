@@ -0,0 +1,106 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__RIGID_TRANSFORM_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__RIGID_TRANSFORM_HPP_
+
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+
+#include <geometry_msgs/msg/transform.hpp>
+
+#include <array>
+#include <cstdint>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Rotation (row-major) and translation taking points from one frame to another
+struct RigidTransform
+{
+  std::array<double, 9> rotation = {{1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0}};
+  std::array<double, 3> translation = {{0.0, 0.0, 0.0}};
+
+  static RigidTransform fromTransform(const geometry_msgs::msg::Transform & transform)
+  {
+    const double x = transform.rotation.x;
+    const double y = transform.rotation.y;
+    const double z = transform.rotation.z;
+    const double w = transform.rotation.w;
+    RigidTransform result;
+    result.rotation = {{
+      1.0 - 2.0 * (y * y + z * z), 2.0 * (x * y - z * w), 2.0 * (x * z + y * w),
+      2.0 * (x * y + z * w), 1.0 - 2.0 * (x * x + z * z), 2.0 * (y * z - x * w),
+      2.0 * (x * z - y * w), 2.0 * (y * z + x * w), 1.0 - 2.0 * (x * x + y * y)}};
+    result.translation = {{transform.translation.x, transform.translation.y,
+      transform.translation.z}};
+    return result;
+  }
+
+  // The transform taking the points back; the rotation is just transposed
+  RigidTransform inverse() const
+  {
+    RigidTransform result;
+    for (int row = 0; row < 3; ++row) {
+      result.translation[row] = 0.0;
+      for (int col = 0; col < 3; ++col) {
+        result.rotation[row * 3 + col] = rotation[col * 3 + row];
+        result.translation[row] -= rotation[col * 3 + row] * translation[col];
+      }
+    }
+    return result;
+  }
+
+  bool operator==(const RigidTransform & other) const
+  {
+    return rotation == other.rotation && translation == other.translation;
+  }
+};
+
+// A RigidTransform in single precision, for transforming points as they are
+// converted
+class PointTransformer
+{
+public:
+  explicit PointTransformer(const RigidTransform & transform)
+  {
+    for (int row = 0; row < 3; ++row) {
+      for (int col = 0; col < 3; ++col) {
+        m_[row * 4 + col] = static_cast<float>(transform.rotation[row * 3 + col]);
+      }
+      m_[row * 4 + 3] = static_cast<float>(transform.translation[row]);
+    }
+  }
+
+  // Transforms x, y and z of count points in the kernel layout in place. Bad
+  // points stay NaN, so there is no need to skip them.
+  void transformRow(uint8_t * points, uint32_t count) const
+  {
+    for (uint32_t i = 0; i < count; ++i, points += kPointStep) {
+      float * point = reinterpret_cast<float *>(points);
+      const float x = point[0];
+      const float y = point[1];
+      const float z = point[2];
+      point[0] = m_[0] * x + m_[1] * y + m_[2] * z + m_[3];
+      point[1] = m_[4] * x + m_[5] * y + m_[6] * z + m_[7];
+      point[2] = m_[8] * x + m_[9] * y + m_[10] * z + m_[11];
+    }
+  }
+
+private:
+  float m_[12];
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__RIGID_TRANSFORM_HPP_
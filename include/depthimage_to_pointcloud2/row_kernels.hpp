@@ -0,0 +1,513 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__ROW_KERNELS_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__ROW_KERNELS_HPP_
+
+#include "depthimage_to_pointcloud2/depth_traits.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DEPTHIMAGE_TO_POINTCLOUD2_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define DEPTHIMAGE_TO_POINTCLOUD2_HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+namespace depthimage_to_pointcloud2
+{
+
+// Layout written by the row kernels, i.e. what
+// PointCloud2Modifier::setPointCloud2FieldsByString(2, "xyz", "rgb") produces:
+// x, y, z and one float of padding, then rgb followed by three floats of padding.
+constexpr uint32_t kPointStep = 32;
+constexpr uint32_t kRgbOffset = 16;
+
+// How depths become meters, and how invalid and out-of-range depths are written,
+// with range_max in meters. depth_scale multiplies the unit of the depth type
+// (see DepthTraits), e.g. 0.25 for 16 bit depths in quarter millimeters or 0.001
+// for float depths in millimeters; it is folded into scale, which the kernels
+// multiply by anyway.
+struct RowLimits
+{
+  float scale;         // meters per depth value
+  float z_max;         // range_max, rounded to what the depth type can represent
+  bool check_max;      // range_max != 0.0
+  bool clamp_invalid;  // write z_max rather than NaN for invalid / too far points
+
+  template<typename T>
+  static RowLimits make(double range_max, bool use_quiet_nan, double depth_scale = 1.0)
+  {
+    RowLimits limits;
+    limits.scale = static_cast<float>(DepthTraits<T>::toMeters(T(1)) * depth_scale);
+    limits.check_max = range_max != 0.0;
+    limits.clamp_invalid = limits.check_max && !use_quiet_nan;
+    limits.z_max = 0.0f;
+    if (limits.check_max) {
+      limits.z_max = std::is_integral<T>::value ?
+        static_cast<float>(std::floor(range_max / limits.scale + 0.5)) * limits.scale :
+        static_cast<float>(range_max);
+    }
+    return limits;
+  }
+};
+
+// Projects one row of depth pixels into kPointStep sized points at out.
+// Bad points get NaN for x, y, z and rgb; good points get an rgb of 0.
+template<typename T>
+using RowKernel = void (*)(
+  const T * depth_row, const float * ray_x, float ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out);
+
+// The same for rays that are not separable into columns and rows (see
+// ProjectionCache::rectified()), with a y ray per pixel of the row
+template<typename T>
+using RectifiedRowKernel = void (*)(
+  const T * depth_row, const float * ray_x, const float * ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out);
+
+namespace detail
+{
+
+// The kernels below are written once for both kinds of y rays, RayY being float
+// for one ray per row and const float * for one per pixel
+inline float rayYAt(float ray_y, uint32_t) {return ray_y;}
+inline float rayYAt(const float * ray_y, uint32_t u) {return ray_y[u];}
+inline float rayYFrom(float ray_y, uint32_t) {return ray_y;}
+inline const float * rayYFrom(const float * ray_y, uint32_t u) {return ray_y + u;}
+
+}  // namespace detail
+
+// Reference implementation, used for any depth type without a vectorized kernel
+// and for the tail of each row in the vectorized ones.
+template<typename T, typename RayY>
+inline void projectRowScalar(
+  const T * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const float bad_point = std::numeric_limits<float>::quiet_NaN();
+  for (uint32_t u = 0; u < width; ++u, out += kPointStep) {
+    float * point = reinterpret_cast<float *>(out);
+    T depth = depth_row[u];
+    float z = static_cast<float>(depth) * limits.scale;
+
+    // Missing points denoted by NaNs
+    bool bad = false;
+    if (!DepthTraits<T>::valid(depth)) {
+      if (limits.clamp_invalid) {
+        z = limits.z_max;
+      } else {
+        bad = true;
+      }
+    } else if (limits.check_max && z > limits.z_max) {
+      if (limits.clamp_invalid) {
+        z = limits.z_max;
+      } else {
+        bad = true;
+      }
+    }
+
+    if (bad) {
+      point[0] = point[1] = point[2] = point[4] = bad_point;
+    } else {
+      point[0] = ray_x[u] * z;
+      point[1] = detail::rayYAt(ray_y, u) * z;
+      point[2] = z;
+      point[4] = 0.0f;
+    }
+    point[3] = point[5] = point[6] = point[7] = 0.0f;
+  }
+}
+
+// Number of pixels in a row the row kernels will write a good point for
+template<typename T>
+inline uint32_t countGoodPoints(const T * depth_row, uint32_t width, const RowLimits & limits)
+{
+  if (limits.clamp_invalid) {
+    return width;
+  }
+  uint32_t count = 0;
+  for (uint32_t u = 0; u < width; ++u) {
+    T depth = depth_row[u];
+    bool good = DepthTraits<T>::valid(depth) &&
+      !(limits.check_max && static_cast<float>(depth) * limits.scale > limits.z_max);
+    count += good ? 1 : 0;
+  }
+  return count;
+}
+
+enum class SimdLevel
+{
+  SCALAR,
+  SSE41,
+  AVX2,
+  NEON
+};
+
+// The best instruction set available on the CPU we are running on
+inline SimdLevel detectSimdLevel()
+{
+#if defined(DEPTHIMAGE_TO_POINTCLOUD2_HAVE_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdLevel::AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return SimdLevel::SSE41;
+  }
+  return SimdLevel::SCALAR;
+#elif defined(DEPTHIMAGE_TO_POINTCLOUD2_HAVE_NEON_KERNELS)
+  return SimdLevel::NEON;
+#else
+  return SimdLevel::SCALAR;
+#endif
+}
+
+namespace detail
+{
+
+#if defined(DEPTHIMAGE_TO_POINTCLOUD2_HAVE_X86_KERNELS)
+
+__attribute__((target("sse4.1")))
+inline __m128 loadRayY4(float ray_y, uint32_t) {return _mm_set1_ps(ray_y);}
+__attribute__((target("sse4.1")))
+inline __m128 loadRayY4(const float * ray_y, uint32_t u) {return _mm_loadu_ps(ray_y + u);}
+__attribute__((target("avx2")))
+inline __m256 loadRayY8(float ray_y, uint32_t) {return _mm256_set1_ps(ray_y);}
+__attribute__((target("avx2")))
+inline __m256 loadRayY8(const float * ray_y, uint32_t u) {return _mm256_loadu_ps(ray_y + u);}
+
+// Interleaves four points from SoA registers into kPointStep sized slots
+inline void storePoints4(__m128 x, __m128 y, __m128 z, __m128 rgb, uint8_t * out)
+{
+  __m128 pad = _mm_setzero_ps();
+  __m128 zero0 = _mm_setzero_ps();
+  __m128 zero1 = _mm_setzero_ps();
+  __m128 zero2 = _mm_setzero_ps();
+  _MM_TRANSPOSE4_PS(x, y, z, pad);
+  _MM_TRANSPOSE4_PS(rgb, zero0, zero1, zero2);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 0 * kPointStep), x);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 0 * kPointStep + kRgbOffset), rgb);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 1 * kPointStep), y);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 1 * kPointStep + kRgbOffset), zero0);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 2 * kPointStep), z);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 2 * kPointStep + kRgbOffset), zero1);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 3 * kPointStep), pad);
+  _mm_storeu_ps(reinterpret_cast<float *>(out + 3 * kPointStep + kRgbOffset), zero2);
+}
+
+__attribute__((target("sse4.1")))
+inline void finishPoints4(
+  __m128 z, __m128 invalid, __m128 ray_x, __m128 ray_y,
+  const RowLimits & limits, uint8_t * out)
+{
+  const __m128 z_max = _mm_set1_ps(limits.z_max);
+  __m128 replace = invalid;
+  if (limits.check_max) {
+    replace = _mm_or_ps(replace, _mm_cmpgt_ps(z, z_max));
+  }
+  __m128 bad;
+  if (limits.clamp_invalid) {
+    z = _mm_blendv_ps(z, z_max, replace);
+    bad = _mm_setzero_ps();
+  } else {
+    bad = replace;
+  }
+  const __m128 nan = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+  __m128 x = _mm_blendv_ps(_mm_mul_ps(ray_x, z), nan, bad);
+  __m128 y = _mm_blendv_ps(_mm_mul_ps(ray_y, z), nan, bad);
+  __m128 rgb = _mm_and_ps(nan, bad);
+  z = _mm_blendv_ps(z, nan, bad);
+  storePoints4(x, y, z, rgb, out);
+}
+
+template<typename RayY>
+__attribute__((target("sse4.1")))
+inline void projectRowSse41(
+  const uint16_t * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const __m128 scale = _mm_set1_ps(limits.scale);
+  uint32_t u = 0;
+  for (; u + 4 <= width; u += 4, out += 4 * kPointStep) {
+    __m128i depth = _mm_cvtepu16_epi32(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i *>(depth_row + u)));
+    __m128 invalid = _mm_castsi128_ps(_mm_cmpeq_epi32(depth, _mm_setzero_si128()));
+    __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(depth), scale);
+    finishPoints4(z, invalid, _mm_loadu_ps(ray_x + u), loadRayY4(ray_y, u), limits, out);
+  }
+  projectRowScalar(depth_row + u, ray_x + u, rayYFrom(ray_y, u), width - u, limits, out);
+}
+
+template<typename RayY>
+__attribute__((target("sse4.1")))
+inline void projectRowSse41(
+  const float * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+  const __m128 scale = _mm_set1_ps(limits.scale);
+  const bool scaled = limits.scale != 1.0f;
+  uint32_t u = 0;
+  for (; u + 4 <= width; u += 4, out += 4 * kPointStep) {
+    __m128 z = _mm_loadu_ps(depth_row + u);
+    // Finite values compare less than infinity, NaNs compare false
+    __m128 invalid = _mm_cmpnlt_ps(_mm_and_ps(z, abs_mask), inf);
+    if (scaled) {
+      z = _mm_mul_ps(z, scale);
+    }
+    finishPoints4(z, invalid, _mm_loadu_ps(ray_x + u), loadRayY4(ray_y, u), limits, out);
+  }
+  projectRowScalar(depth_row + u, ray_x + u, rayYFrom(ray_y, u), width - u, limits, out);
+}
+
+__attribute__((target("avx2")))
+inline void finishPoints8(
+  __m256 z, __m256 invalid, __m256 ray_x, __m256 ray_y,
+  const RowLimits & limits, uint8_t * out)
+{
+  const __m256 z_max = _mm256_set1_ps(limits.z_max);
+  __m256 replace = invalid;
+  if (limits.check_max) {
+    replace = _mm256_or_ps(replace, _mm256_cmp_ps(z, z_max, _CMP_GT_OQ));
+  }
+  __m256 bad;
+  if (limits.clamp_invalid) {
+    z = _mm256_blendv_ps(z, z_max, replace);
+    bad = _mm256_setzero_ps();
+  } else {
+    bad = replace;
+  }
+  const __m256 nan = _mm256_set1_ps(std::numeric_limits<float>::quiet_NaN());
+  __m256 x = _mm256_blendv_ps(_mm256_mul_ps(ray_x, z), nan, bad);
+  __m256 y = _mm256_blendv_ps(_mm256_mul_ps(ray_y, z), nan, bad);
+  __m256 rgb = _mm256_and_ps(nan, bad);
+  z = _mm256_blendv_ps(z, nan, bad);
+  storePoints4(
+    _mm256_castps256_ps128(x), _mm256_castps256_ps128(y),
+    _mm256_castps256_ps128(z), _mm256_castps256_ps128(rgb), out);
+  storePoints4(
+    _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1),
+    _mm256_extractf128_ps(z, 1), _mm256_extractf128_ps(rgb, 1), out + 4 * kPointStep);
+}
+
+template<typename RayY>
+__attribute__((target("avx2")))
+inline void projectRowAvx2(
+  const uint16_t * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const __m256 scale = _mm256_set1_ps(limits.scale);
+  uint32_t u = 0;
+  for (; u + 8 <= width; u += 8, out += 8 * kPointStep) {
+    __m256i depth = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth_row + u)));
+    __m256 invalid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(depth, _mm256_setzero_si256()));
+    __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(depth), scale);
+    finishPoints8(z, invalid, _mm256_loadu_ps(ray_x + u), loadRayY8(ray_y, u), limits, out);
+  }
+  projectRowScalar(depth_row + u, ray_x + u, rayYFrom(ray_y, u), width - u, limits, out);
+}
+
+template<typename RayY>
+__attribute__((target("avx2")))
+inline void projectRowAvx2(
+  const float * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  const __m256 scale = _mm256_set1_ps(limits.scale);
+  const bool scaled = limits.scale != 1.0f;
+  uint32_t u = 0;
+  for (; u + 8 <= width; u += 8, out += 8 * kPointStep) {
+    __m256 z = _mm256_loadu_ps(depth_row + u);
+    // Finite values compare less than infinity, NaNs compare false
+    __m256 invalid = _mm256_cmp_ps(_mm256_and_ps(z, abs_mask), inf, _CMP_NLT_UQ);
+    if (scaled) {
+      z = _mm256_mul_ps(z, scale);
+    }
+    finishPoints8(z, invalid, _mm256_loadu_ps(ray_x + u), loadRayY8(ray_y, u), limits, out);
+  }
+  projectRowScalar(depth_row + u, ray_x + u, rayYFrom(ray_y, u), width - u, limits, out);
+}
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2_HAVE_X86_KERNELS
+
+#if defined(DEPTHIMAGE_TO_POINTCLOUD2_HAVE_NEON_KERNELS)
+
+inline float32x4_t loadRayY4(float ray_y, uint32_t) {return vdupq_n_f32(ray_y);}
+inline float32x4_t loadRayY4(const float * ray_y, uint32_t u) {return vld1q_f32(ray_y + u);}
+
+inline void transpose4(float32x4_t & a, float32x4_t & b, float32x4_t & c, float32x4_t & d)
+{
+  float32x4_t t0 = vzip1q_f32(a, c);
+  float32x4_t t1 = vzip2q_f32(a, c);
+  float32x4_t t2 = vzip1q_f32(b, d);
+  float32x4_t t3 = vzip2q_f32(b, d);
+  a = vzip1q_f32(t0, t2);
+  b = vzip2q_f32(t0, t2);
+  c = vzip1q_f32(t1, t3);
+  d = vzip2q_f32(t1, t3);
+}
+
+inline void finishPoints4(
+  float32x4_t z, uint32x4_t invalid, float32x4_t ray_x, float32x4_t ray_y,
+  const RowLimits & limits, uint8_t * out)
+{
+  const float32x4_t z_max = vdupq_n_f32(limits.z_max);
+  uint32x4_t replace = invalid;
+  if (limits.check_max) {
+    replace = vorrq_u32(replace, vcgtq_f32(z, z_max));
+  }
+  uint32x4_t bad;
+  if (limits.clamp_invalid) {
+    z = vbslq_f32(replace, z_max, z);
+    bad = vdupq_n_u32(0);
+  } else {
+    bad = replace;
+  }
+  const float32x4_t nan = vdupq_n_f32(std::numeric_limits<float>::quiet_NaN());
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  float32x4_t x = vbslq_f32(bad, nan, vmulq_f32(ray_x, z));
+  float32x4_t y = vbslq_f32(bad, nan, vmulq_f32(ray_y, z));
+  float32x4_t rgb = vbslq_f32(bad, nan, zero);
+  float32x4_t pad = zero;
+  float32x4_t zero0 = zero;
+  float32x4_t zero1 = zero;
+  float32x4_t zero2 = zero;
+  z = vbslq_f32(bad, nan, z);
+  transpose4(x, y, z, pad);
+  transpose4(rgb, zero0, zero1, zero2);
+  vst1q_f32(reinterpret_cast<float *>(out + 0 * kPointStep), x);
+  vst1q_f32(reinterpret_cast<float *>(out + 0 * kPointStep + kRgbOffset), rgb);
+  vst1q_f32(reinterpret_cast<float *>(out + 1 * kPointStep), y);
+  vst1q_f32(reinterpret_cast<float *>(out + 1 * kPointStep + kRgbOffset), zero0);
+  vst1q_f32(reinterpret_cast<float *>(out + 2 * kPointStep), z);
+  vst1q_f32(reinterpret_cast<float *>(out + 2 * kPointStep + kRgbOffset), zero1);
+  vst1q_f32(reinterpret_cast<float *>(out + 3 * kPointStep), pad);
+  vst1q_f32(reinterpret_cast<float *>(out + 3 * kPointStep + kRgbOffset), zero2);
+}
+
+template<typename RayY>
+inline void projectRowNeon(
+  const uint16_t * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const float32x4_t scale = vdupq_n_f32(limits.scale);
+  uint32_t u = 0;
+  for (; u + 4 <= width; u += 4, out += 4 * kPointStep) {
+    uint32x4_t depth = vmovl_u16(vld1_u16(depth_row + u));
+    uint32x4_t invalid = vceqq_u32(depth, vdupq_n_u32(0));
+    float32x4_t z = vmulq_f32(vcvtq_f32_u32(depth), scale);
+    finishPoints4(z, invalid, vld1q_f32(ray_x + u), loadRayY4(ray_y, u), limits, out);
+  }
+  projectRowScalar(depth_row + u, ray_x + u, rayYFrom(ray_y, u), width - u, limits, out);
+}
+
+template<typename RayY>
+inline void projectRowNeon(
+  const float * depth_row, const float * ray_x, RayY ray_y, uint32_t width,
+  const RowLimits & limits, uint8_t * out)
+{
+  const float32x4_t inf = vdupq_n_f32(std::numeric_limits<float>::infinity());
+  const float32x4_t scale = vdupq_n_f32(limits.scale);
+  const bool scaled = limits.scale != 1.0f;
+  uint32_t u = 0;
+  for (; u + 4 <= width; u += 4, out += 4 * kPointStep) {
+    float32x4_t z = vld1q_f32(depth_row + u);
+    // Finite values compare less than infinity, NaNs compare false
+    uint32x4_t invalid = vmvnq_u32(vcltq_f32(vabsq_f32(z), inf));
+    if (scaled) {
+      z = vmulq_f32(z, scale);
+    }
+    finishPoints4(z, invalid, vld1q_f32(ray_x + u), loadRayY4(ray_y, u), limits, out);
+  }
+  projectRowScalar(depth_row + u, ray_x + u, rayYFrom(ray_y, u), width - u, limits, out);
+}
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2_HAVE_NEON_KERNELS
+
+// Kernel is RowKernel<T> or RectifiedRowKernel<T>
+template<typename T, typename Kernel>
+inline Kernel selectVectorKernel(SimdLevel level)
+{
+#if defined(DEPTHIMAGE_TO_POINTCLOUD2_HAVE_X86_KERNELS)
+  if (level == SimdLevel::AVX2) {
+    return static_cast<Kernel>(&projectRowAvx2);
+  }
+  if (level == SimdLevel::SSE41) {
+    return static_cast<Kernel>(&projectRowSse41);
+  }
+#elif defined(DEPTHIMAGE_TO_POINTCLOUD2_HAVE_NEON_KERNELS)
+  if (level == SimdLevel::NEON) {
+    return static_cast<Kernel>(&projectRowNeon);
+  }
+#endif
+  (void)level;
+  return static_cast<Kernel>(&projectRowScalar);
+}
+
+}  // namespace detail
+
+// Picks the row kernel for the depth type T and the given instruction set,
+// falling back to projectRowScalar() where no vectorized kernel exists
+template<typename T>
+inline RowKernel<T> selectRowKernel(SimdLevel level)
+{
+  (void)level;
+  return &projectRowScalar<T, float>;
+}
+
+template<>
+inline RowKernel<uint16_t> selectRowKernel<uint16_t>(SimdLevel level)
+{
+  return detail::selectVectorKernel<uint16_t, RowKernel<uint16_t>>(level);
+}
+
+template<>
+inline RowKernel<float> selectRowKernel<float>(SimdLevel level)
+{
+  return detail::selectVectorKernel<float, RowKernel<float>>(level);
+}
+
+template<typename T>
+inline RectifiedRowKernel<T> selectRectifiedRowKernel(SimdLevel level)
+{
+  (void)level;
+  return &projectRowScalar<T, const float *>;
+}
+
+template<>
+inline RectifiedRowKernel<uint16_t> selectRectifiedRowKernel<uint16_t>(SimdLevel level)
+{
+  return detail::selectVectorKernel<uint16_t, RectifiedRowKernel<uint16_t>>(level);
+}
+
+template<>
+inline RectifiedRowKernel<float> selectRectifiedRowKernel<float>(SimdLevel level)
+{
+  return detail::selectVectorKernel<float, RectifiedRowKernel<float>>(level);
+}
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__ROW_KERNELS_HPP_
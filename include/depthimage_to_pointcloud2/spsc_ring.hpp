@@ -0,0 +1,206 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__SPSC_RING_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__SPSC_RING_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace depthimage_to_pointcloud2
+{
+
+// What a full ring does with one more element
+enum class Overflow
+{
+  DROP_OLDEST,  // evict the element that waited longest, the new one goes in
+  DROP_NEWEST,  // keep what is waiting, the new one is dropped
+};
+
+inline bool overflowFromString(const std::string & name, Overflow & overflow)
+{
+  if (name == "drop_oldest") {
+    overflow = Overflow::DROP_OLDEST;
+  } else if (name == "drop_newest") {
+    overflow = Overflow::DROP_NEWEST;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// A bounded ring between one producer and one consumer thread that never locks.
+// Every slot carries a sequence number saying whether it is free for the push of
+// a given round or holds the element of it. The consumer claims the oldest
+// element with a compare-exchange, so the producer may also evict it to make room
+// (Overflow::DROP_OLDEST) while the consumer is popping; the evicted element is
+// destroyed on the producer's thread.
+template<typename T>
+class SpscRing
+{
+public:
+  // Room for capacity elements, rounded up to a power of two
+  explicit SpscRing(size_t capacity)
+  {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    slots_.reset(new Slot[size]);
+    for (size_t i = 0; i < size; ++i) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing & operator=(const SpscRing &) = delete;
+
+  size_t capacity() const {return mask_ + 1;}
+
+  // Producer only. Returns false if the ring was full: then with DROP_NEWEST
+  // value is dropped, and with DROP_OLDEST the oldest element was evicted and
+  // value went in instead.
+  bool push(T value, Overflow overflow)
+  {
+    if (tryPush(value)) {
+      return true;
+    }
+    if (overflow == Overflow::DROP_NEWEST) {
+      return false;
+    }
+    bool evicted = false;
+    do {
+      // A pop that is still moving its element out has already made room
+      if (tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_relaxed) >=
+        capacity())
+      {
+        T oldest;
+        evicted = tryPop(oldest) || evicted;
+      } else {
+        std::this_thread::yield();
+      }
+    } while (!tryPush(value));
+    return !evicted;
+  }
+
+  // Producer only
+  bool tryPush(T & value)
+  {
+    const size_t position = tail_.load(std::memory_order_relaxed);
+    Slot & slot = slots_[position & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != position) {
+      return false;
+    }
+    slot.value = std::move(value);
+    slot.sequence.store(position + 1, std::memory_order_release);
+    tail_.store(position + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Consumer, or the producer to evict
+  bool tryPop(T & value)
+  {
+    size_t position = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot & slot = slots_[position & mask_];
+      const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence != position + 1) {
+        if (sequence == position) {
+          return false;  // empty
+        }
+        position = head_.load(std::memory_order_relaxed);  // popped by the other thread
+        continue;
+      }
+      if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        value = std::move(slot.value);
+        slot.value = T();
+        slot.sequence.store(position + capacity(), std::memory_order_release);
+        return true;
+      }
+    }
+  }
+
+  bool empty() const
+  {
+    const size_t position = head_.load(std::memory_order_relaxed);
+    return slots_[position & mask_].sequence.load(std::memory_order_acquire) != position + 1;
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  // The positions are on cache lines of their own, so the consumer popping does
+  // not slow down the producer pushing. Padded rather than alignas(), which
+  // operator new only honors from C++17.
+  static constexpr size_t kCacheLine = 64;
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_ = 0;
+  char pad0_[kCacheLine];
+  std::atomic<size_t> head_{0};
+  char pad1_[kCacheLine - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail_{0};
+  char pad2_[kCacheLine - sizeof(std::atomic<size_t>)];
+};
+
+// Wakes a consumer waiting for a ring to fill. ring() only takes the mutex when
+// the consumer is actually asleep, so a busy pipeline never locks.
+class Doorbell
+{
+public:
+  // Producer, after pushing
+  void ring()
+  {
+    generation_.fetch_add(1);
+    if (waiting_.load()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
+  }
+
+  // Consumer: sleeps until ring() is called, unless ready() already holds
+  template<typename Ready>
+  void wait(Ready ready)
+  {
+    waiting_.store(true);
+    const uint64_t seen = generation_.load();
+    if (!ready()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this, seen] {return generation_.load() != seen;});
+    }
+    waiting_.store(false);
+  }
+
+private:
+  std::atomic<uint64_t> generation_{0};
+  std::atomic<bool> waiting_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__SPSC_RING_HPP_
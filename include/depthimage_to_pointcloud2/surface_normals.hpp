@@ -0,0 +1,166 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__SURFACE_NORMALS_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__SURFACE_NORMALS_HPP_
+
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Where NormalEstimator leaves the normal and curvature of a point: in the
+// padding of the kernel layout (see kPointStep), which the Packer of formats
+// with normals moves into place
+constexpr uint32_t kCurvatureOffset = 12;
+constexpr uint32_t kNormalOffset = kRgbOffset + 4;  // normal_x, normal_y, normal_z
+
+// Normals of an organized cloud from the neighbors every point has on the depth
+// grid, rather than from a nearest neighbor search on the unordered cloud: the
+// cross product of the differences to the points left and right of it and above
+// and below it, facing the viewpoint. Neighbors farther from the point than
+// max_depth_change times its distance to the viewpoint are on the other side of
+// an edge and not used; without both a horizontal and a vertical neighbor a
+// point has no normal (NaN).
+//
+// The curvature is the surface variation of the 3x3 neighborhood, like PCL's:
+// the variance along the normal over the total variance, 0 for a plane.
+class NormalEstimator
+{
+public:
+  NormalEstimator(const std::array<float, 3> & viewpoint, float max_depth_change)
+  : viewpoint_(viewpoint), max_depth_change_squared_(max_depth_change * max_depth_change) {}
+
+  // Estimates the normals of the width points of row in the kernel layout.
+  // above and below are the projected rows next to it, nullptr at the edge of
+  // the cloud; only their x, y and z are read.
+  void estimateRow(
+    const uint8_t * above, uint8_t * row, const uint8_t * below, uint32_t width) const
+  {
+    const float bad_point = std::numeric_limits<float>::quiet_NaN();
+    const uint8_t * const rows[3] = {above, row, below};
+    for (uint32_t u = 0; u < width; ++u) {
+      float * point = reinterpret_cast<float *>(row + static_cast<size_t>(u) * kPointStep);
+      float * normal = point + kNormalOffset / sizeof(float);
+      float & curvature = point[kCurvatureOffset / sizeof(float)];
+      normal[0] = normal[1] = normal[2] = curvature = bad_point;
+      if (std::isnan(point[2])) {
+        continue;
+      }
+
+      const float view[3] = {
+        point[0] - viewpoint_[0], point[1] - viewpoint_[1], point[2] - viewpoint_[2]};
+      const float limit = max_depth_change_squared_ * dot(view, view);
+      // The differences to the 3x3 neighbors, row by row, and which of them are
+      // there and near enough; bad points are NaN and fail the comparison. The
+      // column u - 1 wraps at the left edge.
+      float d[9][3];
+      bool near[9];
+      for (int i = 0; i < 9; ++i) {
+        const uint8_t * points = rows[i / 3];
+        const uint32_t column = u + static_cast<uint32_t>(i % 3) - 1;
+        near[i] = false;
+        if (points == nullptr || column >= width || i == 4) {
+          continue;
+        }
+        const float * other =
+          reinterpret_cast<const float *>(points + static_cast<size_t>(column) * kPointStep);
+        d[i][0] = other[0] - point[0];
+        d[i][1] = other[1] - point[1];
+        d[i][2] = other[2] - point[2];
+        near[i] = dot(d[i], d[i]) <= limit;
+      }
+
+      float du[3];
+      float dv[3];
+      if (!difference(near[3] ? d[3] : nullptr, near[5] ? d[5] : nullptr, du) ||
+        !difference(near[1] ? d[1] : nullptr, near[7] ? d[7] : nullptr, dv))
+      {
+        continue;
+      }
+      float n[3] = {
+        du[1] * dv[2] - du[2] * dv[1],
+        du[2] * dv[0] - du[0] * dv[2],
+        du[0] * dv[1] - du[1] * dv[0]};
+      const float length_squared = dot(n, n);
+      if (!(length_squared > 0.0f)) {
+        continue;
+      }
+      float scale = 1.0f / std::sqrt(length_squared);
+      if (dot(n, view) > 0.0f) {
+        scale = -scale;
+      }
+      for (int i = 0; i < 3; ++i) {
+        n[i] *= scale;
+        normal[i] = n[i];
+      }
+
+      // Around the point rather than the origin, so float keeps the precision;
+      // the point itself is at 0
+      float sum[3] = {0.0f, 0.0f, 0.0f};
+      float sum_squared = 0.0f;
+      float sum_along = 0.0f;
+      float sum_along_squared = 0.0f;
+      float count = 1.0f;
+      for (int i = 0; i < 9; ++i) {
+        if (!near[i]) {
+          continue;
+        }
+        const float along = dot(n, d[i]);
+        sum[0] += d[i][0];
+        sum[1] += d[i][1];
+        sum[2] += d[i][2];
+        sum_squared += dot(d[i], d[i]);
+        sum_along += along;
+        sum_along_squared += along * along;
+        count += 1.0f;
+      }
+      const float variance = sum_squared - dot(sum, sum) / count;
+      const float variance_along = sum_along_squared - sum_along * sum_along / count;
+      curvature = variance > 0.0f ? std::max(variance_along, 0.0f) / variance : 0.0f;
+    }
+  }
+
+private:
+  static float dot(const float * a, const float * b)
+  {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  }
+
+  // The central difference from the differences to the neighbors before and
+  // after the point, or the one-sided one where only one of them is there
+  static bool difference(const float * before, const float * after, float * out)
+  {
+    if (before == nullptr && after == nullptr) {
+      return false;
+    }
+    for (int i = 0; i < 3; ++i) {
+      out[i] = (after != nullptr ? after[i] : 0.0f) - (before != nullptr ? before[i] : 0.0f);
+    }
+    return true;
+  }
+
+  const std::array<float, 3> viewpoint_;
+  const float max_depth_change_squared_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__SURFACE_NORMALS_HPP_
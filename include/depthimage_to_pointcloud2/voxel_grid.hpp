@@ -0,0 +1,140 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__VOXEL_GRID_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__VOXEL_GRID_HPP_
+
+#include "depthimage_to_pointcloud2/row_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// Sparse voxel grid accumulating the points written by the row kernels, which
+// reduces them to one centroid (with the average color) per occupied voxel.
+class VoxelGrid
+{
+public:
+  // Drops all points and starts binning with the given voxel edge length in
+  // meters. The hash table keeps its buckets, so reusing a grid does not allocate.
+  void reset(float leaf_size)
+  {
+    inv_leaf_size_ = 1.0f / leaf_size;
+    voxels_.clear();
+  }
+
+  // Adds a good point in the kernel layout (see kPointStep)
+  void add(const uint8_t * point)
+  {
+    const float * xyz = reinterpret_cast<const float *>(point);
+    uint32_t rgb;
+    std::memcpy(&rgb, point + kRgbOffset, sizeof(rgb));
+
+    Voxel & voxel = voxels_[key(xyz)];
+    voxel.x += xyz[0];
+    voxel.y += xyz[1];
+    voxel.z += xyz[2];
+    voxel.r += (rgb >> 16) & 0xff;
+    voxel.g += (rgb >> 8) & 0xff;
+    voxel.b += rgb & 0xff;
+    ++voxel.count;
+  }
+
+  void merge(const VoxelGrid & other)
+  {
+    for (const auto & entry : other.voxels_) {
+      Voxel & voxel = voxels_[entry.first];
+      voxel.x += entry.second.x;
+      voxel.y += entry.second.y;
+      voxel.z += entry.second.z;
+      voxel.r += entry.second.r;
+      voxel.g += entry.second.g;
+      voxel.b += entry.second.b;
+      voxel.count += entry.second.count;
+    }
+  }
+
+  size_t size() const {return voxels_.size();}
+
+  // Writes size() centroids in the kernel layout to out, ordered by voxel index
+  // so that the same points always give the same cloud
+  void writeCentroids(uint8_t * out) const
+  {
+    std::vector<std::pair<uint64_t, const Voxel *>> sorted;
+    sorted.reserve(voxels_.size());
+    for (const auto & entry : voxels_) {
+      sorted.emplace_back(entry.first, &entry.second);
+    }
+    std::sort(
+      sorted.begin(), sorted.end(),
+      [](const std::pair<uint64_t, const Voxel *> & a, const std::pair<uint64_t, const Voxel *> & b)
+      {return a.first < b.first;});
+
+    for (const auto & entry : sorted) {
+      const Voxel & voxel = *entry.second;
+      const double inv_count = 1.0 / voxel.count;
+      float point[kPointStep / sizeof(float)] = {};
+      point[0] = static_cast<float>(voxel.x * inv_count);
+      point[1] = static_cast<float>(voxel.y * inv_count);
+      point[2] = static_cast<float>(voxel.z * inv_count);
+      uint32_t rgb = (average(voxel.r, voxel.count) << 16) |
+        (average(voxel.g, voxel.count) << 8) | average(voxel.b, voxel.count);
+      std::memcpy(&point[kRgbOffset / sizeof(float)], &rgb, sizeof(rgb));
+      std::memcpy(out, point, kPointStep);
+      out += kPointStep;
+    }
+  }
+
+private:
+  struct Voxel
+  {
+    double x = 0.0;
+    double y = 0.0;
+    double z = 0.0;
+    uint64_t r = 0;
+    uint64_t g = 0;
+    uint64_t b = 0;
+    uint32_t count = 0;
+  };
+
+  static uint32_t average(uint64_t sum, uint32_t count)
+  {
+    return static_cast<uint32_t>((sum + count / 2) / count);
+  }
+
+  // 21 bits per axis, i.e. +-2^20 voxels around the sensor
+  uint64_t key(const float * xyz) const
+  {
+    uint64_t result = 0;
+    for (int i = 0; i < 3; ++i) {
+      int64_t index = static_cast<int64_t>(std::floor(xyz[i] * inv_leaf_size_)) + (1 << 20);
+      result = (result << 21) | (static_cast<uint64_t>(index) & 0x1fffff);
+    }
+    return result;
+  }
+
+  float inv_leaf_size_ = 1.0f;
+  std::unordered_map<uint64_t, Voxel> voxels_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__VOXEL_GRID_HPP_
@@ -0,0 +1,164 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2__WORKER_POOL_HPP_
+#define DEPTHIMAGE_TO_POINTCLOUD2__WORKER_POOL_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+
+// A fixed set of threads, started once, that split a range of rows between them.
+// The thread calling parallelFor() works on the first band itself, so a pool of
+// size 1 has no extra threads and runs everything inline.
+class WorkerPool
+{
+public:
+  using BandFunction = std::function<void (size_t band_begin, size_t band_end)>;
+
+  explicit WorkerPool(size_t num_threads)
+  : num_threads_(num_threads == 0 ? 1 : num_threads)
+  {
+    threads_.reserve(num_threads_ - 1);
+    for (size_t i = 1; i < num_threads_; ++i) {
+      threads_.emplace_back(&WorkerPool::run, this, i);
+    }
+  }
+
+  ~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (std::thread & thread : threads_) {
+      thread.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool & operator=(const WorkerPool &) = delete;
+
+  size_t size() const {return num_threads_;}
+
+  // Splits [begin, end) into size() contiguous bands and calls fn once per
+  // non-empty band. Band boundaries only depend on the range and the pool size.
+  // Blocks until all bands are done and rethrows the first exception thrown by fn.
+  void parallelFor(size_t begin, size_t end, const BandFunction & fn)
+  {
+    if (end <= begin) {
+      return;
+    }
+    if (num_threads_ == 1 || end - begin == 1) {
+      fn(begin, end);
+      return;
+    }
+
+    std::lock_guard<std::mutex> call_lock(call_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &fn;
+      begin_ = begin;
+      end_ = end;
+      pending_ = num_threads_ - 1;
+      error_ = nullptr;
+      ++generation_;
+    }
+    start_cv_.notify_all();
+
+    runBand(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] {return pending_ == 0;});
+    task_ = nullptr;
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+private:
+  void runBand(size_t index)
+  {
+    const size_t length = end_ - begin_;
+    const size_t band_begin = begin_ + length * index / num_threads_;
+    const size_t band_end = begin_ + length * (index + 1) / num_threads_;
+    if (band_begin == band_end) {
+      return;
+    }
+    try {
+      (*task_)(band_begin, band_end);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+    }
+  }
+
+  void run(size_t index)
+  {
+    uint64_t seen_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cv_.wait(lock, [this, seen_generation] {
+            return stop_ || generation_ != seen_generation;
+          });
+        if (stop_) {
+          return;
+        }
+        seen_generation = generation_;
+      }
+
+      runBand(index);
+
+      bool last;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last = --pending_ == 0;
+      }
+      if (last) {
+        done_cv_.notify_one();
+      }
+    }
+  }
+
+  const size_t num_threads_;
+  std::vector<std::thread> threads_;
+
+  std::mutex call_mutex_;  // serializes parallelFor() callers
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  const BandFunction * task_ = nullptr;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  size_t pending_ = 0;
+  uint64_t generation_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // DEPTHIMAGE_TO_POINTCLOUD2__WORKER_POOL_HPP_
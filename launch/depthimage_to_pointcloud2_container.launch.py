@@ -0,0 +1,45 @@
+from launch.actions import DeclareLaunchArgument
+from launch.substitutions import LaunchConfiguration, PythonExpression
+
+from launch import LaunchDescription
+from launch_ros.actions import ComposableNodeContainer
+from launch_ros.descriptions import ComposableNode
+def generate_launch_description():
+    return LaunchDescription([
+        DeclareLaunchArgument(
+            'full_sensor_topic',
+            default_value=['/my_depth_sensor'],
+            description='Base for topic (and node) names'),
+        DeclareLaunchArgument(
+            'range_max',
+            default_value='0.0',
+            description='Max range of depth sensor'),
+        DeclareLaunchArgument(
+            'use_quiet_nan',
+            default_value='true',
+            description='Use quiet NaN instead of range_max'),
+        DeclareLaunchArgument(
+            'container_name',
+            default_value='depthimage_to_pointcloud2_container',
+            description='Name of the component container to create'),
+        ComposableNodeContainer(
+            name=LaunchConfiguration('container_name'),
+            namespace='',
+            package='rclcpp_components',
+            executable='component_container_mt',
+            output='screen',
+            composable_node_descriptions=[
+                ComposableNode(
+                    package='depthimage_to_pointcloud2',
+                    plugin='depthimage_to_pointcloud2::Depthimage2Pointcloud2',
+                    name=[PythonExpression(["'", LaunchConfiguration('full_sensor_topic'), "'.split('/')[-1]"]), '_depth2pc2'],
+                    parameters=[{'range_max': LaunchConfiguration('range_max'),
+                                 'use_quiet_nan': LaunchConfiguration('use_quiet_nan')}],
+                    remappings=[
+                        ("depth", [LaunchConfiguration('full_sensor_topic'), "/image"]),
+                        ("depth_camera_info", [LaunchConfiguration('full_sensor_topic'), "/camera_info"]),
+                        ("pointcloud2", [PythonExpression(["'", LaunchConfiguration('full_sensor_topic'), "'.split('/')[-1]"]), "_pointcloud2"])
+                    ],
+                    extra_arguments=[{'use_intra_process_comms': True}]),
+            ])
+    ])
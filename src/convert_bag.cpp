@@ -0,0 +1,491 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Converts the depth images of a rosbag2 bag offline, as fast as the machine
+// goes rather than at the rate they were recorded: frames are converted in
+// batches, a frame per thread, and written to a new bag or to PCD files.
+
+#include <cv_bridge/cv_bridge.h>
+
+#include <depthimage_to_pointcloud2/cloud_pool.hpp>
+#include <depthimage_to_pointcloud2/color_samplers.hpp>
+#include <depthimage_to_pointcloud2/decimation.hpp>
+#include <depthimage_to_pointcloud2/depth_conversions.hpp>
+#include <depthimage_to_pointcloud2/pcd_writer.hpp>
+#include <depthimage_to_pointcloud2/point_formats.hpp>
+#include <depthimage_to_pointcloud2/projection_cache.hpp>
+#include <depthimage_to_pointcloud2/worker_pool.hpp>
+
+#include <rclcpp/serialization.hpp>
+#include <rclcpp/serialized_message.hpp>
+#include <rclcpp/time.hpp>
+#include <rosbag2_cpp/reader.hpp>
+#include <rosbag2_cpp/writer.hpp>
+#include <rosbag2_storage/serialized_bag_message.hpp>
+#include <rosbag2_storage/storage_options.hpp>
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+const char kUsage[] =
+  "usage: depthimage_to_pointcloud2_bag --input BAG --depth-topic TOPIC --info-topic TOPIC\n"
+  "         (--output-bag BAG [--cloud-topic TOPIC] | --output-pcd DIRECTORY)\n"
+  "         [--color-topic TOPIC] [--threads N] [--batch N] [--range-max METERS]\n"
+  "         [--use-quiet-nan] [--output-dense] [--decimation N] [--decimation-mode MODE]\n"
+  "         [--depth-scale SCALE] [--point-format FORMAT] [--quantization-scale METERS]\n"
+  "         [--rectify]\n"
+  "\n"
+  "Converts every depth image on --depth-topic with the last camera info on\n"
+  "--info-topic before it, colored from the image on --color-topic nearest to its\n"
+  "stamp. Clouds go to --cloud-topic (by default pointcloud2 next to the depth\n"
+  "topic) of a new bag, or to DIRECTORY/<sec>.<nanosec>.pcd. The options are the\n"
+  "node's parameters of the same names; --threads defaults to one per core and\n"
+  "--batch, the frames converted at once, to 2 per thread.\n";
+
+struct Settings
+{
+  std::string input;
+  std::string depth_topic;
+  std::string info_topic;
+  std::string color_topic;
+  std::string output_bag;
+  std::string cloud_topic;
+  std::string output_pcd;
+  size_t threads = 0;
+  size_t batch = 0;
+  bool rectify = false;
+  depthimage_to_pointcloud2::PointFormat point_format =
+    depthimage_to_pointcloud2::PointFormat::XYZRGB;
+  depthimage_to_pointcloud2::ConversionOptions options;
+};
+
+// Throws std::invalid_argument with what is wrong
+Settings parseArguments(int argc, char ** argv)
+{
+  Settings settings;
+  for (int i = 1; i < argc; ++i) {
+    const std::string name = argv[i];
+    auto value = [&]() -> std::string {
+        if (i + 1 >= argc) {
+          throw std::invalid_argument(name + " needs a value");
+        }
+        return argv[++i];
+      };
+    auto number = [&]() {
+        const std::string text = value();
+        char * end = nullptr;
+        const double result = std::strtod(text.c_str(), &end);
+        if (end == text.c_str() || *end != '\0') {
+          throw std::invalid_argument(name + " needs a number, not " + text);
+        }
+        return result;
+      };
+    if (name == "--input") {
+      settings.input = value();
+    } else if (name == "--depth-topic") {
+      settings.depth_topic = value();
+    } else if (name == "--info-topic") {
+      settings.info_topic = value();
+    } else if (name == "--color-topic") {
+      settings.color_topic = value();
+    } else if (name == "--output-bag") {
+      settings.output_bag = value();
+    } else if (name == "--cloud-topic") {
+      settings.cloud_topic = value();
+    } else if (name == "--output-pcd") {
+      settings.output_pcd = value();
+    } else if (name == "--threads") {
+      settings.threads = static_cast<size_t>(std::max(number(), 1.0));
+    } else if (name == "--batch") {
+      settings.batch = static_cast<size_t>(std::max(number(), 1.0));
+    } else if (name == "--range-max") {
+      settings.options.range_max = number();
+    } else if (name == "--use-quiet-nan") {
+      settings.options.use_quiet_nan = true;
+    } else if (name == "--output-dense") {
+      settings.options.output_dense = true;
+    } else if (name == "--decimation") {
+      settings.options.decimation = static_cast<uint32_t>(std::max(number(), 1.0));
+    } else if (name == "--decimation-mode") {
+      const std::string mode = value();
+      if (!depthimage_to_pointcloud2::decimationModeFromString(
+          mode, settings.options.decimation_mode))
+      {
+        throw std::invalid_argument("Unknown decimation mode " + mode);
+      }
+    } else if (name == "--depth-scale") {
+      settings.options.depth_scale = number();
+    } else if (name == "--point-format") {
+      const std::string format = value();
+      if (!depthimage_to_pointcloud2::pointFormatFromString(format, settings.point_format)) {
+        throw std::invalid_argument("Unknown point format " + format);
+      }
+    } else if (name == "--quantization-scale") {
+      settings.options.quantization_scale = static_cast<float>(number());
+    } else if (name == "--rectify") {
+      settings.rectify = true;
+    } else {
+      throw std::invalid_argument("Unknown argument " + name);
+    }
+  }
+
+  if (settings.input.empty() || settings.depth_topic.empty() || settings.info_topic.empty()) {
+    throw std::invalid_argument("--input, --depth-topic and --info-topic are needed");
+  }
+  if (settings.output_bag.empty() == settings.output_pcd.empty()) {
+    throw std::invalid_argument("Either --output-bag or --output-pcd is needed");
+  }
+  if (!(settings.options.depth_scale > 0.0) || !(settings.options.quantization_scale > 0.0f)) {
+    throw std::invalid_argument("--depth-scale and --quantization-scale must be > 0");
+  }
+  if (!depthimage_to_pointcloud2::pointFormatHasRgb(settings.point_format) &&
+    !settings.color_topic.empty())
+  {
+    std::fprintf(stderr, "The point format has no color, ignoring --color-topic\n");
+    settings.color_topic.clear();
+  }
+  if (settings.cloud_topic.empty()) {
+    const size_t slash = settings.depth_topic.rfind('/');
+    settings.cloud_topic = (slash == std::string::npos ? std::string() :
+      settings.depth_topic.substr(0, slash)) + "/pointcloud2";
+  }
+  if (settings.threads == 0) {
+    settings.threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+  if (settings.batch == 0) {
+    settings.batch = 2 * settings.threads;
+  }
+  return settings;
+}
+
+int64_t nanoseconds(const builtin_interfaces::msg::Time & stamp)
+{
+  return static_cast<int64_t>(stamp.sec) * 1000000000 + stamp.nanosec;
+}
+
+// A depth image with what it is converted with, and its cloud
+struct Frame
+{
+  sensor_msgs::msg::Image::ConstSharedPtr depth;
+  sensor_msgs::msg::Image::ConstSharedPtr color;
+  std::shared_ptr<const depthimage_to_pointcloud2::ProjectionCache> projection;
+  rcutils_time_point_value_t bag_time = 0;
+  sensor_msgs::msg::PointCloud2 cloud;
+  std::shared_ptr<rclcpp::SerializedMessage> serialized_cloud;
+  std::string error;
+};
+
+class BagConverter
+{
+public:
+  explicit BagConverter(const Settings & settings)
+  : settings_(settings), pool_(settings.threads)
+  {
+    frames_.resize(settings_.batch);
+  }
+
+  void run()
+  {
+    rosbag2_cpp::Reader reader;
+    reader.open(settings_.input);
+    checkTopic(reader, settings_.depth_topic, "sensor_msgs/msg/Image");
+    checkTopic(reader, settings_.info_topic, "sensor_msgs/msg/CameraInfo");
+    if (!settings_.color_topic.empty()) {
+      checkTopic(reader, settings_.color_topic, "sensor_msgs/msg/Image");
+    }
+    if (!settings_.output_bag.empty()) {
+      // Without a cache the clouds are written right away, so their serialized
+      // buffers can be reused
+      rosbag2_storage::StorageOptions storage_options;
+      storage_options.uri = settings_.output_bag;
+      storage_options.max_cache_size = 0;
+      writer_ = std::make_unique<rosbag2_cpp::Writer>();
+      writer_->open(storage_options);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    while (reader.has_next()) {
+      std::shared_ptr<rosbag2_storage::SerializedBagMessage> message = reader.read_next();
+      rclcpp::SerializedMessage serialized(*message->serialized_data);
+      if (message->topic_name == settings_.info_topic) {
+        sensor_msgs::msg::CameraInfo info;
+        info_serialization_.deserialize_message(&serialized, &info);
+        updateProjection(info);
+      } else if (message->topic_name == settings_.color_topic) {
+        auto color = std::make_shared<sensor_msgs::msg::Image>();
+        image_serialization_.deserialize_message(&serialized, color.get());
+        colors_[nanoseconds(color->header.stamp)] = color;
+      } else if (message->topic_name == settings_.depth_topic) {
+        if (projection_ == nullptr) {
+          ++skipped_;
+          continue;
+        }
+        if (pending_ == frames_.size()) {
+          // The color images never caught up
+          convertPending();
+        }
+        auto depth = std::make_shared<sensor_msgs::msg::Image>();
+        image_serialization_.deserialize_message(&serialized, depth.get());
+        Frame & frame = frames_[pending_++];
+        frame.depth = depth;
+        frame.projection = projection_;
+        frame.bag_time = message->time_stamp;
+      }
+      // Wait for the color images stamped up to the last depth image, which
+      // may come after it
+      if (pending_ == frames_.size() && (settings_.color_topic.empty() ||
+        (!colors_.empty() && colors_.rbegin()->first >= lastDepthStamp())))
+      {
+        convertPending();
+      }
+    }
+    convertPending();
+
+    const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    std::fprintf(stderr,
+      "Converted %zu depth images in %.1f s (%.1f per second), %zu failed, "
+      "%zu before any camera info\n",
+      converted_, seconds, converted_ / std::max(seconds, 1e-9), failed_, skipped_);
+  }
+
+private:
+  static void checkTopic(
+    rosbag2_cpp::Reader & reader, const std::string & topic, const std::string & type)
+  {
+    for (const auto & metadata : reader.get_all_topics_and_types()) {
+      if (metadata.name == topic) {
+        if (metadata.type != type) {
+          throw std::runtime_error(topic + " has " + metadata.type + " rather than " + type);
+        }
+        return;
+      }
+    }
+    throw std::runtime_error("The bag has no topic " + topic);
+  }
+
+  int64_t lastDepthStamp() const
+  {
+    return nanoseconds(frames_[pending_ - 1].depth->header.stamp);
+  }
+
+  // Only rebuilds the ray tables when the calibration actually changes
+  void updateProjection(const sensor_msgs::msg::CameraInfo & info)
+  {
+    if (projection_ != nullptr && projection_->matches(info)) {
+      return;
+    }
+    depthimage_to_pointcloud2::ProjectionCache full_resolution(
+      info, info.width, info.height, settings_.rectify);
+    if (settings_.options.decimation > 1) {
+      projection_ = std::make_shared<depthimage_to_pointcloud2::ProjectionCache>(
+        full_resolution.decimated(
+          settings_.options.decimation,
+          depthimage_to_pointcloud2::decimationSamplesBlockCenter(
+            settings_.options.decimation_mode)));
+    } else {
+      projection_ = std::make_shared<depthimage_to_pointcloud2::ProjectionCache>(
+        std::move(full_resolution));
+    }
+  }
+
+  // The color image nearest to stamp
+  sensor_msgs::msg::Image::ConstSharedPtr nearestColor(int64_t stamp) const
+  {
+    if (colors_.empty()) {
+      return nullptr;
+    }
+    auto after = colors_.lower_bound(stamp);
+    if (after == colors_.begin()) {
+      return after->second;
+    }
+    auto before = std::prev(after);
+    if (after == colors_.end() || stamp - before->first <= after->first - stamp) {
+      return before->second;
+    }
+    return after->second;
+  }
+
+  // Converts the pending frames, a frame per thread at a time, and writes them
+  // in the order they were read
+  void convertPending()
+  {
+    if (pending_ == 0) {
+      return;
+    }
+    for (size_t i = 0; i < pending_; ++i) {
+      frames_[i].color = nearestColor(nanoseconds(frames_[i].depth->header.stamp));
+    }
+    // The colors before the last depth image are not needed anymore, but for
+    // the one closest to it
+    auto keep = colors_.lower_bound(lastDepthStamp());
+    if (keep != colors_.begin()) {
+      colors_.erase(colors_.begin(), std::prev(keep));
+    }
+
+    pool_.parallelFor(0, pending_, [this](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          convertFrame(frames_[i]);
+        }
+      });
+
+    for (size_t i = 0; i < pending_; ++i) {
+      Frame & frame = frames_[i];
+      if (!frame.error.empty()) {
+        std::fprintf(stderr, "Depth image at %" PRId64 " ns: %s\n",
+          nanoseconds(frame.depth->header.stamp), frame.error.c_str());
+        ++failed_;
+      } else {
+        if (writer_ != nullptr) {
+          writer_->write(
+            frame.serialized_cloud, settings_.cloud_topic, "sensor_msgs/msg/PointCloud2",
+            rclcpp::Time(frame.bag_time));
+        }
+        ++converted_;
+      }
+      // The clouds keep their buffers for the next batch
+      frame.depth.reset();
+      frame.color.reset();
+      frame.projection.reset();
+      frame.error.clear();
+    }
+    pending_ = 0;
+  }
+
+  // Everything but the bag writes, which have to be in order, happens here on
+  // the frame's thread: decoding the color, converting, and serializing the
+  // cloud or writing its PCD file
+  void convertFrame(Frame & frame)
+  {
+    try {
+      cv_bridge::CvImageConstPtr cv_ptr;
+      if (frame.color != nullptr) {
+        cv_ptr = cv_bridge::toCvShare(frame.color, frame.color->encoding);
+      }
+      frame.cloud.header = frame.depth->header;
+      switch (settings_.point_format) {
+        case depthimage_to_pointcloud2::PointFormat::XYZ:
+          fillCloud<depthimage_to_pointcloud2::PointXYZ>(frame, cv_ptr);
+          break;
+        case depthimage_to_pointcloud2::PointFormat::XYZ_HALF:
+          fillCloud<depthimage_to_pointcloud2::PointXYZHalf>(frame, cv_ptr);
+          break;
+        case depthimage_to_pointcloud2::PointFormat::XYZ_INT16:
+          fillCloud<depthimage_to_pointcloud2::PointXYZQuantized>(frame, cv_ptr);
+          break;
+        case depthimage_to_pointcloud2::PointFormat::XYZRGB_NORMAL:
+          fillCloud<depthimage_to_pointcloud2::PointXYZRGBNormal>(frame, cv_ptr);
+          break;
+        default:
+          fillCloud<depthimage_to_pointcloud2::PointXYZRGB>(frame, cv_ptr);
+          break;
+      }
+
+      if (writer_ != nullptr) {
+        if (frame.serialized_cloud == nullptr) {
+          frame.serialized_cloud = std::make_shared<rclcpp::SerializedMessage>();
+        }
+        cloud_serialization_.serialize_message(&frame.cloud, frame.serialized_cloud.get());
+      } else {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%d.%09u.pcd",
+          frame.depth->header.stamp.sec, frame.depth->header.stamp.nanosec);
+        depthimage_to_pointcloud2::writePcd(frame.cloud, settings_.output_pcd + name);
+      }
+    } catch (const std::exception & e) {
+      frame.error = e.what();
+    }
+  }
+
+  template<typename Format>
+  void fillCloud(Frame & frame, const cv_bridge::CvImageConstPtr & cv_ptr)
+  {
+    const sensor_msgs::msg::Image::ConstSharedPtr & image = frame.depth;
+    const depthimage_to_pointcloud2::ProjectionCache & projection = *frame.projection;
+    depthimage_to_pointcloud2::prepareCloud<Format>(
+      frame.cloud, projection.width(), projection.height());
+    const depthimage_to_pointcloud2::ColorSource color(cv_ptr);
+
+    // mono16 is 16UC1 under another name
+    if (image->encoding == sensor_msgs::image_encodings::TYPE_16UC1 ||
+      image->encoding == sensor_msgs::image_encodings::MONO16)
+    {
+      depthimage_to_pointcloud2::convert<uint16_t, Format>(
+        image, frame.cloud, projection, settings_.options, color);
+    } else if (image->encoding == sensor_msgs::image_encodings::TYPE_32SC1) {
+      depthimage_to_pointcloud2::convert<int32_t, Format>(
+        image, frame.cloud, projection, settings_.options, color);
+    } else if (image->encoding == sensor_msgs::image_encodings::TYPE_64FC1) {
+      depthimage_to_pointcloud2::convert<double, Format>(
+        image, frame.cloud, projection, settings_.options, color);
+    } else if (image->encoding == sensor_msgs::image_encodings::TYPE_32FC1) {
+      depthimage_to_pointcloud2::convert<float, Format>(
+        image, frame.cloud, projection, settings_.options, color);
+    } else {
+      throw std::runtime_error("Depth image has unsupported encoding " + image->encoding);
+    }
+  }
+
+  const Settings settings_;
+  depthimage_to_pointcloud2::WorkerPool pool_;
+  std::unique_ptr<rosbag2_cpp::Writer> writer_;
+  rclcpp::Serialization<sensor_msgs::msg::Image> image_serialization_;
+  rclcpp::Serialization<sensor_msgs::msg::CameraInfo> info_serialization_;
+  rclcpp::Serialization<sensor_msgs::msg::PointCloud2> cloud_serialization_;
+
+  std::shared_ptr<const depthimage_to_pointcloud2::ProjectionCache> projection_;
+  std::map<int64_t, sensor_msgs::msg::Image::ConstSharedPtr> colors_;
+  std::vector<Frame> frames_;
+  size_t pending_ = 0;
+  size_t converted_ = 0;
+  size_t failed_ = 0;
+  size_t skipped_ = 0;
+};
+
+}  // namespace
+
+int main(int argc, char ** argv)
+{
+  Settings settings;
+  try {
+    settings = parseArguments(argc, argv);
+  } catch (const std::invalid_argument & e) {
+    std::fprintf(stderr, "%s\n\n%s", e.what(), kUsage);
+    return 2;
+  }
+  try {
+    BagConverter(settings).run();
+  } catch (const std::exception & e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "convert_kernels.hpp"
+
+#include <cuda_runtime.h>
+
+#include <cstdint>
+
+namespace depthimage_to_pointcloud2
+{
+namespace cuda
+{
+namespace
+{
+
+// The device side of DepthTraits::valid(); the unit is in ConvertParams::scale
+template<typename T>
+struct DeviceDepth {};
+
+template<>
+struct DeviceDepth<uint16_t>
+{
+  __device__ static bool valid(uint16_t depth) {return depth != 0;}
+};
+
+template<>
+struct DeviceDepth<float>
+{
+  __device__ static bool valid(float depth) {return isfinite(depth);}
+};
+
+// One thread per pixel, writing the same point projectRowScalar() and the color
+// samplers do
+template<typename T>
+__global__ void convertKernel(const ConvertParams params)
+{
+  const uint32_t u = blockIdx.x * blockDim.x + threadIdx.x;
+  const uint32_t v = blockIdx.y * blockDim.y + threadIdx.y;
+  if (u >= params.width || v >= params.height) {
+    return;
+  }
+
+  const T depth = reinterpret_cast<const T *>(params.depth + v * params.depth_step)[u];
+  float z = static_cast<float>(depth) * params.scale;
+  bool bad = false;
+  if (!DeviceDepth<T>::valid(depth) || (params.check_max && z > params.z_max)) {
+    if (params.clamp_invalid) {
+      z = params.z_max;
+    } else {
+      bad = true;
+    }
+  }
+
+  float4 * out = reinterpret_cast<float4 *>(params.out + v * params.out_step) + 2 * u;
+  if (bad) {
+    const float nan = __int_as_float(0x7fc00000);
+    out[0] = make_float4(nan, nan, nan, 0.0f);
+    out[1] = make_float4(nan, 0.0f, 0.0f, 0.0f);
+    return;
+  }
+
+  const size_t pixel = static_cast<size_t>(v) * params.width + u;
+  float x = (params.rectified ? params.ray_x[pixel] : params.ray_x[u]) * z;
+  float y = (params.rectified ? params.ray_y[pixel] : params.ray_y[v]) * z;
+  float rgb = 0.0f;
+  if (params.color != nullptr && u < params.color_width && v < params.color_height) {
+    const uint8_t * color = params.color + v * params.color_step + u * params.color_channels;
+    rgb = __uint_as_float(
+      (static_cast<uint32_t>(color[params.color_r]) << 16) |
+      (static_cast<uint32_t>(color[params.color_g]) << 8) | color[params.color_b]);
+  }
+  if (params.transform_points) {
+    const float * m = params.transform;
+    const float tx = m[0] * x + m[1] * y + m[2] * z + m[3];
+    const float ty = m[4] * x + m[5] * y + m[6] * z + m[7];
+    const float tz = m[8] * x + m[9] * y + m[10] * z + m[11];
+    x = tx;
+    y = ty;
+    z = tz;
+  }
+  out[0] = make_float4(x, y, z, 0.0f);
+  out[1] = make_float4(rgb, 0.0f, 0.0f, 0.0f);
+}
+
+}  // namespace
+
+cudaError_t convertOnDevice(const ConvertParams & params, bool float_depth, cudaStream_t stream)
+{
+  const dim3 block(32, 8);
+  const dim3 grid((params.width + block.x - 1) / block.x, (params.height + block.y - 1) / block.y);
+  if (float_depth) {
+    convertKernel<float><<<grid, block, 0, stream>>>(params);
+  } else {
+    convertKernel<uint16_t><<<grid, block, 0, stream>>>(params);
+  }
+  return cudaGetLastError();
+}
+
+}  // namespace cuda
+}  // namespace depthimage_to_pointcloud2
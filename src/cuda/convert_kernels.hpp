@@ -0,0 +1,77 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CUDA__CONVERT_KERNELS_HPP_
+#define CUDA__CONVERT_KERNELS_HPP_
+
+#include <cuda_runtime_api.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Only plain types cross into convert_kernels.cu, so nvcc never sees the ROS or
+// SIMD headers
+
+namespace depthimage_to_pointcloud2
+{
+namespace cuda
+{
+
+// What convertOnDevice() projects, all pointers being device pointers
+struct ConvertParams
+{
+  const uint8_t * depth;
+  size_t depth_step;
+  uint32_t width;
+  uint32_t height;
+
+  // Per column and per row like ProjectionCache::rayX() and rayY(v), or per
+  // pixel if rectified
+  const float * ray_x;
+  const float * ray_y;
+  bool rectified;
+
+  // See RowLimits
+  float scale;
+  float z_max;
+  bool check_max;
+  bool clamp_invalid;
+
+  // Pixel-aligned 8 bit color image, or nullptr; the byte indices of red, green
+  // and blue in its pixels of color_channels bytes
+  const uint8_t * color;
+  size_t color_step;
+  uint32_t color_width;
+  uint32_t color_height;
+  int color_channels;
+  int color_r;
+  int color_g;
+  int color_b;
+
+  // Row-major 3x4 matrix applied to the points if transform_points
+  bool transform_points;
+  float transform[12];
+
+  // Organized cloud in the kernel layout (see kPointStep)
+  uint8_t * out;
+  size_t out_step;
+};
+
+// Queues the conversion of a 16UC1 or 32FC1 image on stream
+cudaError_t convertOnDevice(const ConvertParams & params, bool float_depth, cudaStream_t stream);
+
+}  // namespace cuda
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // CUDA__CONVERT_KERNELS_HPP_
@@ -0,0 +1,324 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cuda_converter.hpp"
+#include "convert_kernels.hpp"
+
+#include <cuda_runtime_api.h>
+
+#include <depthimage_to_pointcloud2/color_samplers.hpp>
+#include <depthimage_to_pointcloud2/point_formats.hpp>
+#include <depthimage_to_pointcloud2/row_kernels.hpp>
+
+#include <sensor_msgs/image_encodings.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace depthimage_to_pointcloud2
+{
+namespace
+{
+
+void check(cudaError_t error, const char * what)
+{
+  if (error != cudaSuccess) {
+    throw std::runtime_error(std::string("CUDA ") + what + " failed: " + cudaGetErrorString(error));
+  }
+}
+
+// Device memory that only ever grows
+class DeviceBuffer
+{
+public:
+  DeviceBuffer() = default;
+  DeviceBuffer(const DeviceBuffer &) = delete;
+  DeviceBuffer & operator=(const DeviceBuffer &) = delete;
+
+  ~DeviceBuffer()
+  {
+    cudaFree(data_);
+  }
+
+  uint8_t * reserve(size_t size)
+  {
+    if (size > capacity_) {
+      cudaFree(data_);
+      data_ = nullptr;
+      capacity_ = 0;
+      check(cudaMalloc(reinterpret_cast<void **>(&data_), size), "cudaMalloc");
+      capacity_ = size;
+    }
+    return data_;
+  }
+
+  const uint8_t * data() const {return data_;}
+
+private:
+  uint8_t * data_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+// Page-locked host memory, which the device copies from without staging it
+// again, or reads directly if it is mapped
+class PinnedBuffer
+{
+public:
+  PinnedBuffer() = default;
+  PinnedBuffer(const PinnedBuffer &) = delete;
+  PinnedBuffer & operator=(const PinnedBuffer &) = delete;
+
+  ~PinnedBuffer()
+  {
+    cudaFreeHost(data_);
+  }
+
+  uint8_t * reserve(size_t size, bool mapped)
+  {
+    if (size > capacity_) {
+      cudaFreeHost(data_);
+      data_ = nullptr;
+      capacity_ = 0;
+      check(
+        cudaHostAlloc(
+          reinterpret_cast<void **>(&data_), size,
+          mapped ? cudaHostAllocMapped : cudaHostAllocDefault),
+        "cudaHostAlloc");
+      capacity_ = size;
+      if (mapped) {
+        check(
+          cudaHostGetDevicePointer(reinterpret_cast<void **>(&device_data_), data_, 0),
+          "cudaHostGetDevicePointer");
+      }
+    }
+    return data_;
+  }
+
+  const uint8_t * deviceData() const {return device_data_;}
+
+private:
+  uint8_t * data_ = nullptr;
+  uint8_t * device_data_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+}  // namespace
+
+struct CudaConverter::Impl
+{
+  cudaStream_t stream = nullptr;
+  // The device shares memory with the host, so mapped pinned memory needs no copy
+  bool zero_copy = false;
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool rectified = false;
+  DeviceBuffer ray_x;
+  DeviceBuffer ray_y;
+
+  PinnedBuffer depth_staging;
+  PinnedBuffer color_staging;
+  DeviceBuffer depth;
+  DeviceBuffer color;
+  DeviceBuffer cloud;
+
+  // Copies rows of row_bytes (step apart) into staging and queues the upload,
+  // returns where the kernel finds them, row_bytes apart
+  const uint8_t * upload(
+    const uint8_t * data, size_t step, size_t row_bytes, uint32_t rows,
+    PinnedBuffer & staging, DeviceBuffer & device)
+  {
+    const size_t size = row_bytes * rows;
+    uint8_t * host = staging.reserve(size, zero_copy);
+    if (step == row_bytes) {
+      std::memcpy(host, data, size);
+    } else {
+      for (uint32_t v = 0; v < rows; ++v) {
+        std::memcpy(host + v * row_bytes, data + v * step, row_bytes);
+      }
+    }
+    if (zero_copy) {
+      return staging.deviceData();
+    }
+    uint8_t * device_data = device.reserve(size);
+    check(
+      cudaMemcpyAsync(device_data, host, size, cudaMemcpyHostToDevice, stream),
+      "cudaMemcpyAsync");
+    return device_data;
+  }
+};
+
+CudaConverter::CudaConverter()
+: impl_(std::make_unique<Impl>())
+{
+  int device_count = 0;
+  check(cudaGetDeviceCount(&device_count), "cudaGetDeviceCount");
+  if (device_count == 0) {
+    throw std::runtime_error("No CUDA device");
+  }
+  int device = 0;
+  check(cudaGetDevice(&device), "cudaGetDevice");
+  cudaDeviceProp properties;
+  check(cudaGetDeviceProperties(&properties, device), "cudaGetDeviceProperties");
+  impl_->zero_copy = properties.integrated && properties.canMapHostMemory;
+  check(cudaStreamCreateWithFlags(&impl_->stream, cudaStreamNonBlocking), "cudaStreamCreate");
+}
+
+CudaConverter::~CudaConverter()
+{
+  if (impl_->stream != nullptr) {
+    cudaStreamSynchronize(impl_->stream);
+    cudaStreamDestroy(impl_->stream);
+  }
+}
+
+bool CudaConverter::supports(const ConversionOptions & options)
+{
+  const PixelRoi & roi = options.roi;
+  return options.decimation <= 1 && !options.output_dense && !(options.voxel_size > 0.0f) &&
+         roi.x_offset == 0 && roi.y_offset == 0 && roi.width == 0 && roi.height == 0 &&
+         !(options.range_min > 0.0) && !options.crop_box.bounded() && options.filter == nullptr;
+}
+
+void CudaConverter::setProjection(const ProjectionCache & projection)
+{
+  if (projection.decimation() != 1) {
+    throw std::runtime_error("CUDA conversion does not support decimation");
+  }
+  const size_t x_count = projection.rectified() ?
+    static_cast<size_t>(projection.width()) * projection.height() : projection.width();
+  const size_t y_count = projection.rectified() ?
+    static_cast<size_t>(projection.width()) * projection.height() : projection.height();
+  std::vector<float> ray_y(y_count);
+  for (uint32_t v = 0; v < projection.height(); ++v) {
+    if (projection.rectified()) {
+      std::memcpy(
+        &ray_y[static_cast<size_t>(v) * projection.width()], projection.rayYRow(v),
+        projection.width() * sizeof(float));
+    } else {
+      ray_y[v] = projection.rayY(v);
+    }
+  }
+
+  check(
+    cudaMemcpy(
+      impl_->ray_x.reserve(x_count * sizeof(float)), projection.rayX(),
+      x_count * sizeof(float), cudaMemcpyHostToDevice),
+    "cudaMemcpy");
+  check(
+    cudaMemcpy(
+      impl_->ray_y.reserve(y_count * sizeof(float)), ray_y.data(),
+      y_count * sizeof(float), cudaMemcpyHostToDevice),
+    "cudaMemcpy");
+  impl_->width = projection.width();
+  impl_->height = projection.height();
+  impl_->rectified = projection.rectified();
+}
+
+void CudaConverter::convert(
+  const sensor_msgs::msg::Image & depth_msg,
+  sensor_msgs::msg::PointCloud2 & cloud_msg,
+  const ConversionOptions & options,
+  const cv_bridge::CvImageConstPtr & cv_ptr)
+{
+  if (!supports(options)) {
+    throw std::runtime_error("CUDA conversion does not support these options");
+  }
+  if (depth_msg.width != impl_->width || depth_msg.height != impl_->height) {
+    throw std::runtime_error("Projection tables do not match the depth image");
+  }
+  if (!PointXYZRGB::hasFields(cloud_msg) || cloud_msg.width != impl_->width ||
+    cloud_msg.height != impl_->height)
+  {
+    throw std::runtime_error("Point cloud is not set up for the depth image");
+  }
+  const bool float_depth = depth_msg.encoding == sensor_msgs::image_encodings::TYPE_32FC1;
+  if (!float_depth && depth_msg.encoding != sensor_msgs::image_encodings::TYPE_16UC1 &&
+    depth_msg.encoding != sensor_msgs::image_encodings::MONO16)
+  {
+    throw std::runtime_error("Unsupported depth encoding " + depth_msg.encoding);
+  }
+  const size_t depth_size = float_depth ? sizeof(float) : sizeof(uint16_t);
+
+  cuda::ConvertParams params;
+  params.width = impl_->width;
+  params.height = impl_->height;
+  params.depth_step = params.width * depth_size;
+  params.depth = impl_->upload(
+    depth_msg.data.data(), depth_msg.step, params.depth_step, params.height,
+    impl_->depth_staging, impl_->depth);
+
+  params.ray_x = reinterpret_cast<const float *>(impl_->ray_x.data());
+  params.ray_y = reinterpret_cast<const float *>(impl_->ray_y.data());
+  params.rectified = impl_->rectified;
+
+  const RowLimits limits = float_depth ?
+    RowLimits::make<float>(options.range_max, options.use_quiet_nan, options.depth_scale) :
+    RowLimits::make<uint16_t>(options.range_max, options.use_quiet_nan, options.depth_scale);
+  params.scale = limits.scale;
+  params.z_max = limits.z_max;
+  params.check_max = limits.check_max;
+  params.clamp_invalid = limits.clamp_invalid;
+
+  params.color = nullptr;
+  const ColorLayout layout = cv_ptr != nullptr && !cv_ptr->image.empty() ?
+    colorLayout(cv_ptr->encoding, cv_ptr->image.type()) : ColorLayout::NONE;
+  if (layout != ColorLayout::NONE) {
+    const cv::Mat & image = cv_ptr->image;
+    struct Channels {int count, r, g, b;};
+    const Channels channels =
+      layout == ColorLayout::GRAY ? Channels{1, 0, 0, 0} :
+      layout == ColorLayout::BGR ? Channels{3, 2, 1, 0} :
+      layout == ColorLayout::RGB ? Channels{3, 0, 1, 2} :
+      layout == ColorLayout::BGRA ? Channels{4, 2, 1, 0} : Channels{4, 0, 1, 2};
+    params.color_width = static_cast<uint32_t>(image.cols);
+    params.color_height = static_cast<uint32_t>(image.rows);
+    params.color_step = params.color_width * channels.count;
+    params.color = impl_->upload(
+      image.ptr<uint8_t>(0), image.step, params.color_step, params.color_height,
+      impl_->color_staging, impl_->color);
+    params.color_channels = channels.count;
+    params.color_r = channels.r;
+    params.color_g = channels.g;
+    params.color_b = channels.b;
+  }
+
+  params.transform_points = options.transform_points;
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      params.transform[row * 4 + col] =
+        static_cast<float>(options.transform.rotation[row * 3 + col]);
+    }
+    params.transform[row * 4 + 3] = static_cast<float>(options.transform.translation[row]);
+  }
+
+  const size_t cloud_size = cloud_msg.data.size();
+  params.out_step = cloud_msg.row_step;
+  params.out = impl_->cloud.reserve(cloud_size);
+  check(cuda::convertOnDevice(params, float_depth, impl_->stream), "kernel launch");
+  check(
+    cudaMemcpyAsync(
+      cloud_msg.data.data(), params.out, cloud_size, cudaMemcpyDeviceToHost, impl_->stream),
+    "cudaMemcpyAsync");
+  // The staging buffers are reused by the next frame, and the cloud is published
+  // right after this returns
+  check(cudaStreamSynchronize(impl_->stream), "cudaStreamSynchronize");
+}
+
+}  // namespace depthimage_to_pointcloud2
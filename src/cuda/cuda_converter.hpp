@@ -0,0 +1,69 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CUDA__CUDA_CONVERTER_HPP_
+#define CUDA__CUDA_CONVERTER_HPP_
+
+#include <depthimage_to_pointcloud2/depth_conversions.hpp>
+#include <depthimage_to_pointcloud2/projection_cache.hpp>
+
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <memory>
+
+#include <cv_bridge/cv_bridge.h>
+
+namespace depthimage_to_pointcloud2
+{
+
+// convert<T, PointXYZRGB>() on a CUDA device, for the organized clouds without
+// decimation that most pipelines publish. The ray tables stay on the device
+// until setProjection() is called with new ones. Depth and color images go
+// through pinned staging buffers; on devices sharing memory with the host (e.g.
+// Jetson) the kernel reads them in place rather than after a copy.
+// Errors throw std::runtime_error.
+class CudaConverter
+{
+public:
+  // Uses the current CUDA device, throws if there is none
+  CudaConverter();
+  ~CudaConverter();
+
+  CudaConverter(const CudaConverter &) = delete;
+  CudaConverter & operator=(const CudaConverter &) = delete;
+
+  // Whether convert() handles these options, otherwise use the CPU path
+  static bool supports(const ConversionOptions & options);
+
+  // Uploads the tables convert() projects with
+  void setProjection(const ProjectionCache & projection);
+
+  // Fills cloud_msg, set up with prepareCloud<PointXYZRGB>(), from a 16UC1, mono16
+  // or 32FC1 depth image, coloring the points from the pixel-aligned cv_ptr if it is
+  // set. The projection must have been set for the depth image's size.
+  void convert(
+    const sensor_msgs::msg::Image & depth_msg,
+    sensor_msgs::msg::PointCloud2 & cloud_msg,
+    const ConversionOptions & options,
+    const cv_bridge::CvImageConstPtr & cv_ptr);
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+#endif  // CUDA__CUDA_CONVERTER_HPP_
@@ -15,21 +15,74 @@
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <depthimage_to_pointcloud2/cloud_pool.hpp>
+#include <depthimage_to_pointcloud2/color_samplers.hpp>
+#include <depthimage_to_pointcloud2/compressed_depth.hpp>
+#include <depthimage_to_pointcloud2/conversion_stats.hpp>
+#include <depthimage_to_pointcloud2/decimation.hpp>
 #include <depthimage_to_pointcloud2/depth_conversions.hpp>
+#include <depthimage_to_pointcloud2/depth_filters.hpp>
+#include <depthimage_to_pointcloud2/point_formats.hpp>
+#include <depthimage_to_pointcloud2/projection_cache.hpp>
+#include <depthimage_to_pointcloud2/registration.hpp>
+#include <depthimage_to_pointcloud2/rigid_transform.hpp>
+#include <depthimage_to_pointcloud2/spsc_ring.hpp>
+#include <depthimage_to_pointcloud2/worker_pool.hpp>
 
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
+#include <diagnostic_msgs/msg/diagnostic_status.hpp>
+#include <diagnostic_msgs/msg/key_value.hpp>
 #include <image_geometry/pinhole_camera_model.h>
+#include <message_filters/subscriber.h>
+#include <message_filters/sync_policies/approximate_time.h>
+#include <message_filters/sync_policies/exact_time.h>
+#include <message_filters/synchronizer.h>
 #include <rclcpp/rclcpp.hpp>
+#include <rclcpp_components/register_node_macro.hpp>
 #include <sensor_msgs/image_encodings.hpp>
 #include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/compressed_image.hpp>
 #include <sensor_msgs/msg/image.hpp>
 #include <sensor_msgs/msg/point_cloud2.hpp>
 #include <sensor_msgs/point_cloud2_iterator.hpp>
+#include <statistics_msgs/msg/metrics_message.hpp>
+#include <statistics_msgs/msg/statistic_data_type.hpp>
+#include <tf2/exceptions.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/buffer_interface.h>
+#include <tf2_ros/transform_listener.h>
 
-// #include <limits>
-// #include <functional>
-// #include <memory>
-// #include <string>
-// #include <vector>
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+#include "cuda/cuda_converter.hpp"
+#endif
+
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+#include <depthimage_to_pointcloud2/cloud_compression.hpp>
+#include <point_cloud_interfaces/msg/compressed_point_cloud2.hpp>
+#endif
+
+// Publisher matched events are only in rclcpp 21 (Iron) and later
+#if defined(__has_include)
+#if __has_include(<rclcpp/version.h>)
+#include <rclcpp/version.h>
+#endif
+#endif
+#if defined(RCLCPP_VERSION_MAJOR) && RCLCPP_VERSION_MAJOR >= 21
+#define DEPTHIMAGE_TO_POINTCLOUD2_MATCHED_EVENTS
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 /* Usage example remapping:
 $ ros2 run depthimage_to_pointcloud2 depthimage_to_pointcloud2_node \
@@ -37,50 +90,511 @@ $ ros2 run depthimage_to_pointcloud2 depthimage_to_pointcloud2_node \
 */
 
 using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
 
 /* This example creates a subclass of Node and uses std::bind() to register a
 * member function as a callback from the timer. */
 
-class Depthimage2Pointcloud2 : public rclcpp::Node
+namespace depthimage_to_pointcloud2
+{
+
+// How the node converts, from its parameters; the same for all of its cameras
+struct CameraSettings
+{
+  depthimage_to_pointcloud2::ConversionOptions conversion_options;
+  depthimage_to_pointcloud2::DepthFilterOptions filter_options;
+  depthimage_to_pointcloud2::PointFormat point_format =
+    depthimage_to_pointcloud2::PointFormat::XYZRGB;
+  bool colorful = false;
+  bool register_color = false;
+  bool rectify = false;
+  std::string target_frame;
+  bool use_cuda = false;
+  bool latest_only = false;
+  bool pipeline = false;
+  size_t pipeline_depth = 2;
+  depthimage_to_pointcloud2::Overflow pipeline_overflow =
+    depthimage_to_pointcloud2::Overflow::DROP_OLDEST;
+  double max_age = 0.0;
+  bool lazy_subscribe = false;
+  bool compressed_depth = false;
+  bool compress = false;
+  int compression_level = 3;
+  rclcpp::QoS qos{10};
+  rclcpp::QoS pointcloud_qos{10};
+  std::string sync = "approximate";
+  int sync_queue_size = 10;
+};
+
+// What the parameter callback can change while the node runs. A camera swaps
+// it as a whole, so every frame is converted with one consistent set.
+struct ConversionConfig
+{
+  depthimage_to_pointcloud2::ConversionOptions options;
+  depthimage_to_pointcloud2::PointFormat point_format;
+};
+
+// The subscriptions, ray tables and publisher of one depth camera. Its topics are
+// the node's topics under the camera's name (e.g. front/depth and
+// front/pointcloud2 for the camera front), or the node's topics themselves for
+// the unnamed camera. Each camera has a callback group of its own, so with a
+// multi-threaded executor cameras are converted in parallel.
+class DepthCamera
 {
   public:
-    Depthimage2Pointcloud2(const rclcpp::NodeOptions & options)
-    : Node("depthimage_to_pointcloud2_node", options)
+    DepthCamera(
+      rclcpp::Node & node, const std::string & name, const CameraSettings & settings,
+      depthimage_to_pointcloud2::WorkerPool * pool, tf2_ros::Buffer * tf_buffer)
+    : node(node), camera_name(name), topic_prefix(name.empty() ? "" : name + "/"),
+      config(std::make_shared<const ConversionConfig>(
+          ConversionConfig{settings.conversion_options, settings.point_format})),
+      colorful(settings.colorful),
+      register_color(settings.register_color), rectify(settings.rectify),
+      target_frame(settings.target_frame), latest_only(settings.latest_only),
+      overflow(settings.latest_only ?
+        depthimage_to_pointcloud2::Overflow::DROP_OLDEST : settings.pipeline_overflow),
+      max_age(settings.max_age), lazy_subscribe(settings.lazy_subscribe),
+      compressed_depth(settings.compressed_depth), qos(settings.qos),
+      pool(pool), tf_buffer(tf_buffer),
+      cloud_pool(std::max<size_t>(4, settings.pipeline_depth + 2))
     {
-      range_max = this->declare_parameter("range_max", 0.0);
-      use_quiet_nan = this->declare_parameter("use_quiet_nan", true);
-      colorful = this->declare_parameter("colorful", false);
+      callback_group = node.create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+      subscription_options.callback_group = callback_group;
+
+      if (settings.use_cuda) {
+        setUpCuda();
+      }
+      // The temporal state is the camera's own
+      if (settings.filter_options.enabled()) {
+        depth_filter = std::make_unique<depthimage_to_pointcloud2::DepthFilter>(
+          settings.filter_options);
+      }
+
+      // Nothing is converted while there are no subscribers. With lazy_subscribe
+      // the depth (and color) images are not even received then.
+      rclcpp::PublisherOptions pub_options;
+      pub_options.callback_group = callback_group;
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_MATCHED_EVENTS
+      if (lazy_subscribe) {
+        pub_options.event_callbacks.matched_callback = [this](rclcpp::MatchedInfo &) {
+            updateSubscriptions();
+          };
+      }
+#endif
+      g_pub_point_cloud = node.create_publisher<sensor_msgs::msg::PointCloud2>(
+        topic_prefix + "pointcloud2", settings.pointcloud_qos, pub_options);
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+      // Where point_cloud_transport subscribers of pointcloud2 look for its zstd
+      // transport
+      if (settings.compress) {
+        compressor = std::make_unique<depthimage_to_pointcloud2::ZstdCloudCompressor>(
+          settings.compression_level);
+        compressed_pub =
+          node.create_publisher<point_cloud_interfaces::msg::CompressedPointCloud2>(
+          topic_prefix + "pointcloud2/zstd", settings.pointcloud_qos, pub_options);
+      }
+#endif
+#ifndef DEPTHIMAGE_TO_POINTCLOUD2_MATCHED_EVENTS
+      if (lazy_subscribe) {
+        lazy_timer = node.create_wall_timer(
+          std::chrono::seconds(1), std::bind(&DepthCamera::updateSubscriptions, this),
+          callback_group);
+      }
+#endif
 
-      g_pub_point_cloud = this->create_publisher<sensor_msgs::msg::PointCloud2>("pointcloud2", 10);
+      // In latest_only and pipeline mode the callbacks only hand their messages to
+      // the conversion thread. latest_only keeps just the newest depth image
+      // waiting; pipeline keeps pipeline_depth and publishes on yet another thread,
+      // which serializes a cloud while the conversion thread fills the next one.
+      if (latest_only || settings.pipeline) {
+        frames = std::make_unique<depthimage_to_pointcloud2::SpscRing<PendingFrame>>(
+          latest_only ? 1 : settings.pipeline_depth);
+        conversion_thread = std::thread(&DepthCamera::conversionLoop, this);
+      }
+      if (settings.pipeline) {
+        clouds = std::make_unique<depthimage_to_pointcloud2::SpscRing<ConvertedCloud>>(
+          settings.pipeline_depth);
+        publish_thread = std::thread(&DepthCamera::publishLoop, this);
+      }
 
       if (colorful){
-        image_sub = this->create_subscription<sensor_msgs::msg::Image>(
-          "image", 10, std::bind(&Depthimage2Pointcloud2::imageCb, this, _1));
+        // Depth, color and camera info are matched by their stamps, so every cloud
+        // is colored from the image taken with its depth image
+        if (settings.sync == "exact") {
+          exact_sync = std::make_shared<ExactSync>(
+            ExactPolicy(settings.sync_queue_size), depth_filter_sub, image_filter_sub,
+            cam_info_filter_sub);
+          exact_sync->registerCallback(std::bind(&DepthCamera::syncedCb, this, _1, _2, _3));
+        } else {
+          approximate_sync = std::make_shared<ApproximateSync>(
+            ApproximatePolicy(settings.sync_queue_size), depth_filter_sub, image_filter_sub,
+            cam_info_filter_sub);
+          approximate_sync->registerCallback(
+            std::bind(&DepthCamera::syncedCb, this, _1, _2, _3));
+        }
+
+        if (register_color) {
+          // The color camera has its own calibration and pose, every point is
+          // reprojected into it (see ColorRegistration)
+          color_cam_info_sub = node.create_subscription<sensor_msgs::msg::CameraInfo>(
+            topic_prefix + "color_camera_info", qos,
+            std::bind(&DepthCamera::colorInfoCb, this, _1), subscription_options);
+        }
+      } else {
+        cam_info_sub = node.create_subscription<sensor_msgs::msg::CameraInfo>(
+          topic_prefix + "depth_camera_info", qos, std::bind(&DepthCamera::camInfoCb, this, _1),
+          subscription_options);
+      }
+
+      if (!lazy_subscribe || hasSubscribers()) {
+        subscribeImages();
       }
+    }
+
+    ~DepthCamera()
+    {
+      stop_pipeline.store(true);
+      frames_bell.ring();
+      clouds_bell.ring();
+      if (conversion_thread.joinable()) {
+        conversion_thread.join();
+      }
+      if (publish_thread.joinable()) {
+        publish_thread.join();
+      }
+    }
+
+    DepthCamera(const DepthCamera &) = delete;
+    DepthCamera & operator=(const DepthCamera &) = delete;
+
+    const std::string & name() const {return camera_name;}
 
-      depthimage_sub = this->create_subscription<sensor_msgs::msg::Image>(
-        "depth", 10, std::bind(&Depthimage2Pointcloud2::depthCb, this, _1));
-      cam_info_sub = this->create_subscription<sensor_msgs::msg::CameraInfo>(
-        "depth_camera_info", 10, std::bind(&Depthimage2Pointcloud2::infoCb, this, _1));
+    depthimage_to_pointcloud2::ConversionStats & statistics() {return stats;}
+
+    // Converts the following frames with the conversion options and point format
+    // of settings. The ray tables are rebuilt by the converting thread if the
+    // decimation changed.
+    void reconfigure(const CameraSettings & settings)
+    {
+      std::atomic_store(
+        &config, std::make_shared<const ConversionConfig>(
+          ConversionConfig{settings.conversion_options, settings.point_format}));
+    }
+
+    // The frame of the depth camera, once its camera info arrived
+    std::string hardwareId() const
+    {
+      const sensor_msgs::msg::CameraInfo::ConstSharedPtr cam_info = std::atomic_load(&g_cam_info);
+      return nullptr == cam_info ? "" : cam_info->header.frame_id;
     }
 
   private:
-    void imageCb(const sensor_msgs::msg::Image::SharedPtr msg)
+    typedef message_filters::sync_policies::ApproximateTime<
+        sensor_msgs::msg::Image, sensor_msgs::msg::Image, sensor_msgs::msg::CameraInfo>
+      ApproximatePolicy;
+    typedef message_filters::sync_policies::ExactTime<
+        sensor_msgs::msg::Image, sensor_msgs::msg::Image, sensor_msgs::msg::CameraInfo>
+      ExactPolicy;
+    typedef message_filters::Synchronizer<ApproximatePolicy> ApproximateSync;
+    typedef message_filters::Synchronizer<ExactPolicy> ExactSync;
+
+    // Messages waiting for the conversion thread in latest_only and pipeline mode
+    struct PendingFrame
+    {
+      sensor_msgs::msg::Image::ConstSharedPtr depth;
+      cv_bridge::CvImageConstPtr cv_ptr;
+      sensor_msgs::msg::CameraInfo::ConstSharedPtr info;
+      std::chrono::steady_clock::time_point received;
+      // Decoded into depth right before the conversion, if set
+      sensor_msgs::msg::CompressedImage::ConstSharedPtr compressed_depth;
+    };
+
+    // A cloud waiting for the publish thread in pipeline mode
+    struct ConvertedCloud
+    {
+      std::unique_ptr<sensor_msgs::msg::PointCloud2> cloud;
+      std::chrono::steady_clock::time_point received;
+    };
+
+    bool hasSubscribers() const
+    {
+      return hasRawSubscribers() || compressedSubscriptionCount() > 0;
+    }
+
+    bool hasRawSubscribers() const
+    {
+      return g_pub_point_cloud->get_subscription_count() +
+             g_pub_point_cloud->get_intra_process_subscription_count() > 0;
+    }
+
+    size_t compressedSubscriptionCount() const
+    {
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+      if (nullptr != compressed_pub) {
+        return compressed_pub->get_subscription_count() +
+               compressed_pub->get_intra_process_subscription_count();
+      }
+#endif
+      return 0;
+    }
+
+    // Compresses cloud right after it was filled, while it is still in cache, on
+    // whichever thread converted it. compressed_cloud, and the buffer it keeps, is
+    // only used by that thread.
+    void publishCompressed(
+      const sensor_msgs::msg::PointCloud2 & cloud, depthimage_to_pointcloud2::StageTimer & timer)
+    {
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+      if (compressedSubscriptionCount() == 0) {
+        return;
+      }
+      try {
+        compressor->compress(cloud, compressed_cloud);
+      } catch (const std::runtime_error & e) {
+        RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
+          "Cannot compress the point cloud: %s", e.what());
+        return;
+      }
+      compressed_pub->publish(compressed_cloud);
+      timer.record(depthimage_to_pointcloud2::Stage::COMPRESS);
+#else
+      (void)cloud;
+      (void)timer;
+#endif
+    }
+
+    // The image subscriptions, synchronized in colorful mode; the depth camera
+    // info of the plain mode stays subscribed so the ray tables are ready
+    void subscribeImages()
+    {
+      if (colorful) {
+        depth_filter_sub.subscribe(
+          &node, topic_prefix + "depth", qos.get_rmw_qos_profile(), subscription_options);
+        image_filter_sub.subscribe(
+          &node, topic_prefix + "image", qos.get_rmw_qos_profile(), subscription_options);
+        cam_info_filter_sub.subscribe(
+          &node, topic_prefix + "depth_camera_info", qos.get_rmw_qos_profile(),
+          subscription_options);
+      } else if (compressed_depth) {
+        // Where image_transport publishes the compressedDepth transport of depth
+        compressed_depth_sub = node.create_subscription<sensor_msgs::msg::CompressedImage>(
+          topic_prefix + "depth/compressedDepth", qos,
+          std::bind(&DepthCamera::compressedDepthCb, this, _1), subscription_options);
+      } else {
+        depthimage_sub = node.create_subscription<sensor_msgs::msg::Image>(
+          topic_prefix + "depth", qos, std::bind(&DepthCamera::depthCb, this, _1),
+          subscription_options);
+      }
+      images_subscribed = true;
+    }
+
+    void unsubscribeImages()
+    {
+      if (colorful) {
+        depth_filter_sub.unsubscribe();
+        image_filter_sub.unsubscribe();
+        cam_info_filter_sub.unsubscribe();
+      } else {
+        depthimage_sub.reset();
+        compressed_depth_sub.reset();
+      }
+      images_subscribed = false;
+    }
+
+    // lazy_subscribe: follows the subscribers of the cloud coming and going
+    void updateSubscriptions()
     {
+      const bool wanted = hasSubscribers();
+      if (wanted && !images_subscribed) {
+        RCLCPP_INFO(node.get_logger(), "Subscribers connected, subscribing to the %simages",
+          topic_prefix.c_str());
+        subscribeImages();
+      } else if (!wanted && images_subscribed) {
+        RCLCPP_INFO(node.get_logger(), "No subscribers left, unsubscribing from the %simages",
+          topic_prefix.c_str());
+        unsubscribeImages();
+      }
+    }
 
+    void setUpCuda()
+    {
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+      try {
+        cuda_converter = std::make_unique<depthimage_to_pointcloud2::CudaConverter>();
+      } catch (const std::runtime_error & e) {
+        RCLCPP_WARN(node.get_logger(), "%s, using cpu", e.what());
+      }
+#endif
+    }
+
+    void syncedCb(
+      const sensor_msgs::msg::Image::ConstSharedPtr & depth,
+      const sensor_msgs::msg::Image::ConstSharedPtr & image,
+      const sensor_msgs::msg::CameraInfo::ConstSharedPtr & info)
+    {
+      const auto received = std::chrono::steady_clock::now();
+      if (!hasSubscribers()) {
+        // Keep the ray tables up to date, but skip the conversion
+        stats.skip();
+        camInfoCb(info);
+        return;
+      }
+      cv_bridge::CvImageConstPtr cv_ptr;
       try
       {
-          cv_ptr = cv_bridge::toCvShare(msg, msg->encoding);
+          cv_ptr = cv_bridge::toCvShare(image, image->encoding);
       }
       catch (cv_bridge::Exception& e)
       {
-          RCLCPP_ERROR(this->get_logger(), "cv_bridge exception: %s", e.what());
+          RCLCPP_ERROR(node.get_logger(), "cv_bridge exception: %s", e.what());
+          stats.drop(depthimage_to_pointcloud2::Drop::BAD_COLOR_IMAGE);
           return;
       }
+      process(PendingFrame{depth, cv_ptr, info, received, nullptr});
     }
 
-  private:
-    void depthCb(const sensor_msgs::msg::Image::SharedPtr image)
+    void depthCb(const sensor_msgs::msg::Image::ConstSharedPtr image)
+    {
+      if (!hasSubscribers()) {
+        stats.skip();
+        return;
+      }
+      process(PendingFrame{image, nullptr, nullptr, std::chrono::steady_clock::now(), nullptr});
+    }
+
+    void compressedDepthCb(const sensor_msgs::msg::CompressedImage::ConstSharedPtr image)
+    {
+      if (!hasSubscribers()) {
+        stats.skip();
+        return;
+      }
+      process(PendingFrame{nullptr, nullptr, nullptr, std::chrono::steady_clock::now(), image});
+    }
+
+    void camInfoCb(const sensor_msgs::msg::CameraInfo::ConstSharedPtr info)
+    {
+      if (nullptr == frames) {
+        infoCb(info);
+        return;
+      }
+      std::atomic_store(&pending_info, info);
+      frames_bell.ring();
+    }
+
+    // Converts frame right away, or leaves it for the conversion thread. The
+    // callbacks of a camera share a mutually exclusive callback group, so they are
+    // the single producer of its ring.
+    void process(PendingFrame frame)
+    {
+      if (nullptr == frames) {
+        convertFrame(frame);
+        return;
+      }
+      if (!frames->push(std::move(frame), overflow)) {
+        dropOverflow();
+      }
+      frames_bell.ring();
+    }
+
+    void dropOverflow()
+    {
+      stats.drop(overflow == depthimage_to_pointcloud2::Overflow::DROP_OLDEST ?
+        depthimage_to_pointcloud2::Drop::SUPERSEDED :
+        depthimage_to_pointcloud2::Drop::PIPELINE_FULL);
+    }
+
+    // Everything that touches the ray tables runs here in latest_only and pipeline
+    // mode, so the callbacks never wait for a conversion
+    void conversionLoop()
+    {
+      while (!stop_pipeline.load()) {
+        const sensor_msgs::msg::CameraInfo::ConstSharedPtr info =
+          std::atomic_exchange(&pending_info, sensor_msgs::msg::CameraInfo::ConstSharedPtr());
+        if (nullptr != info) {
+          infoCb(info);
+        }
+        PendingFrame frame;
+        if (frames->tryPop(frame)) {
+          convertFrame(frame);
+          continue;
+        }
+        frames_bell.wait([this] {
+            return stop_pipeline.load() || !frames->empty() ||
+                   nullptr != std::atomic_load(&pending_info);
+          });
+      }
+    }
+
+    // Publishes what the conversion thread filled in pipeline mode
+    void publishLoop()
+    {
+      while (!stop_pipeline.load()) {
+        ConvertedCloud converted;
+        if (!clouds->tryPop(converted)) {
+          clouds_bell.wait([this] {return stop_pipeline.load() || !clouds->empty();});
+          continue;
+        }
+        depthimage_to_pointcloud2::StageTimer timer(stats);
+        const builtin_interfaces::msg::Time stamp = converted.cloud->header.stamp;
+        if (node.get_node_options().use_intra_process_comms()) {
+          g_pub_point_cloud->publish(std::move(converted.cloud));
+        } else {
+          g_pub_point_cloud->publish(*converted.cloud);
+          cloud_pool.release(std::move(converted.cloud));
+        }
+        timer.record(depthimage_to_pointcloud2::Stage::PUBLISH);
+        recordPublished(stamp, converted.received);
+      }
+    }
+
+    void recordPublished(
+      const builtin_interfaces::msg::Time & stamp, std::chrono::steady_clock::time_point received)
+    {
+      stats.record(
+        depthimage_to_pointcloud2::Stage::CALLBACK, std::chrono::steady_clock::now() - received);
+      stats.record(
+        depthimage_to_pointcloud2::Stage::LATENCY,
+        std::chrono::nanoseconds((node.now() - rclcpp::Time(stamp)).nanoseconds()));
+    }
+
+    void convertFrame(const PendingFrame & frame)
+    {
+      if (nullptr != frame.info) {
+        infoCb(frame.info);
+      }
+      sensor_msgs::msg::Image::ConstSharedPtr depth = frame.depth;
+      if (nullptr != frame.compressed_depth) {
+        depth = decodeDepth(*frame.compressed_depth);
+        if (nullptr == depth) {
+          return;
+        }
+      }
+      convertDepth(depth, frame.cv_ptr, frame.received);
+    }
+
+    // Decodes into decoded_depth, which only the converting thread uses, so its
+    // buffer is reused for every frame
+    sensor_msgs::msg::Image::ConstSharedPtr decodeDepth(
+      const sensor_msgs::msg::CompressedImage & compressed)
+    {
+      depthimage_to_pointcloud2::StageTimer timer(stats);
+      try {
+        decoder.decode(compressed, *decoded_depth);
+      } catch (const std::runtime_error & e) {
+        RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
+          "Cannot decode the compressed depth image: %s", e.what());
+        stats.drop(depthimage_to_pointcloud2::Drop::BAD_COMPRESSED_DEPTH);
+        return nullptr;
+      }
+      timer.record(depthimage_to_pointcloud2::Stage::DECODE);
+      return decoded_depth;
+    }
+
+    void convertDepth(
+      const sensor_msgs::msg::Image::ConstSharedPtr & image,
+      const cv_bridge::CvImageConstPtr & cv_ptr,
+      std::chrono::steady_clock::time_point received)
     {
       // The meat of this function is a port of the code from:
       // https://github.com/ros-perception/image_pipeline/blob/92d7f6b/depth_image_proc/src/nodelets/point_cloud_xyz.cpp
@@ -88,61 +602,851 @@ class Depthimage2Pointcloud2 : public rclcpp::Node
       if (nullptr == g_cam_info) {
         // we haven't gotten the camera info yet, so just drop until we do
         RCUTILS_LOG_WARN("No camera info, skipping point cloud conversion");
+        stats.drop(depthimage_to_pointcloud2::Drop::NO_CAMERA_INFO);
         return;
       }
 
-      sensor_msgs::msg::PointCloud2::SharedPtr cloud_msg =
-        std::make_shared<sensor_msgs::msg::PointCloud2>();
-      cloud_msg->header = image->header;
-      cloud_msg->height = image->height;
-      cloud_msg->width = image->width;
-      cloud_msg->is_dense = false;
-      cloud_msg->is_bigendian = false;
-      cloud_msg->fields.clear();
-      cloud_msg->fields.reserve(2);
-
-      sensor_msgs::PointCloud2Modifier pcd_modifier(*cloud_msg);
-      pcd_modifier.setPointCloud2FieldsByString(2, "xyz", "rgb");
-
-      // g_cam_info here is a sensor_msg::msg::CameraInfo::SharedPtr,
-      // which we get from the depth_camera_info topic.
-      image_geometry::PinholeCameraModel model;
-      model.fromCameraInfo(g_cam_info);
-
-      if (image->encoding == sensor_msgs::image_encodings::TYPE_16UC1) {
-        depthimage_to_pointcloud2::convert<uint16_t>(image, cloud_msg, model, range_max, use_quiet_nan, cv_ptr);
-      } else if (image->encoding == sensor_msgs::image_encodings::TYPE_32FC1) {
-        depthimage_to_pointcloud2::convert<float>(image, cloud_msg, model, range_max, use_quiet_nan, cv_ptr);
-      } else {
+      // A cloud this old is of no use to anyone any more
+      if (max_age > 0.0 && (node.now() - rclcpp::Time(image->header.stamp)).seconds() > max_age) {
+        stats.drop(depthimage_to_pointcloud2::Drop::TOO_OLD);
+        return;
+      }
+
+      if (image->encoding != sensor_msgs::image_encodings::TYPE_16UC1 &&
+        image->encoding != sensor_msgs::image_encodings::MONO16 &&
+        image->encoding != sensor_msgs::image_encodings::TYPE_32SC1 &&
+        image->encoding != sensor_msgs::image_encodings::TYPE_32FC1 &&
+        image->encoding != sensor_msgs::image_encodings::TYPE_64FC1)
+      {
         RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
           "Depth image has unsupported encoding [%s]", image->encoding.c_str());
+        stats.drop(depthimage_to_pointcloud2::Drop::UNSUPPORTED_ENCODING);
         return;
       }
 
-      g_pub_point_cloud->publish(*cloud_msg);
+      depthimage_to_pointcloud2::StageTimer timer(stats);
+      const std::shared_ptr<const ConversionConfig> frame_config = std::atomic_load(&config);
+
+      // The ray tables are built from g_cam_info in infoCb(); they only need to be
+      // rebuilt here if the depth image does not have the calibrated size, or the
+      // decimation was reconfigured.
+      if (projection->sourceWidth() != image->width || projection->sourceHeight() != image->height ||
+        !projectionMatches(frame_config->options))
+      {
+        updateProjection(*g_cam_info, image->width, image->height, frame_config->options);
+        timer.record(depthimage_to_pointcloud2::Stage::CAMERA_INFO);
+      }
+
+      // With a target_frame the points are transformed as they are converted,
+      // rather than by another node after publishing
+      depthimage_to_pointcloud2::ConversionOptions options = frame_config->options;
+      const depthimage_to_pointcloud2::PointFormat point_format = frame_config->point_format;
+      options.filter = depth_filter.get();
+      if (!target_frame.empty() && target_frame != image->header.frame_id) {
+        try {
+          options.transform = depthimage_to_pointcloud2::RigidTransform::fromTransform(
+            tf_buffer->lookupTransform(
+              target_frame, image->header.frame_id,
+              tf2_ros::fromMsg(image->header.stamp)).transform);
+          options.transform_points = true;
+        } catch (const tf2::TransformException & e) {
+          RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
+            "No transform to [%s], skipping point cloud conversion: %s",
+            target_frame.c_str(), e.what());
+          stats.drop(depthimage_to_pointcloud2::Drop::NO_TRANSFORM);
+          return;
+        }
+        timer.record(depthimage_to_pointcloud2::Stage::TRANSFORM);
+      }
+
+      const depthimage_to_pointcloud2::ColorSource color = colorSource(*image, cv_ptr);
+      if (cv_ptr != nullptr) {
+        timer.record(depthimage_to_pointcloud2::Stage::COLOR);
+      }
+
+      // Only the clouds with subscribers are published, the compressed one right
+      // after converting
+      const bool publish_raw = hasRawSubscribers();
+      if (nullptr != clouds && publish_raw) {
+        auto cloud_msg = cloud_pool.acquire();
+        fillCloud(image, color, cv_ptr, options, point_format, *cloud_msg);
+        timer.record(depthimage_to_pointcloud2::Stage::CONVERT);
+        publishCompressed(*cloud_msg, timer);
+        if (!clouds->push(ConvertedCloud{std::move(cloud_msg), received}, overflow)) {
+          dropOverflow();
+        }
+        clouds_bell.ring();
+        return;
+      }
+
+      // Write the cloud straight into middleware memory when the RMW can loan it,
+      // otherwise hand over ownership so intra-process subscribers get it without a copy.
+      // Without intra-process communication publishing by reference only serializes
+      // the cloud, so it can be recycled for the next frame right away.
+      if (!publish_raw) {
+        auto cloud_msg = cloud_pool.acquire();
+        fillCloud(image, color, cv_ptr, options, point_format, *cloud_msg);
+        timer.record(depthimage_to_pointcloud2::Stage::CONVERT);
+        publishCompressed(*cloud_msg, timer);
+        cloud_pool.release(std::move(cloud_msg));
+      } else if (g_pub_point_cloud->can_loan_messages()) {
+        auto cloud_msg = g_pub_point_cloud->borrow_loaned_message();
+        fillCloud(image, color, cv_ptr, options, point_format, cloud_msg.get());
+        timer.record(depthimage_to_pointcloud2::Stage::CONVERT);
+        publishCompressed(cloud_msg.get(), timer);
+        g_pub_point_cloud->publish(std::move(cloud_msg));
+      } else if (node.get_node_options().use_intra_process_comms()) {
+        auto cloud_msg = std::make_unique<sensor_msgs::msg::PointCloud2>();
+        fillCloud(image, color, cv_ptr, options, point_format, *cloud_msg);
+        timer.record(depthimage_to_pointcloud2::Stage::CONVERT);
+        publishCompressed(*cloud_msg, timer);
+        g_pub_point_cloud->publish(std::move(cloud_msg));
+      } else {
+        auto cloud_msg = cloud_pool.acquire();
+        fillCloud(image, color, cv_ptr, options, point_format, *cloud_msg);
+        timer.record(depthimage_to_pointcloud2::Stage::CONVERT);
+        publishCompressed(*cloud_msg, timer);
+        g_pub_point_cloud->publish(*cloud_msg);
+        cloud_pool.release(std::move(cloud_msg));
+      }
+      timer.record(depthimage_to_pointcloud2::Stage::PUBLISH);
+      recordPublished(image->header.stamp, received);
+    }
+
+    void fillCloud(
+      const sensor_msgs::msg::Image::ConstSharedPtr & image,
+      const depthimage_to_pointcloud2::ColorSource & color,
+      const cv_bridge::CvImageConstPtr & cv_ptr,
+      const depthimage_to_pointcloud2::ConversionOptions & options,
+      depthimage_to_pointcloud2::PointFormat point_format,
+      sensor_msgs::msg::PointCloud2 & cloud_msg)
+    {
+      cloud_msg.header = image->header;
+      if (options.transform_points) {
+        cloud_msg.header.frame_id = target_frame;
+      }
+
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+      if (nullptr != cuda_converter) {
+        depthimage_to_pointcloud2::prepareCloud(cloud_msg, projection->width(), projection->height());
+        try {
+          cuda_converter->convert(*image, cloud_msg, options, cv_ptr);
+          return;
+        } catch (const std::runtime_error & e) {
+          RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
+            "CUDA conversion failed, converting on the CPU: %s", e.what());
+        }
+      }
+#else
+      (void)cv_ptr;
+#endif
+
+      switch (point_format) {
+        case depthimage_to_pointcloud2::PointFormat::XYZ:
+          fillCloud<depthimage_to_pointcloud2::PointXYZ>(image, color, options, cloud_msg);
+          break;
+        case depthimage_to_pointcloud2::PointFormat::XYZ_HALF:
+          fillCloud<depthimage_to_pointcloud2::PointXYZHalf>(image, color, options, cloud_msg);
+          break;
+        case depthimage_to_pointcloud2::PointFormat::XYZ_INT16:
+          fillCloud<depthimage_to_pointcloud2::PointXYZQuantized>(image, color, options, cloud_msg);
+          break;
+        case depthimage_to_pointcloud2::PointFormat::XYZRGB_NORMAL:
+          fillCloud<depthimage_to_pointcloud2::PointXYZRGBNormal>(image, color, options, cloud_msg);
+          break;
+        default:
+          fillCloud<depthimage_to_pointcloud2::PointXYZRGB>(image, color, options, cloud_msg);
+          break;
+      }
+    }
+
+    // Each format is its own instantiation of convert(), so the format is not
+    // looked at again per point
+    template<typename Format>
+    void fillCloud(
+      const sensor_msgs::msg::Image::ConstSharedPtr & image,
+      const depthimage_to_pointcloud2::ColorSource & color,
+      const depthimage_to_pointcloud2::ConversionOptions & options,
+      sensor_msgs::msg::PointCloud2 & cloud_msg)
+    {
+      depthimage_to_pointcloud2::prepareCloud<Format>(
+        cloud_msg, projection->width(), projection->height());
+
+      // mono16 is 16UC1 under another name
+      if (image->encoding == sensor_msgs::image_encodings::TYPE_16UC1 ||
+        image->encoding == sensor_msgs::image_encodings::MONO16)
+      {
+        depthimage_to_pointcloud2::convert<uint16_t, Format>(image, cloud_msg, *projection, options, color, pool);
+      } else if (image->encoding == sensor_msgs::image_encodings::TYPE_32SC1) {
+        depthimage_to_pointcloud2::convert<int32_t, Format>(image, cloud_msg, *projection, options, color, pool);
+      } else if (image->encoding == sensor_msgs::image_encodings::TYPE_64FC1) {
+        depthimage_to_pointcloud2::convert<double, Format>(image, cloud_msg, *projection, options, color, pool);
+      } else {
+        depthimage_to_pointcloud2::convert<float, Format>(image, cloud_msg, *projection, options, color, pool);
+      }
+    }
+
+    // The color of a synchronized image, reprojected with the color camera's
+    // calibration and pose if register_color is set. Without what that needs the
+    // cloud is published without color.
+    depthimage_to_pointcloud2::ColorSource colorSource(
+      const sensor_msgs::msg::Image & image, const cv_bridge::CvImageConstPtr & cv_ptr)
+    {
+      if (nullptr == cv_ptr || !register_color) {
+        return depthimage_to_pointcloud2::ColorSource(cv_ptr);
+      }
+      const sensor_msgs::msg::CameraInfo::ConstSharedPtr color_cam_info =
+        std::atomic_load(&g_color_cam_info);
+      if (nullptr == color_cam_info) {
+        RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
+          "No color camera info, publishing the point cloud without color");
+        return depthimage_to_pointcloud2::ColorSource();
+      }
+
+      depthimage_to_pointcloud2::RigidTransform extrinsic;
+      try {
+        extrinsic = depthimage_to_pointcloud2::RigidTransform::fromTransform(
+          tf_buffer->lookupTransform(
+            color_cam_info->header.frame_id, image.header.frame_id,
+            tf2::TimePointZero).transform);
+      } catch (const tf2::TransformException & e) {
+        RCUTILS_LOG_WARN_THROTTLE(RCUTILS_STEADY_TIME, 5000,
+          "No transform to the color camera, publishing the point cloud without color: %s",
+          e.what());
+        return depthimage_to_pointcloud2::ColorSource();
+      }
+
+      // Only rebuild the reprojection tables when the depth tables were rebuilt,
+      // or the color calibration or the pose changed
+      if (nullptr == registration || !registration->matches(*color_cam_info, extrinsic)) {
+        registration = std::make_shared<depthimage_to_pointcloud2::ColorRegistration>(
+          *projection, *color_cam_info, extrinsic);
+      }
+      return depthimage_to_pointcloud2::ColorSource(cv_ptr, registration);
     }
 
-    void infoCb(sensor_msgs::msg::CameraInfo::SharedPtr info)
+    // Read by the conversion thread in latest_only and pipeline mode
+    void colorInfoCb(const sensor_msgs::msg::CameraInfo::ConstSharedPtr info)
     {
-      g_cam_info = info;
+      std::atomic_store(&g_color_cam_info, info);
+    }
+
+    void infoCb(const sensor_msgs::msg::CameraInfo::ConstSharedPtr info)
+    {
+      depthimage_to_pointcloud2::StageTimer timer(stats);
+      // Only rebuild the ray tables when the calibration actually changes
+      if (nullptr == projection || !projection->matches(*info)) {
+        updateProjection(*info, info->width, info->height, std::atomic_load(&config)->options);
+      }
+      std::atomic_store(&g_cam_info, info);
+      timer.record(depthimage_to_pointcloud2::Stage::CAMERA_INFO);
+    }
+
+    // Whether the ray tables were built for the decimation of options
+    bool projectionMatches(const depthimage_to_pointcloud2::ConversionOptions & options) const
+    {
+      return projection->decimation() == options.decimation &&
+             (options.decimation <= 1 || projection_block_center ==
+             depthimage_to_pointcloud2::decimationSamplesBlockCenter(options.decimation_mode));
+    }
+
+    void updateProjection(
+      const sensor_msgs::msg::CameraInfo & info, uint32_t width, uint32_t height,
+      const depthimage_to_pointcloud2::ConversionOptions & options)
+    {
+      depthimage_to_pointcloud2::ProjectionCache full_resolution(info, width, height, rectify);
+      projection_block_center =
+        depthimage_to_pointcloud2::decimationSamplesBlockCenter(options.decimation_mode);
+      if (options.decimation > 1) {
+        projection = std::make_shared<depthimage_to_pointcloud2::ProjectionCache>(
+          full_resolution.decimated(options.decimation, projection_block_center));
+      } else {
+        projection = std::make_shared<depthimage_to_pointcloud2::ProjectionCache>(
+          std::move(full_resolution));
+      }
+      registration.reset();
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+      if (nullptr != cuda_converter) {
+        try {
+          cuda_converter->setProjection(*projection);
+        } catch (const std::runtime_error & e) {
+          RCLCPP_ERROR(node.get_logger(), "%s, converting on the CPU from now on", e.what());
+          cuda_converter.reset();
+        }
+      }
+#endif
     }
 
-    sensor_msgs::msg::CameraInfo::SharedPtr g_cam_info;
+    rclcpp::Node & node;
+    const std::string camera_name;
+    const std::string topic_prefix;
+    rclcpp::CallbackGroup::SharedPtr callback_group;
+    rclcpp::SubscriptionOptions subscription_options;
+
+    sensor_msgs::msg::CameraInfo::ConstSharedPtr g_cam_info;
+    std::shared_ptr<depthimage_to_pointcloud2::ProjectionCache> projection;
+    bool projection_block_center = false;
     rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr g_pub_point_cloud;
     rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr depthimage_sub;
-    rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr image_sub;
+    rclcpp::Subscription<sensor_msgs::msg::CompressedImage>::SharedPtr compressed_depth_sub;
+    depthimage_to_pointcloud2::CompressedDepthDecoder decoder;
+    std::unique_ptr<depthimage_to_pointcloud2::DepthFilter> depth_filter;
+    std::shared_ptr<sensor_msgs::msg::Image> decoded_depth =
+      std::make_shared<sensor_msgs::msg::Image>();
     rclcpp::Subscription<sensor_msgs::msg::CameraInfo>::SharedPtr cam_info_sub;
-    
-    cv_bridge::CvImageConstPtr cv_ptr;
-    double range_max;
-    bool use_quiet_nan;
-    bool colorful;
+    message_filters::Subscriber<sensor_msgs::msg::Image> depth_filter_sub;
+    message_filters::Subscriber<sensor_msgs::msg::Image> image_filter_sub;
+    message_filters::Subscriber<sensor_msgs::msg::CameraInfo> cam_info_filter_sub;
+    std::shared_ptr<ApproximateSync> approximate_sync;
+    std::shared_ptr<ExactSync> exact_sync;
+    rclcpp::Subscription<sensor_msgs::msg::CameraInfo>::SharedPtr color_cam_info_sub;
+    sensor_msgs::msg::CameraInfo::ConstSharedPtr g_color_cam_info;
+    std::shared_ptr<const depthimage_to_pointcloud2::ColorRegistration> registration;
+    depthimage_to_pointcloud2::ConversionStats stats;
+
+    // Swapped by reconfigure(), read once per frame
+    std::shared_ptr<const ConversionConfig> config;
+    const bool colorful;
+    const bool register_color;
+    const bool rectify;
+    const std::string target_frame;
+    const bool latest_only;
+    const depthimage_to_pointcloud2::Overflow overflow;
+    const double max_age;
+    const bool lazy_subscribe;
+    const bool compressed_depth;
+    const rclcpp::QoS qos;
+    bool images_subscribed = false;
+    rclcpp::TimerBase::SharedPtr lazy_timer;
+
+    std::unique_ptr<depthimage_to_pointcloud2::SpscRing<PendingFrame>> frames;
+    std::unique_ptr<depthimage_to_pointcloud2::SpscRing<ConvertedCloud>> clouds;
+    depthimage_to_pointcloud2::Doorbell frames_bell;
+    depthimage_to_pointcloud2::Doorbell clouds_bell;
+    sensor_msgs::msg::CameraInfo::ConstSharedPtr pending_info;
+    std::atomic<bool> stop_pipeline{false};
+    std::thread conversion_thread;
+    std::thread publish_thread;
+
+    depthimage_to_pointcloud2::WorkerPool * const pool;
+    tf2_ros::Buffer * const tf_buffer;
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+    std::unique_ptr<depthimage_to_pointcloud2::CudaConverter> cuda_converter;
+#endif
+    depthimage_to_pointcloud2::CloudPool cloud_pool;
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+    std::unique_ptr<depthimage_to_pointcloud2::ZstdCloudCompressor> compressor;
+    rclcpp::Publisher<point_cloud_interfaces::msg::CompressedPointCloud2>::SharedPtr compressed_pub;
+    point_cloud_interfaces::msg::CompressedPointCloud2 compressed_cloud;
+#endif
 };
 
-int main(int argc, char * argv[])
+// Registered as the depthimage_to_pointcloud2::Depthimage2Pointcloud2 component,
+// so it can be loaded into a component container next to the camera driver and
+// exchange images and clouds with it through intra-process communication.
+class Depthimage2Pointcloud2 : public rclcpp::Node
 {
-  rclcpp::init(argc, argv);
-  rclcpp::spin(std::make_shared<Depthimage2Pointcloud2>(rclcpp::NodeOptions()));
-  rclcpp::shutdown();
-  return 0;
-}
\ No newline at end of file
+  public:
+    explicit Depthimage2Pointcloud2(const rclcpp::NodeOptions & options = rclcpp::NodeOptions())
+    : Node("depthimage_to_pointcloud2_node", options)
+    {
+      settings.conversion_options.range_max = this->declare_parameter("range_max", 0.0);
+      settings.conversion_options.depth_scale = this->declare_parameter("depth_scale", 1.0);
+      if (!(settings.conversion_options.depth_scale > 0.0)) {
+        RCLCPP_WARN(this->get_logger(), "depth_scale must be > 0, using 1.0");
+        settings.conversion_options.depth_scale = 1.0;
+      }
+      settings.conversion_options.range_min = this->declare_parameter("range_min", 0.0);
+      depthimage_to_pointcloud2::PixelRoi & roi = settings.conversion_options.roi;
+      roi.x_offset = static_cast<uint32_t>(
+        std::max<int64_t>(this->declare_parameter<int64_t>("roi_x_offset", 0), 0));
+      roi.y_offset = static_cast<uint32_t>(
+        std::max<int64_t>(this->declare_parameter<int64_t>("roi_y_offset", 0), 0));
+      roi.width = static_cast<uint32_t>(
+        std::max<int64_t>(this->declare_parameter<int64_t>("roi_width", 0), 0));
+      roi.height = static_cast<uint32_t>(
+        std::max<int64_t>(this->declare_parameter<int64_t>("roi_height", 0), 0));
+      std::vector<double> crop_box_min =
+        this->declare_parameter("crop_box_min", std::vector<double>());
+      std::vector<double> crop_box_max =
+        this->declare_parameter("crop_box_max", std::vector<double>());
+      if (!crop_box_min.empty() || !crop_box_max.empty()) {
+        if (crop_box_min.size() != 3 || crop_box_max.size() != 3) {
+          RCLCPP_WARN(this->get_logger(),
+            "crop_box_min and crop_box_max must be [x, y, z], not cropping");
+        } else {
+          for (int i = 0; i < 3; ++i) {
+            settings.conversion_options.crop_box.min[i] = static_cast<float>(crop_box_min[i]);
+            settings.conversion_options.crop_box.max[i] = static_cast<float>(crop_box_max[i]);
+          }
+        }
+      }
+      settings.conversion_options.use_quiet_nan = this->declare_parameter("use_quiet_nan", true);
+      settings.filter_options.spatial_delta = this->declare_parameter("spatial_filter_delta", 0.0);
+      settings.filter_options.flying_pixel_threshold =
+        this->declare_parameter("flying_pixel_threshold", 0.0);
+      settings.filter_options.temporal_alpha = this->declare_parameter("temporal_filter_alpha", 1.0);
+      settings.filter_options.temporal_delta = this->declare_parameter("temporal_filter_delta", 0.05);
+      if (!(settings.filter_options.temporal_alpha > 0.0f)) {
+        RCLCPP_WARN(this->get_logger(), "temporal_filter_alpha must be > 0, using 1.0");
+        settings.filter_options.temporal_alpha = 1.0f;
+      }
+      settings.conversion_options.output_dense = this->declare_parameter("output_dense", false);
+      settings.conversion_options.decimation = std::max<int64_t>(
+        this->declare_parameter<int64_t>("decimation", 1), 1);
+      settings.conversion_options.voxel_size = this->declare_parameter("voxel_size", 0.0);
+      std::string decimation_mode = this->declare_parameter("decimation_mode", std::string("stride"));
+      if (!depthimage_to_pointcloud2::decimationModeFromString(
+          decimation_mode, settings.conversion_options.decimation_mode))
+      {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown decimation_mode [%s], using stride", decimation_mode.c_str());
+      }
+      settings.conversion_options.quantization_scale = this->declare_parameter("quantization_scale", 0.001);
+      if (!(settings.conversion_options.quantization_scale > 0.0f)) {
+        RCLCPP_WARN(this->get_logger(), "quantization_scale must be > 0, using 0.001");
+        settings.conversion_options.quantization_scale = 0.001f;
+      }
+      std::string point_format_name = this->declare_parameter("point_format", std::string("xyzrgb"));
+      if (!depthimage_to_pointcloud2::pointFormatFromString(point_format_name, settings.point_format)) {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown point_format [%s], using xyzrgb", point_format_name.c_str());
+      }
+      if (settings.point_format == depthimage_to_pointcloud2::PointFormat::XYZRGB_NORMAL &&
+        settings.conversion_options.voxel_size > 0.0f)
+      {
+        RCLCPP_WARN(this->get_logger(), "voxel_size has no normals, using point_format xyzrgb");
+        settings.point_format = depthimage_to_pointcloud2::PointFormat::XYZRGB;
+      }
+      settings.conversion_options.normal_max_depth_change =
+        this->declare_parameter("normal_max_depth_change", 0.05);
+      settings.colorful = this->declare_parameter("colorful", false);
+      if (settings.colorful && !depthimage_to_pointcloud2::pointFormatHasRgb(settings.point_format)) {
+        RCLCPP_WARN(this->get_logger(),
+          "point_format [%s] has no color, ignoring colorful", point_format_name.c_str());
+        settings.colorful = false;
+      }
+      settings.register_color =
+        this->declare_parameter("register_color", false) && settings.colorful;
+      settings.rectify = this->declare_parameter("rectify", false);
+      settings.target_frame = this->declare_parameter("target_frame", std::string(""));
+      int num_threads = this->declare_parameter("num_threads", 1);
+      double diagnostics_period = this->declare_parameter("diagnostics_period", 1.0);
+      bool publish_statistics = this->declare_parameter("publish_statistics", false);
+      latency_budget = this->declare_parameter("latency_budget", 0.0);
+      std::string backend = this->declare_parameter("backend", std::string("cpu"));
+      settings.latest_only = this->declare_parameter("latest_only", false);
+      settings.pipeline = this->declare_parameter("pipeline", false);
+      settings.pipeline_depth = static_cast<size_t>(
+        std::max<int64_t>(this->declare_parameter<int64_t>("pipeline_depth", 2), 1));
+      std::string pipeline_overflow =
+        this->declare_parameter("pipeline_overflow", std::string("drop_oldest"));
+      if (!depthimage_to_pointcloud2::overflowFromString(
+          pipeline_overflow, settings.pipeline_overflow))
+      {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown pipeline_overflow [%s], using drop_oldest", pipeline_overflow.c_str());
+      }
+      settings.max_age = this->declare_parameter("max_age", 0.0);
+      settings.qos = declareQos("qos_");
+      settings.lazy_subscribe = this->declare_parameter("lazy_subscribe", false);
+      settings.pointcloud_qos = declareQos("pointcloud_qos_");
+      std::string compression = this->declare_parameter("compression", std::string("none"));
+      settings.compression_level = this->declare_parameter("compression_level", 3);
+      if (compression == "zstd") {
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+        settings.compress = true;
+#else
+        RCLCPP_WARN(this->get_logger(),
+          "Built without zstd (see WITH_ZSTD in CMakeLists.txt), not compressing");
+#endif
+      } else if (compression != "none") {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown compression [%s], not compressing", compression.c_str());
+      }
+      std::vector<std::string> camera_names =
+        this->declare_parameter("cameras", std::vector<std::string>());
+
+      if (backend == "cuda") {
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+        // Converts on the GPU if it handles the options, otherwise everything
+        // stays on the CPU
+        if (!depthimage_to_pointcloud2::CudaConverter::supports(settings.conversion_options) ||
+          settings.filter_options.enabled() ||
+          settings.point_format != depthimage_to_pointcloud2::PointFormat::XYZRGB ||
+          settings.register_color)
+        {
+          RCLCPP_WARN(this->get_logger(),
+            "The cuda backend does not support decimation, output_dense, voxel_size, roi_*, "
+            "range_min, crop_box_*, depth filters, point_format or register_color, using cpu");
+        } else {
+          settings.use_cuda = true;
+        }
+#else
+        RCLCPP_WARN(this->get_logger(),
+          "Built without the cuda backend (see WITH_CUDA in CMakeLists.txt), using cpu");
+#endif
+      } else if (backend != "cpu") {
+        RCLCPP_WARN(this->get_logger(), "Unknown backend [%s], using cpu", backend.c_str());
+      }
+
+      // Threads are started once here and reused for every frame, by all cameras;
+      // convert() keeps what its bands leave behind out of the pool threads' storage
+      if (num_threads > 1) {
+        pool = std::make_unique<depthimage_to_pointcloud2::WorkerPool>(num_threads);
+      }
+
+      if (settings.register_color || !settings.target_frame.empty()) {
+        tf_buffer = std::make_unique<tf2_ros::Buffer>(this->get_clock());
+        tf_listener = std::make_shared<tf2_ros::TransformListener>(*tf_buffer);
+      }
+
+      std::string depth_transport = this->declare_parameter("depth_transport", std::string("raw"));
+      settings.compressed_depth = depth_transport == "compressedDepth";
+      if (!settings.compressed_depth && depth_transport != "raw") {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown depth_transport [%s], using raw", depth_transport.c_str());
+      } else if (settings.compressed_depth && settings.colorful) {
+        RCLCPP_WARN(this->get_logger(),
+          "depth_transport compressedDepth is not supported with colorful, using raw");
+        settings.compressed_depth = false;
+      }
+
+      if (settings.colorful) {
+        settings.sync_queue_size = this->declare_parameter("sync_queue_size", 10);
+        settings.sync = this->declare_parameter("sync", std::string("approximate"));
+        if (settings.sync != "exact" && settings.sync != "approximate") {
+          RCLCPP_WARN(this->get_logger(),
+            "Unknown sync [%s], using approximate", settings.sync.c_str());
+          settings.sync = "approximate";
+        }
+      }
+
+      // Without a list of cameras the node converts a single camera on its own topics
+      if (camera_names.empty()) {
+        camera_names.emplace_back();
+      }
+      for (const std::string & name : camera_names) {
+        cameras.push_back(std::make_unique<DepthCamera>(
+            *this, name, settings, pool.get(), tf_buffer.get()));
+      }
+
+      // Without a restart, see setParameters()
+      parameter_callback = this->add_on_set_parameters_callback(
+        std::bind(&Depthimage2Pointcloud2::setParameters, this, _1));
+
+      // Stage timings are recorded for every frame, and summarized on /diagnostics
+      // (and ~/statistics) once per diagnostics_period
+      if (diagnostics_period > 0.0) {
+        diagnostics_pub = this->create_publisher<diagnostic_msgs::msg::DiagnosticArray>(
+          "/diagnostics", 10);
+        if (publish_statistics) {
+          statistics_pub = this->create_publisher<statistics_msgs::msg::MetricsMessage>(
+            "~/statistics", 10);
+        }
+        stats_timer = this->create_wall_timer(
+          std::chrono::duration<double>(diagnostics_period),
+          std::bind(&Depthimage2Pointcloud2::publishStats, this));
+      }
+    }
+
+  private:
+    // The conversion options and point_format can be changed while the node runs;
+    // all cameras convert with the new values from their next frame on. Either all
+    // the parameters are set or, if one of them is not valid, none. The other
+    // parameters are only read when the node starts.
+    rcl_interfaces::msg::SetParametersResult setParameters(
+      const std::vector<rclcpp::Parameter> & parameters)
+    {
+      rcl_interfaces::msg::SetParametersResult result;
+      CameraSettings changed = settings;
+      bool reconfigured = false;
+      for (const rclcpp::Parameter & parameter : parameters) {
+        bool handled = true;
+        result.reason = applyParameter(parameter, changed, handled);
+        if (!result.reason.empty()) {
+          result.successful = false;
+          return result;
+        }
+        reconfigured = reconfigured || handled;
+      }
+      if (!reconfigured) {
+        result.successful = true;
+        return result;
+      }
+      if (changed.conversion_options.voxel_size > 0.0f &&
+        changed.point_format == depthimage_to_pointcloud2::PointFormat::XYZRGB_NORMAL)
+      {
+        result.successful = false;
+        result.reason = "voxel_size has no normals";
+        return result;
+      }
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_CUDA
+      if (changed.use_cuda &&
+        (!depthimage_to_pointcloud2::CudaConverter::supports(changed.conversion_options) ||
+        changed.point_format != depthimage_to_pointcloud2::PointFormat::XYZRGB))
+      {
+        result.successful = false;
+        result.reason = "Not supported by the cuda backend";
+        return result;
+      }
+#endif
+
+      settings = changed;
+      for (const std::unique_ptr<DepthCamera> & camera : cameras) {
+        camera->reconfigure(settings);
+      }
+      result.successful = true;
+      return result;
+    }
+
+    // Applies parameter to the conversion options and point format of changed.
+    // Returns why it is not valid, or an empty string; handled is cleared for
+    // parameters that are not reconfigurable.
+    std::string applyParameter(
+      const rclcpp::Parameter & parameter, CameraSettings & changed, bool & handled) const
+    {
+      depthimage_to_pointcloud2::ConversionOptions & options = changed.conversion_options;
+      const std::string & name = parameter.get_name();
+      try {
+        if (name == "range_max") {
+          options.range_max = parameter.as_double();
+        } else if (name == "range_min") {
+          options.range_min = parameter.as_double();
+        } else if (name == "use_quiet_nan") {
+          options.use_quiet_nan = parameter.as_bool();
+        } else if (name == "output_dense") {
+          options.output_dense = parameter.as_bool();
+        } else if (name == "depth_scale") {
+          if (!(parameter.as_double() > 0.0)) {
+            return "depth_scale must be > 0";
+          }
+          options.depth_scale = parameter.as_double();
+        } else if (name == "quantization_scale") {
+          if (!(parameter.as_double() > 0.0)) {
+            return "quantization_scale must be > 0";
+          }
+          options.quantization_scale = static_cast<float>(parameter.as_double());
+        } else if (name == "normal_max_depth_change") {
+          options.normal_max_depth_change = static_cast<float>(parameter.as_double());
+        } else if (name == "voxel_size") {
+          options.voxel_size = static_cast<float>(parameter.as_double());
+        } else if (name == "decimation") {
+          if (parameter.as_int() < 1) {
+            return "decimation must be >= 1";
+          }
+          options.decimation = static_cast<uint32_t>(parameter.as_int());
+        } else if (name == "decimation_mode") {
+          if (!depthimage_to_pointcloud2::decimationModeFromString(
+              parameter.as_string(), options.decimation_mode))
+          {
+            return "Unknown decimation_mode " + parameter.as_string();
+          }
+        } else if (name == "point_format") {
+          if (!depthimage_to_pointcloud2::pointFormatFromString(
+              parameter.as_string(), changed.point_format))
+          {
+            return "Unknown point_format " + parameter.as_string();
+          }
+        } else if (uint32_t * roi_value = roiValue(name, options.roi)) {
+          if (parameter.as_int() < 0) {
+            return name + " must be >= 0";
+          }
+          *roi_value = static_cast<uint32_t>(parameter.as_int());
+        } else if (name == "crop_box_min" || name == "crop_box_max") {
+          // An empty list leaves that side of the box open
+          const std::vector<double> bound = parameter.as_double_array();
+          if (!bound.empty() && bound.size() != 3) {
+            return name + " must be [x, y, z] or []";
+          }
+          const bool is_min = name == "crop_box_min";
+          const float open = is_min ?
+            -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity();
+          std::array<float, 3> & side = is_min ? options.crop_box.min : options.crop_box.max;
+          for (int i = 0; i < 3; ++i) {
+            side[i] = bound.empty() ? open : static_cast<float>(bound[i]);
+          }
+        } else {
+          handled = false;
+        }
+      } catch (const rclcpp::ParameterTypeException & e) {
+        return e.what();
+      }
+      return "";
+    }
+
+    // The member of roi the roi_* parameter name sets, nullptr for other names
+    static uint32_t * roiValue(const std::string & name, depthimage_to_pointcloud2::PixelRoi & roi)
+    {
+      if (name == "roi_x_offset") {
+        return &roi.x_offset;
+      } else if (name == "roi_y_offset") {
+        return &roi.y_offset;
+      } else if (name == "roi_width") {
+        return &roi.width;
+      } else if (name == "roi_height") {
+        return &roi.height;
+      }
+      return nullptr;
+    }
+
+    // A QoS profile from the <prefix>reliability (reliable or best_effort),
+    // <prefix>history (keep_last or keep_all) and <prefix>depth parameters
+    rclcpp::QoS declareQos(const std::string & prefix)
+    {
+      std::string reliability = this->declare_parameter(prefix + "reliability", std::string("reliable"));
+      std::string history = this->declare_parameter(prefix + "history", std::string("keep_last"));
+      int64_t depth = std::max<int64_t>(this->declare_parameter<int64_t>(prefix + "depth", 10), 1);
+
+      rclcpp::QoS qos(rclcpp::KeepLast(static_cast<size_t>(depth)));
+      if (history == "keep_all") {
+        qos.keep_all();
+      } else if (history != "keep_last") {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown %shistory [%s], using keep_last", prefix.c_str(), history.c_str());
+      }
+      if (reliability == "best_effort") {
+        qos.best_effort();
+      } else if (reliability != "reliable") {
+        RCLCPP_WARN(this->get_logger(),
+          "Unknown %sreliability [%s], using reliable", prefix.c_str(), reliability.c_str());
+      }
+      return qos;
+    }
+
+    // Summarizes the frames since the last call, one status per camera. The
+    // diagnostics warn when frames were dropped, none were published, or the 99th
+    // percentile of the latency is over latency_budget.
+    void publishStats()
+    {
+      const rclcpp::Time stop = this->now();
+      diagnostic_msgs::msg::DiagnosticArray diagnostics;
+      diagnostics.header.stamp = stop;
+      for (const std::unique_ptr<DepthCamera> & camera : cameras) {
+        publishStats(*camera, stop, diagnostics);
+      }
+      diagnostics_pub->publish(diagnostics);
+    }
+
+    void publishStats(
+      DepthCamera & camera, const rclcpp::Time & stop,
+      diagnostic_msgs::msg::DiagnosticArray & diagnostics)
+    {
+      const depthimage_to_pointcloud2::ConversionStats::Snapshot snapshot =
+        camera.statistics().take();
+      const double window = std::chrono::duration<double>(snapshot.window).count();
+      const depthimage_to_pointcloud2::HistogramSnapshot & latency =
+        snapshot.stage(depthimage_to_pointcloud2::Stage::LATENCY);
+      const uint64_t frames = latency.count;
+      const uint64_t dropped = snapshot.dropped();
+
+      diagnostic_msgs::msg::DiagnosticStatus status;
+      status.name = std::string(this->get_name()) + ": " +
+        (camera.name().empty() ? "" : camera.name() + " ") + "point cloud conversion";
+      status.hardware_id = camera.hardwareId();
+      char text[128];
+      if (frames == 0 && snapshot.skipped > 0 && dropped == 0) {
+        status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+        status.message = "No subscribers, not converting";
+      } else if (frames == 0) {
+        status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+        status.message = "No point clouds published";
+      } else if (dropped > 0) {
+        status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+        std::snprintf(text, sizeof(text), "Dropped %llu of %llu depth images",
+          static_cast<unsigned long long>(dropped),
+          static_cast<unsigned long long>(dropped + frames));
+        status.message = text;
+      } else if (latency_budget > 0.0 && latency.percentile(0.99) > latency_budget * 1e9) {
+        status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+        std::snprintf(text, sizeof(text), "Latency p99 %.1f ms over the %.1f ms budget",
+          latency.percentile(0.99) * 1e-6, latency_budget * 1e3);
+        status.message = text;
+      } else {
+        status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+        status.message = "OK";
+      }
+
+      auto add = [&status](const std::string & key, const std::string & value) {
+          diagnostic_msgs::msg::KeyValue key_value;
+          key_value.key = key;
+          key_value.value = value;
+          status.values.push_back(key_value);
+        };
+      auto milliseconds = [&text](double nanoseconds) {
+          std::snprintf(text, sizeof(text), "%.3f", nanoseconds * 1e-6);
+          return std::string(text);
+        };
+      add("published", std::to_string(frames));
+      add("skipped without subscribers", std::to_string(snapshot.skipped));
+      std::snprintf(text, sizeof(text), "%.2f", window > 0.0 ? frames / window : 0.0);
+      add("rate (Hz)", text);
+      for (size_t i = 0; i < depthimage_to_pointcloud2::kStageCount; ++i) {
+        const auto stage = static_cast<depthimage_to_pointcloud2::Stage>(i);
+        const depthimage_to_pointcloud2::HistogramSnapshot & histogram = snapshot.stage(stage);
+        const std::string name = depthimage_to_pointcloud2::stageName(stage);
+        add(name + " count", std::to_string(histogram.count));
+        add(name + " mean (ms)", milliseconds(histogram.mean()));
+        add(name + " p50 (ms)", milliseconds(histogram.percentile(0.5)));
+        add(name + " p90 (ms)", milliseconds(histogram.percentile(0.9)));
+        add(name + " p99 (ms)", milliseconds(histogram.percentile(0.99)));
+        add(name + " max (ms)", milliseconds(static_cast<double>(histogram.max)));
+      }
+      for (size_t i = 0; i < depthimage_to_pointcloud2::kDropCount; ++i) {
+        add(
+          std::string("dropped ") +
+          depthimage_to_pointcloud2::dropName(static_cast<depthimage_to_pointcloud2::Drop>(i)),
+          std::to_string(snapshot.drops[i]));
+      }
+
+      diagnostics.status.push_back(std::move(status));
+
+      // One message per stage, like the topic statistics of rclcpp, with the
+      // camera's name in front of the stage's
+      if (nullptr != statistics_pub) {
+        using statistics_msgs::msg::StatisticDataType;
+        const rclcpp::Time start = stop - rclcpp::Duration(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(snapshot.window));
+        for (size_t i = 0; i < depthimage_to_pointcloud2::kStageCount; ++i) {
+          const auto stage = static_cast<depthimage_to_pointcloud2::Stage>(i);
+          const depthimage_to_pointcloud2::HistogramSnapshot & histogram = snapshot.stage(stage);
+          statistics_msgs::msg::MetricsMessage metrics;
+          metrics.measurement_source_name = this->get_fully_qualified_name();
+          metrics.metrics_source = (camera.name().empty() ? "" : camera.name() + "/") +
+            depthimage_to_pointcloud2::stageName(stage);
+          metrics.unit = "ms";
+          metrics.window_start = start;
+          metrics.window_stop = stop;
+          const std::pair<uint8_t, double> values[] = {
+            {StatisticDataType::STATISTICS_DATA_TYPE_AVERAGE, histogram.mean() * 1e-6},
+            {StatisticDataType::STATISTICS_DATA_TYPE_MINIMUM, histogram.min * 1e-6},
+            {StatisticDataType::STATISTICS_DATA_TYPE_MAXIMUM, histogram.max * 1e-6},
+            {StatisticDataType::STATISTICS_DATA_TYPE_STDDEV, histogram.stddev() * 1e-6},
+            {StatisticDataType::STATISTICS_DATA_TYPE_SAMPLE_COUNT,
+              static_cast<double>(histogram.count)}};
+          for (const auto & value : values) {
+            statistics_msgs::msg::StatisticDataPoint point;
+            point.data_type = value.first;
+            point.data = value.second;
+            metrics.statistics.push_back(point);
+          }
+          statistics_pub->publish(metrics);
+        }
+      }
+    }
+
+    CameraSettings settings;
+    std::unique_ptr<depthimage_to_pointcloud2::WorkerPool> pool;
+    std::unique_ptr<tf2_ros::Buffer> tf_buffer;
+    std::shared_ptr<tf2_ros::TransformListener> tf_listener;
+    std::vector<std::unique_ptr<DepthCamera>> cameras;
+    rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr diagnostics_pub;
+    rclcpp::Publisher<statistics_msgs::msg::MetricsMessage>::SharedPtr statistics_pub;
+    rclcpp::TimerBase::SharedPtr stats_timer;
+    rclcpp::node_interfaces::OnSetParametersCallbackHandle::SharedPtr parameter_callback;
+    double latency_budget;
+};
+
+}  // namespace depthimage_to_pointcloud2
+
+RCLCPP_COMPONENTS_REGISTER_NODE(depthimage_to_pointcloud2::Depthimage2Pointcloud2)
@@ -0,0 +1,359 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <cv_bridge/cv_bridge.h>
+
+#include <depthimage_to_pointcloud2/cloud_pool.hpp>
+#include <depthimage_to_pointcloud2/depth_conversions.hpp>
+#include <depthimage_to_pointcloud2/depth_filters.hpp>
+#include <depthimage_to_pointcloud2/depth_traits.hpp>
+#include <depthimage_to_pointcloud2/projection_cache.hpp>
+#include <depthimage_to_pointcloud2/worker_pool.hpp>
+
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+#include <depthimage_to_pointcloud2/cloud_compression.hpp>
+#include <point_cloud_interfaces/msg/compressed_point_cloud2.hpp>
+#endif
+
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Throughput of convert<T>() on synthetic depth images. Every benchmark reports
+// the converted points per second ("points") and the cloud bytes written per
+// second; run with --benchmark_filter to pick a subset. BM_Compress measures
+// what compression_level trades: the cloud bytes compressed per second, and the
+// compression ratio ("ratio").
+
+namespace
+{
+
+using depthimage_to_pointcloud2::ConversionOptions;
+using depthimage_to_pointcloud2::DepthTraits;
+using depthimage_to_pointcloud2::ProjectionCache;
+using depthimage_to_pointcloud2::WorkerPool;
+
+// How invalid and out of range depths are handled, the third benchmark argument
+enum RangeMode
+{
+  NO_RANGE_MAX,     // range_max 0.0
+  RANGE_MAX_NAN,    // range_max 5.0, use_quiet_nan true
+  RANGE_MAX_CLAMP,  // range_max 5.0, use_quiet_nan false
+};
+
+sensor_msgs::msg::CameraInfo makeCameraInfo(uint32_t width, uint32_t height)
+{
+  sensor_msgs::msg::CameraInfo info;
+  info.width = width;
+  info.height = height;
+  const double f = width * 0.8;
+  info.k = {f, 0.0, width / 2.0, 0.0, f, height / 2.0, 0.0, 0.0, 1.0};
+  info.p = {f, 0.0, width / 2.0, 0.0, 0.0, f, height / 2.0, 0.0, 0.0, 0.0, 1.0, 0.0};
+  info.r = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+  return info;
+}
+
+// Depths uniformly in [0.3, 8.0] m, with invalid_percent of the pixels invalid
+template<typename T>
+sensor_msgs::msg::Image::ConstSharedPtr makeDepthImage(
+  uint32_t width, uint32_t height, int invalid_percent)
+{
+  auto image = std::make_shared<sensor_msgs::msg::Image>();
+  image->width = width;
+  image->height = height;
+  image->encoding = sizeof(T) == 2 ?
+    sensor_msgs::image_encodings::TYPE_16UC1 : sensor_msgs::image_encodings::TYPE_32FC1;
+  image->step = width * sizeof(T);
+  image->data.resize(static_cast<size_t>(image->step) * height);
+
+  std::mt19937 random(42);
+  std::uniform_real_distribution<float> depth(0.3f, 8.0f);
+  std::uniform_int_distribution<int> percent(0, 99);
+  T * pixels = reinterpret_cast<T *>(image->data.data());
+  // quiet_NaN() is 0 for uint16_t, i.e. invalid for either type
+  const T invalid = std::numeric_limits<T>::quiet_NaN();
+  for (size_t i = 0; i < static_cast<size_t>(width) * height; ++i) {
+    pixels[i] = percent(random) < invalid_percent ?
+      invalid : DepthTraits<T>::fromMeters(depth(random));
+  }
+  return image;
+}
+
+cv_bridge::CvImageConstPtr makeColorImage(uint32_t width, uint32_t height)
+{
+  auto color = std::make_shared<cv_bridge::CvImage>();
+  color->encoding = sensor_msgs::image_encodings::BGR8;
+  color->image = cv::Mat(static_cast<int>(height), static_cast<int>(width), CV_8UC3);
+  for (uint32_t v = 0; v < height; ++v) {
+    uint8_t * row = color->image.ptr<uint8_t>(static_cast<int>(v));
+    for (uint32_t i = 0; i < width * 3; ++i) {
+      row[i] = static_cast<uint8_t>((v + i) & 0xff);
+    }
+  }
+  return color;
+}
+
+ConversionOptions makeOptions(int range_mode)
+{
+  ConversionOptions options;
+  options.range_max = range_mode == NO_RANGE_MAX ? 0.0 : 5.0;
+  options.use_quiet_nan = range_mode != RANGE_MAX_CLAMP;
+  return options;
+}
+
+// Arguments: width, height, invalid percent, RangeMode, color (0 or 1) and the
+// number of pool threads (0 converts on the calling thread)
+template<typename T>
+void BM_Convert(benchmark::State & state)
+{
+  const uint32_t width = static_cast<uint32_t>(state.range(0));
+  const uint32_t height = static_cast<uint32_t>(state.range(1));
+  const auto depth = makeDepthImage<T>(width, height, static_cast<int>(state.range(2)));
+  const ConversionOptions options = makeOptions(static_cast<int>(state.range(3)));
+  const cv_bridge::CvImageConstPtr color =
+    state.range(4) != 0 ? makeColorImage(width, height) : nullptr;
+  std::unique_ptr<WorkerPool> pool;
+  if (state.range(5) > 0) {
+    pool = std::make_unique<WorkerPool>(static_cast<size_t>(state.range(5)));
+  }
+
+  const ProjectionCache projection(makeCameraInfo(width, height));
+  sensor_msgs::msg::PointCloud2 cloud;
+  depthimage_to_pointcloud2::prepareCloud(cloud, width, height);
+
+  for (auto _ : state) {
+    depthimage_to_pointcloud2::convert<T>(depth, cloud, projection, options, color, pool.get());
+    benchmark::DoNotOptimize(cloud.data.data());
+    benchmark::ClobberMemory();
+  }
+
+  const int64_t points = static_cast<int64_t>(width) * height;
+  state.counters["points"] = benchmark::Counter(
+    static_cast<double>(points * state.iterations()), benchmark::Counter::kIsRate);
+  state.SetBytesProcessed(static_cast<int64_t>(cloud.data.size()) * state.iterations());
+}
+
+const std::vector<std::vector<int64_t>> kResolutions = {
+  {640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+
+// Every resolution, invalid ratio, range mode and color combination, single threaded
+void singleThreadedArguments(benchmark::internal::Benchmark * benchmark)
+{
+  benchmark->ArgNames({"width", "height", "invalid%", "range", "color", "threads"});
+  for (const auto & resolution : kResolutions) {
+    for (int64_t invalid_percent : {0, 10, 50}) {
+      for (int64_t range_mode : {NO_RANGE_MAX, RANGE_MAX_NAN, RANGE_MAX_CLAMP}) {
+        for (int64_t color : {0, 1}) {
+          benchmark->Args(
+            {resolution[0], resolution[1], invalid_percent, range_mode, color, 0});
+        }
+      }
+    }
+  }
+}
+
+// Scaling with the worker pool, for the default options
+void pooledArguments(benchmark::internal::Benchmark * benchmark)
+{
+  benchmark->ArgNames({"width", "height", "invalid%", "range", "color", "threads"});
+  for (const auto & resolution : kResolutions) {
+    for (int64_t threads : {2, 4, 8}) {
+      benchmark->Args({resolution[0], resolution[1], 10, RANGE_MAX_NAN, 1, threads});
+    }
+  }
+}
+
+// Cost of the depth filters on top of the conversion. Arguments: width, height
+// and the filters, a sum of 1 (spatial), 2 (flying pixels) and 4 (temporal)
+void BM_ConvertFiltered(benchmark::State & state)
+{
+  const uint32_t width = static_cast<uint32_t>(state.range(0));
+  const uint32_t height = static_cast<uint32_t>(state.range(1));
+  const auto depth = makeDepthImage<uint16_t>(width, height, 10);
+  depthimage_to_pointcloud2::DepthFilterOptions filter_options;
+  if (state.range(2) & 1) {
+    filter_options.spatial_delta = 0.02f;
+  }
+  if (state.range(2) & 2) {
+    filter_options.flying_pixel_threshold = 0.05f;
+  }
+  if (state.range(2) & 4) {
+    filter_options.temporal_alpha = 0.3f;
+  }
+  depthimage_to_pointcloud2::DepthFilter filter(filter_options);
+  ConversionOptions options = makeOptions(RANGE_MAX_NAN);
+  options.filter = &filter;
+
+  const ProjectionCache projection(makeCameraInfo(width, height));
+  sensor_msgs::msg::PointCloud2 cloud;
+  depthimage_to_pointcloud2::prepareCloud(cloud, width, height);
+
+  for (auto _ : state) {
+    depthimage_to_pointcloud2::convert<uint16_t>(depth, cloud, projection, options, nullptr);
+    benchmark::DoNotOptimize(cloud.data.data());
+    benchmark::ClobberMemory();
+  }
+
+  const int64_t points = static_cast<int64_t>(width) * height;
+  state.counters["points"] = benchmark::Counter(
+    static_cast<double>(points * state.iterations()), benchmark::Counter::kIsRate);
+  state.SetBytesProcessed(static_cast<int64_t>(cloud.data.size()) * state.iterations());
+}
+
+void filterArguments(benchmark::internal::Benchmark * benchmark)
+{
+  benchmark->ArgNames({"width", "height", "filters"});
+  for (const auto & resolution : {kResolutions[0], kResolutions[1]}) {
+    for (int64_t filters : {1, 2, 4, 7}) {
+      benchmark->Args({resolution[0], resolution[1], filters});
+    }
+  }
+}
+
+// Depths of a floor seen from 1 m up, smooth like most of a real scene, rather
+// than the noise of makeDepthImage(), which hardly compresses and has no surfaces
+sensor_msgs::msg::Image::ConstSharedPtr makeFloorDepthImage(uint32_t width, uint32_t height)
+{
+  auto image = std::make_shared<sensor_msgs::msg::Image>();
+  image->width = width;
+  image->height = height;
+  image->encoding = sensor_msgs::image_encodings::TYPE_16UC1;
+  image->step = width * sizeof(uint16_t);
+  image->data.resize(static_cast<size_t>(image->step) * height);
+  uint16_t * pixels = reinterpret_cast<uint16_t *>(image->data.data());
+  for (uint32_t v = 0; v < height; ++v) {
+    // Rows above the horizon see nothing
+    const double below_horizon = (v + 0.5) / height - 0.5;
+    const uint16_t depth = below_horizon > 0.0 ?
+      DepthTraits<uint16_t>::fromMeters(static_cast<float>(std::min(0.8 / below_horizon, 8.0))) :
+      0;
+    std::fill(pixels + static_cast<size_t>(v) * width, pixels + static_cast<size_t>(v + 1) * width,
+      depth);
+  }
+  return image;
+}
+
+// Cost of the normals of the xyzrgb_normal format, on the floor of
+// makeFloorDepthImage(). Arguments: width, height and the number of pool threads.
+void BM_ConvertNormals(benchmark::State & state)
+{
+  const uint32_t width = static_cast<uint32_t>(state.range(0));
+  const uint32_t height = static_cast<uint32_t>(state.range(1));
+  const auto depth = makeFloorDepthImage(width, height);
+  std::unique_ptr<WorkerPool> pool;
+  if (state.range(2) > 0) {
+    pool = std::make_unique<WorkerPool>(static_cast<size_t>(state.range(2)));
+  }
+  const ConversionOptions options = makeOptions(RANGE_MAX_NAN);
+
+  const ProjectionCache projection(makeCameraInfo(width, height));
+  sensor_msgs::msg::PointCloud2 cloud;
+  depthimage_to_pointcloud2::prepareCloud<depthimage_to_pointcloud2::PointXYZRGBNormal>(
+    cloud, width, height);
+
+  for (auto _ : state) {
+    depthimage_to_pointcloud2::convert<uint16_t, depthimage_to_pointcloud2::PointXYZRGBNormal>(
+      depth, cloud, projection, options, nullptr, pool.get());
+    benchmark::DoNotOptimize(cloud.data.data());
+    benchmark::ClobberMemory();
+  }
+
+  const int64_t points = static_cast<int64_t>(width) * height;
+  state.counters["points"] = benchmark::Counter(
+    static_cast<double>(points * state.iterations()), benchmark::Counter::kIsRate);
+  state.SetBytesProcessed(static_cast<int64_t>(cloud.data.size()) * state.iterations());
+}
+
+void normalArguments(benchmark::internal::Benchmark * benchmark)
+{
+  benchmark->ArgNames({"width", "height", "threads"});
+  for (const auto & resolution : {kResolutions[0], kResolutions[1]}) {
+    for (int64_t threads : {0, 4}) {
+      benchmark->Args({resolution[0], resolution[1], threads});
+    }
+  }
+}
+
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+// Arguments: width, height, scene (0 the noise of makeDepthImage(), 1 a floor) and
+// the zstd level
+void BM_Compress(benchmark::State & state)
+{
+  const uint32_t width = static_cast<uint32_t>(state.range(0));
+  const uint32_t height = static_cast<uint32_t>(state.range(1));
+  const auto depth = state.range(2) == 0 ?
+    makeDepthImage<uint16_t>(width, height, 10) : makeFloorDepthImage(width, height);
+  const ProjectionCache projection(makeCameraInfo(width, height));
+  sensor_msgs::msg::PointCloud2 cloud;
+  depthimage_to_pointcloud2::prepareCloud(cloud, width, height);
+  depthimage_to_pointcloud2::convert<uint16_t>(
+    depth, cloud, projection, makeOptions(RANGE_MAX_NAN), nullptr, nullptr);
+
+  depthimage_to_pointcloud2::ZstdCloudCompressor compressor(static_cast<int>(state.range(3)));
+  point_cloud_interfaces::msg::CompressedPointCloud2 compressed;
+  for (auto _ : state) {
+    compressor.compress(cloud, compressed);
+    benchmark::DoNotOptimize(compressed.compressed_data.data());
+    benchmark::ClobberMemory();
+  }
+
+  state.counters["ratio"] =
+    static_cast<double>(cloud.data.size()) / compressed.compressed_data.size();
+  state.SetBytesProcessed(static_cast<int64_t>(cloud.data.size()) * state.iterations());
+}
+
+void compressionArguments(benchmark::internal::Benchmark * benchmark)
+{
+  benchmark->ArgNames({"width", "height", "scene", "level"});
+  for (const auto & resolution : {kResolutions[0], kResolutions[1]}) {
+    for (int64_t scene : {0, 1}) {
+      for (int64_t level : {-5, -1, 1, 3, 9}) {
+        benchmark->Args({resolution[0], resolution[1], scene, level});
+      }
+    }
+  }
+}
+#endif
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_Convert, uint16_t)->Apply(singleThreadedArguments)
+->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Convert, float)->Apply(singleThreadedArguments)
+->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Convert, uint16_t)->Apply(pooledArguments)
+->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Convert, float)->Apply(pooledArguments)
+->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+BENCHMARK(BM_ConvertFiltered)->Apply(filterArguments)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(BM_ConvertNormals)->Apply(normalArguments)->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+#ifdef DEPTHIMAGE_TO_POINTCLOUD2_WITH_ZSTD
+BENCHMARK(BM_Compress)->Apply(compressionArguments)->Unit(benchmark::kMicrosecond)->UseRealTime();
+#endif
+
+BENCHMARK_MAIN();
@@ -0,0 +1,156 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <cv_bridge/cv_bridge.h>
+
+#include <depthimage_to_pointcloud2/cloud_pool.hpp>
+#include <depthimage_to_pointcloud2/depth_conversions.hpp>
+#include <depthimage_to_pointcloud2/point_formats.hpp>
+#include <depthimage_to_pointcloud2/projection_cache.hpp>
+
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "cuda/cuda_converter.hpp"
+#include "test_frames.hpp"
+
+// CudaConverter against convert<T, PointXYZRGB>() on the CPU. The device may
+// contract multiplies and adds, so the points only match within a few ulp;
+// the colors and which points are bad match exactly. Without a device the
+// tests are skipped.
+
+namespace
+{
+
+using depthimage_to_pointcloud2::ConversionOptions;
+using depthimage_to_pointcloud2::CudaConverter;
+using depthimage_to_pointcloud2::ProjectionCache;
+using depthimage_to_pointcloud2::kPointStep;
+using depthimage_to_pointcloud2::kRgbOffset;
+using test_frames::floatAt;
+using test_frames::uintAt;
+
+const uint32_t kWidth = 640;
+const uint32_t kHeight = 480;
+
+class CudaConverterTest : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    try {
+      converter.reset(new CudaConverter());
+    } catch (const std::runtime_error & e) {
+      GTEST_SKIP() << "no CUDA device: " << e.what();
+    }
+  }
+
+  template<typename T>
+  void expectMatchesCpu(
+    const ProjectionCache & projection, const ConversionOptions & options,
+    const cv_bridge::CvImageConstPtr & color)
+  {
+    const auto image = test_frames::makeSceneImage<T>(kWidth, kHeight);
+    sensor_msgs::msg::PointCloud2 expected;
+    depthimage_to_pointcloud2::prepareCloud<depthimage_to_pointcloud2::PointXYZRGB>(
+      expected, kWidth, kHeight);
+    depthimage_to_pointcloud2::convert<T, depthimage_to_pointcloud2::PointXYZRGB>(
+      image, expected, projection, options, depthimage_to_pointcloud2::ColorSource(color));
+
+    sensor_msgs::msg::PointCloud2 actual;
+    depthimage_to_pointcloud2::prepareCloud<depthimage_to_pointcloud2::PointXYZRGB>(
+      actual, kWidth, kHeight);
+    converter->setProjection(projection);
+    converter->convert(*image, actual, options, color);
+
+    ASSERT_EQ(actual.data.size(), expected.data.size());
+    size_t mismatches = 0;
+    for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight && mismatches < 10; ++i) {
+      const uint8_t * a = &actual.data[i * kPointStep];
+      const uint8_t * b = &expected.data[i * kPointStep];
+      bool same = uintAt(a, kRgbOffset) == uintAt(b, kRgbOffset);
+      for (int axis = 0; axis < 3; ++axis) {
+        const float x = floatAt(a, axis * sizeof(float));
+        const float y = floatAt(b, axis * sizeof(float));
+        same = same && (std::isnan(y) ? std::isnan(x) :
+          std::fabs(x - y) <= 1e-6f * std::max(1.0f, std::fabs(y)));
+      }
+      if (!same) {
+        ++mismatches;
+        ADD_FAILURE() << "point " << i << " is (" << floatAt(a, 0) << ", " << floatAt(a, 4) <<
+          ", " << floatAt(a, 8) << ") instead of (" << floatAt(b, 0) << ", " << floatAt(b, 4) <<
+          ", " << floatAt(b, 8) << ")";
+      }
+    }
+  }
+
+  std::unique_ptr<CudaConverter> converter;
+};
+
+TEST_F(CudaConverterTest, MatchesCpu)
+{
+  const sensor_msgs::msg::CameraInfo info = test_frames::makeCameraInfo(kWidth, kHeight);
+  const ProjectionCache projection(info);
+  const cv_bridge::CvImageConstPtr color =
+    test_frames::makeColorImage(kWidth, kHeight, sensor_msgs::image_encodings::BGR8);
+  ConversionOptions clamped;
+  clamped.range_max = 5.0;
+  clamped.use_quiet_nan = false;
+  ConversionOptions cut = clamped;
+  cut.use_quiet_nan = true;
+  for (const ConversionOptions & options : {ConversionOptions(), clamped, cut}) {
+    ASSERT_TRUE(CudaConverter::supports(options));
+    expectMatchesCpu<uint16_t>(projection, options, nullptr);
+    expectMatchesCpu<uint16_t>(projection, options, color);
+    expectMatchesCpu<float>(projection, options, color);
+  }
+}
+
+TEST_F(CudaConverterTest, RectifiedMatchesCpu)
+{
+  sensor_msgs::msg::CameraInfo info = test_frames::makeCameraInfo(kWidth, kHeight);
+  info.d = {-0.05, 0.01, 0.0005, -0.0003, 0.0};
+  const ProjectionCache projection(info, kWidth, kHeight, true);
+  expectMatchesCpu<uint16_t>(projection, ConversionOptions(), nullptr);
+}
+
+TEST_F(CudaConverterTest, RejectsWhatItDoesNotSupport)
+{
+  ConversionOptions dense;
+  dense.output_dense = true;
+  EXPECT_FALSE(CudaConverter::supports(dense));
+  const sensor_msgs::msg::CameraInfo info = test_frames::makeCameraInfo(kWidth, kHeight);
+  converter->setProjection(ProjectionCache(info));
+  const auto image = test_frames::makeSceneImage<uint16_t>(kWidth, kHeight);
+  sensor_msgs::msg::PointCloud2 cloud;
+  depthimage_to_pointcloud2::prepareCloud<depthimage_to_pointcloud2::PointXYZRGB>(
+    cloud, kWidth, kHeight);
+  EXPECT_THROW(converter->convert(*image, cloud, dense, nullptr), std::runtime_error);
+  const auto smaller = test_frames::makeSceneImage<uint16_t>(kWidth / 2, kHeight / 2);
+  EXPECT_THROW(
+    converter->convert(*smaller, cloud, ConversionOptions(), nullptr), std::runtime_error);
+}
+
+}  // namespace
@@ -0,0 +1,759 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <cv_bridge/cv_bridge.h>
+
+#include <depthimage_to_pointcloud2/cloud_pool.hpp>
+#include <depthimage_to_pointcloud2/depth_conversions.hpp>
+#include <depthimage_to_pointcloud2/depth_filters.hpp>
+#include <depthimage_to_pointcloud2/depth_traits.hpp>
+#include <depthimage_to_pointcloud2/point_formats.hpp>
+#include <depthimage_to_pointcloud2/projection_cache.hpp>
+#include <depthimage_to_pointcloud2/worker_pool.hpp>
+
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "test_frames.hpp"
+
+// convert<T, Format>() against a per pixel reference, the conversion of
+// depth_image_proc in double precision, and every faster path (worker pool,
+// dense output, decimation, windows, compact formats) against the plain
+// single threaded organized cloud it has to be equivalent to
+
+namespace
+{
+
+using depthimage_to_pointcloud2::ConversionOptions;
+using depthimage_to_pointcloud2::DepthTraits;
+using depthimage_to_pointcloud2::ProjectionCache;
+using depthimage_to_pointcloud2::WorkerPool;
+using depthimage_to_pointcloud2::kPointStep;
+using depthimage_to_pointcloud2::kRgbOffset;
+using test_frames::floatAt;
+using test_frames::uintAt;
+
+const uint32_t kWidth = 67;
+const uint32_t kHeight = 41;
+
+struct ReferencePoint
+{
+  bool good;
+  double x;
+  double y;
+  double z;
+};
+
+// The organized cloud of the whole image, point (u, v) from pixel (u, v)
+template<typename T>
+std::vector<ReferencePoint> referenceCloud(
+  const sensor_msgs::msg::Image & image, const sensor_msgs::msg::CameraInfo & info,
+  const ConversionOptions & options)
+{
+  const double fx = info.p[0];
+  const double fy = info.p[5];
+  const double cx = info.p[2];
+  const double cy = info.p[6];
+  const double unit = std::is_integral<T>::value ? 0.001 : 1.0;
+  std::vector<ReferencePoint> points;
+  for (uint32_t v = 0; v < image.height; ++v) {
+    const T * row = reinterpret_cast<const T *>(&image.data[static_cast<size_t>(v) * image.step]);
+    for (uint32_t u = 0; u < image.width; ++u) {
+      const T depth = row[u];
+      double z = static_cast<double>(depth) * unit * options.depth_scale;
+      bool good = DepthTraits<T>::valid(depth) &&
+        !(options.range_max != 0.0 && z > options.range_max);
+      if (!good && options.range_max != 0.0 && !options.use_quiet_nan) {
+        z = options.range_max;
+        good = true;
+      }
+      points.push_back(ReferencePoint{good, (u - cx) * z / fx, (v - cy) * z / fy, z});
+    }
+  }
+  return points;
+}
+
+::testing::AssertionResult near(float actual, double expected, const char * what, size_t index)
+{
+  if (std::fabs(actual - expected) <= 1e-5 * std::max(1.0, std::fabs(expected))) {
+    return ::testing::AssertionSuccess();
+  }
+  return ::testing::AssertionFailure() << what << " of point " << index << " is " << actual <<
+         " instead of " << expected;
+}
+
+template<typename Format = depthimage_to_pointcloud2::PointXYZRGB, typename T>
+sensor_msgs::msg::PointCloud2 convertImage(
+  const sensor_msgs::msg::Image::ConstSharedPtr & image, const ProjectionCache & projection,
+  const ConversionOptions & options, const cv_bridge::CvImageConstPtr & color = nullptr,
+  WorkerPool * pool = nullptr, T * = nullptr)
+{
+  sensor_msgs::msg::PointCloud2 cloud;
+  depthimage_to_pointcloud2::prepareCloud<Format>(cloud, projection.width(), projection.height());
+  depthimage_to_pointcloud2::convert<T, Format>(
+    image, cloud, projection, options, depthimage_to_pointcloud2::ColorSource(color), pool);
+  return cloud;
+}
+
+// The options every path is run with: no range_max, range_max with NaN and
+// range_max with clamping, the last in half millimeters
+std::vector<ConversionOptions> rangeOptions()
+{
+  std::vector<ConversionOptions> all(3);
+  all[1].range_max = 5.0;
+  all[1].use_quiet_nan = true;
+  all[2].range_max = 5.0;
+  all[2].use_quiet_nan = false;
+  all[2].depth_scale = 0.5;
+  return all;
+}
+
+template<typename T>
+class ConvertTest : public ::testing::Test
+{
+protected:
+  ConvertTest()
+  : info(test_frames::makeCameraInfo(kWidth, kHeight)),
+    image(test_frames::makeSceneImage<T>(kWidth, kHeight)),
+    projection(info)
+  {
+  }
+
+  sensor_msgs::msg::PointCloud2 convertWith(
+    const ConversionOptions & options, const cv_bridge::CvImageConstPtr & color = nullptr,
+    WorkerPool * pool = nullptr)
+  {
+    return convertImage<depthimage_to_pointcloud2::PointXYZRGB, T>(
+      image, projection, options, color, pool);
+  }
+
+  const sensor_msgs::msg::CameraInfo info;
+  const sensor_msgs::msg::Image::SharedPtr image;
+  const ProjectionCache projection;
+};
+
+typedef ::testing::Types<uint16_t, int32_t, float, double> DepthTypes;
+TYPED_TEST_SUITE(ConvertTest, DepthTypes);
+
+TYPED_TEST(ConvertTest, MatchesReference)
+{
+  for (const ConversionOptions & options : rangeOptions()) {
+    const sensor_msgs::msg::PointCloud2 cloud = this->convertWith(options);
+    const std::vector<ReferencePoint> expected =
+      referenceCloud<TypeParam>(*this->image, this->info, options);
+    ASSERT_EQ(cloud.width, kWidth);
+    ASSERT_EQ(cloud.height, kHeight);
+    ASSERT_EQ(cloud.row_step, kWidth * kPointStep);
+    ASSERT_FALSE(cloud.is_dense);
+    size_t good = 0;
+    for (size_t i = 0; i < expected.size(); ++i) {
+      const uint8_t * point = &cloud.data[i * kPointStep];
+      if (!expected[i].good) {
+        EXPECT_TRUE(std::isnan(floatAt(point, 0)) && std::isnan(floatAt(point, 4)) &&
+          std::isnan(floatAt(point, 8))) << "point " << i << " should be bad";
+        continue;
+      }
+      ++good;
+      EXPECT_TRUE(near(floatAt(point, 0), expected[i].x, "x", i));
+      EXPECT_TRUE(near(floatAt(point, 4), expected[i].y, "y", i));
+      EXPECT_TRUE(near(floatAt(point, 8), expected[i].z, "z", i));
+      EXPECT_EQ(uintAt(point, kRgbOffset), 0u) << "point " << i;
+    }
+    // The scene has bad points to lose, and most are good
+    EXPECT_GT(good, expected.size() / 2);
+    if (options.range_max == 0.0 || options.use_quiet_nan) {
+      EXPECT_LT(good, expected.size());
+    }
+  }
+}
+
+// Every good point takes the color of its own pixel, in every 8 bit layout
+TYPED_TEST(ConvertTest, ColorsEveryPointFromItsPixel)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  for (const std::string & encoding : {enc::BGR8, enc::RGB8, enc::BGRA8, enc::RGBA8, enc::MONO8}) {
+    const cv_bridge::CvImageConstPtr color =
+      test_frames::makeColorImage(kWidth, kHeight, encoding);
+    const sensor_msgs::msg::PointCloud2 cloud = this->convertWith(ConversionOptions(), color);
+    size_t colored = 0;
+    for (uint32_t v = 0; v < kHeight; ++v) {
+      for (uint32_t u = 0; u < kWidth; ++u) {
+        const uint8_t * point = &cloud.data[(static_cast<size_t>(v) * kWidth + u) * kPointStep];
+        if (std::isnan(floatAt(point, 8))) {
+          continue;
+        }
+        ++colored;
+        ASSERT_EQ(uintAt(point, kRgbOffset), test_frames::expectedColor(*color, u, v)) <<
+          encoding << " pixel " << u << ", " << v;
+      }
+    }
+    EXPECT_GT(colored, 0u);
+  }
+}
+
+// Bands of rows on the pool threads have to give the single threaded cloud bit
+// for bit, on every path that runs in bands
+TYPED_TEST(ConvertTest, PoolMatchesSingleThread)
+{
+  std::vector<ConversionOptions> all = rangeOptions();
+  ConversionOptions dense;
+  dense.output_dense = true;
+  dense.range_max = 5.0;
+  dense.use_quiet_nan = true;
+  all.push_back(dense);
+  ConversionOptions clipped = dense;
+  clipped.range_min = 1.2;
+  clipped.crop_box.max[0] = 0.5f;
+  all.push_back(clipped);
+  clipped.output_dense = false;
+  all.push_back(clipped);
+  ConversionOptions window;
+  window.roi.x_offset = 5;
+  window.roi.y_offset = 3;
+  window.roi.width = 40;
+  window.roi.height = 30;
+  all.push_back(window);
+
+  const cv_bridge::CvImageConstPtr color =
+    test_frames::makeColorImage(kWidth, kHeight, sensor_msgs::image_encodings::BGR8);
+  for (size_t threads : {2, 3, 8}) {
+    WorkerPool pool(threads);
+    for (size_t i = 0; i < all.size(); ++i) {
+      EXPECT_TRUE(
+        test_frames::sameClouds(
+          this->convertWith(all[i], color, &pool), this->convertWith(all[i], color))) <<
+        "options " << i << " on " << threads << " threads";
+    }
+  }
+}
+
+// The dense cloud is the organized one without its bad points, in order
+TYPED_TEST(ConvertTest, DenseHoldsTheGoodPointsInOrder)
+{
+  for (ConversionOptions options : rangeOptions()) {
+    const sensor_msgs::msg::PointCloud2 organized = this->convertWith(options);
+    options.output_dense = true;
+    const sensor_msgs::msg::PointCloud2 dense = this->convertWith(options);
+    std::vector<uint8_t> good;
+    for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+      const uint8_t * point = &organized.data[i * kPointStep];
+      if (!std::isnan(floatAt(point, 8))) {
+        good.insert(good.end(), point, point + kPointStep);
+      }
+    }
+    EXPECT_EQ(dense.height, 1u);
+    EXPECT_TRUE(dense.is_dense);
+    EXPECT_EQ(dense.width, good.size() / kPointStep);
+    EXPECT_EQ(dense.row_step, dense.width * kPointStep);
+    EXPECT_TRUE(dense.data == good);
+  }
+}
+
+// range_min and crop_box only invalidate points; the rows and columns they skip
+// must not have held any point in the box
+TYPED_TEST(ConvertTest, ClipsToRangeMinAndBox)
+{
+  ConversionOptions options;
+  options.output_dense = true;
+  const sensor_msgs::msg::PointCloud2 all_points = this->convertWith(options);
+  options.range_min = 1.2;
+  options.crop_box.min = {{-0.6f, -0.4f, -std::numeric_limits<float>::infinity()}};
+  options.crop_box.max = {{0.5f, 0.3f, 3.0f}};
+  const sensor_msgs::msg::PointCloud2 clipped = this->convertWith(options);
+
+  std::vector<uint8_t> expected;
+  for (size_t i = 0; i < all_points.width; ++i) {
+    const uint8_t * point = &all_points.data[i * kPointStep];
+    bool inside = floatAt(point, 8) >= options.range_min;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float value = floatAt(point, axis * sizeof(float));
+      inside = inside && value >= options.crop_box.min[axis] &&
+        value <= options.crop_box.max[axis];
+    }
+    if (inside) {
+      expected.insert(expected.end(), point, point + kPointStep);
+    }
+  }
+  EXPECT_GT(expected.size(), 0u);
+  EXPECT_LT(expected.size(), all_points.data.size());
+  EXPECT_EQ(clipped.width, expected.size() / kPointStep);
+  EXPECT_TRUE(clipped.data == expected);
+}
+
+// The organized cloud of a region of interest is that window of the full cloud,
+// also where the ROI reaches past the image
+TYPED_TEST(ConvertTest, RoiIsWindowOfFullCloud)
+{
+  const sensor_msgs::msg::PointCloud2 full = this->convertWith(ConversionOptions());
+  const std::array<uint32_t, 4> rois[] = {
+    {{0, 0, 0, 0}}, {{5, 3, 40, 30}}, {{60, 30, 0, 0}}, {{50, 20, 100, 100}}, {{1, 1, 1, 1}}};
+  for (const std::array<uint32_t, 4> & roi : rois) {
+    ConversionOptions options;
+    options.roi.x_offset = roi[0];
+    options.roi.y_offset = roi[1];
+    options.roi.width = roi[2];
+    options.roi.height = roi[3];
+    const sensor_msgs::msg::PointCloud2 window = this->convertWith(options);
+    const uint32_t width = std::min(roi[2] == 0 ? kWidth : roi[2], kWidth - roi[0]);
+    const uint32_t height = std::min(roi[3] == 0 ? kHeight : roi[3], kHeight - roi[1]);
+    ASSERT_EQ(window.width, width) << "roi at " << roi[0] << ", " << roi[1];
+    ASSERT_EQ(window.height, height) << "roi at " << roi[0] << ", " << roi[1];
+    for (uint32_t v = 0; v < height; ++v) {
+      EXPECT_TRUE(
+        test_frames::sameFloats(
+          &window.data[static_cast<size_t>(v) * window.row_step],
+          &full.data[(static_cast<size_t>(v + roi[1]) * kWidth + roi[0]) * kPointStep],
+          width * kPointStep / sizeof(float), "row " + std::to_string(v)));
+    }
+  }
+}
+
+// A stride decimated point is the reference point of its block's top left
+// pixel, a min decimated one has the nearest good depth of its block
+TYPED_TEST(ConvertTest, DecimatesBlocks)
+{
+  const std::vector<ReferencePoint> expected =
+    referenceCloud<TypeParam>(*this->image, this->info, ConversionOptions());
+  for (uint32_t factor : {2u, 3u}) {
+    ConversionOptions options;
+    options.decimation = factor;
+    const ProjectionCache stride_projection = this->projection.decimated(factor, false);
+    const sensor_msgs::msg::PointCloud2 stride = convertImage<
+      depthimage_to_pointcloud2::PointXYZRGB, TypeParam>(this->image, stride_projection, options);
+    ASSERT_EQ(stride.width, kWidth / factor);
+    ASSERT_EQ(stride.height, kHeight / factor);
+    for (uint32_t v = 0; v < stride.height; ++v) {
+      for (uint32_t u = 0; u < stride.width; ++u) {
+        const size_t i = static_cast<size_t>(v) * factor * kWidth + u * factor;
+        const uint8_t * point =
+          &stride.data[(static_cast<size_t>(v) * stride.width + u) * kPointStep];
+        if (!expected[i].good) {
+          EXPECT_TRUE(std::isnan(floatAt(point, 8))) << "point " << i << " should be bad";
+          continue;
+        }
+        EXPECT_TRUE(near(floatAt(point, 0), expected[i].x, "x", i));
+        EXPECT_TRUE(near(floatAt(point, 4), expected[i].y, "y", i));
+        EXPECT_TRUE(near(floatAt(point, 8), expected[i].z, "z", i));
+      }
+    }
+
+    options.decimation_mode = depthimage_to_pointcloud2::DecimationMode::BLOCK_MIN;
+    const sensor_msgs::msg::PointCloud2 nearest = convertImage<
+      depthimage_to_pointcloud2::PointXYZRGB, TypeParam>(
+      this->image, this->projection.decimated(factor, true), options);
+    for (uint32_t v = 0; v < nearest.height; ++v) {
+      for (uint32_t u = 0; u < nearest.width; ++u) {
+        double z = std::numeric_limits<double>::infinity();
+        for (uint32_t dv = 0; dv < factor; ++dv) {
+          for (uint32_t du = 0; du < factor; ++du) {
+            const ReferencePoint & pixel =
+              expected[static_cast<size_t>(v * factor + dv) * kWidth + u * factor + du];
+            z = pixel.good ? std::min(z, pixel.z) : z;
+          }
+        }
+        const float actual =
+          floatAt(&nearest.data[(static_cast<size_t>(v) * nearest.width + u) * kPointStep], 8);
+        if (std::isinf(z)) {
+          EXPECT_TRUE(std::isnan(actual)) << "block " << u << ", " << v << " should be bad";
+        } else {
+          EXPECT_TRUE(near(actual, z, "z", static_cast<size_t>(v) * nearest.width + u));
+        }
+      }
+    }
+  }
+}
+
+// Rays undistorted per pixel, without any distortion, are the separable ones
+TYPED_TEST(ConvertTest, RectifiedWithoutDistortionMatches)
+{
+  const ProjectionCache rectified(this->info, kWidth, kHeight, true);
+  ASSERT_TRUE(rectified.rectified());
+  ConversionOptions options;
+  options.range_max = 5.0;
+  const sensor_msgs::msg::PointCloud2 expected = this->convertWith(options);
+  const sensor_msgs::msg::PointCloud2 actual = convertImage<
+    depthimage_to_pointcloud2::PointXYZRGB, TypeParam>(this->image, rectified, options);
+  ASSERT_EQ(actual.data.size(), expected.data.size());
+  for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      const float a = floatAt(&actual.data[i * kPointStep], axis * sizeof(float));
+      const float b = floatAt(&expected.data[i * kPointStep], axis * sizeof(float));
+      if (std::isnan(b)) {
+        EXPECT_TRUE(std::isnan(a)) << "point " << i;
+      } else {
+        EXPECT_NEAR(a, b, 1e-4f * std::max(1.0f, std::fabs(b))) << "point " << i;
+      }
+    }
+  }
+}
+
+// With transform_points every point is moved as the reference point would be
+TYPED_TEST(ConvertTest, TransformsPoints)
+{
+  ConversionOptions options;
+  options.transform_points = true;
+  // 90 degrees about x, from an optical frame into a body frame, and up 1 m
+  options.transform.rotation = {{1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, -1.0, 0.0}};
+  options.transform.translation = {{0.1, -0.2, 1.0}};
+  const sensor_msgs::msg::PointCloud2 cloud = this->convertWith(options);
+  const std::vector<ReferencePoint> expected =
+    referenceCloud<TypeParam>(*this->image, this->info, options);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    const uint8_t * point = &cloud.data[i * kPointStep];
+    if (!expected[i].good) {
+      EXPECT_TRUE(std::isnan(floatAt(point, 8))) << "point " << i;
+      continue;
+    }
+    EXPECT_TRUE(near(floatAt(point, 0), expected[i].x + 0.1, "x", i));
+    EXPECT_TRUE(near(floatAt(point, 4), expected[i].z - 0.2, "y", i));
+    EXPECT_TRUE(near(floatAt(point, 8), 1.0 - expected[i].y, "z", i));
+  }
+}
+
+TYPED_TEST(ConvertTest, RejectsProjectionOfAnotherSize)
+{
+  const ProjectionCache smaller(this->info, kWidth - 1, kHeight);
+  EXPECT_THROW(
+    (convertImage<depthimage_to_pointcloud2::PointXYZRGB, TypeParam>(
+      this->image, smaller, ConversionOptions())),
+    std::runtime_error);
+  ConversionOptions options;
+  options.decimation = 2;
+  EXPECT_THROW(
+    (convertImage<depthimage_to_pointcloud2::PointXYZRGB, TypeParam>(
+      this->image, this->projection, options)),
+    std::runtime_error);
+}
+
+// The filters run on the bands too; each run gets a filter of its own, so the
+// temporal state is the same. Formats with normals project the rows at the
+// edges of bands twice, which must still be filtered once.
+template<typename Format>
+void expectFilteredPoolMatchesSingleThread()
+{
+  const sensor_msgs::msg::CameraInfo info = test_frames::makeCameraInfo(kWidth, kHeight);
+  const ProjectionCache projection(info);
+  depthimage_to_pointcloud2::DepthFilterOptions filter_options;
+  filter_options.spatial_delta = 0.05f;
+  filter_options.flying_pixel_threshold = 0.05f;
+  filter_options.temporal_alpha = 0.5f;
+  depthimage_to_pointcloud2::DepthFilter single(filter_options);
+  depthimage_to_pointcloud2::DepthFilter banded(filter_options);
+  WorkerPool pool(3);
+  for (uint32_t frame = 0; frame < 3; ++frame) {
+    const auto image = test_frames::makeSceneImage<uint16_t>(kWidth, kHeight, frame);
+    for (bool dense : {false, true}) {
+      ConversionOptions options;
+      options.output_dense = dense;
+      options.filter = &single;
+      const sensor_msgs::msg::PointCloud2 expected =
+        convertImage<Format, uint16_t>(image, projection, options);
+      options.filter = &banded;
+      const sensor_msgs::msg::PointCloud2 actual =
+        convertImage<Format, uint16_t>(image, projection, options, nullptr, &pool);
+      EXPECT_TRUE(test_frames::sameClouds(actual, expected)) <<
+        "frame " << frame << (dense ? " dense" : " organized");
+    }
+  }
+}
+
+TEST(ConvertFiltered, PoolMatchesSingleThread)
+{
+  expectFilteredPoolMatchesSingleThread<depthimage_to_pointcloud2::PointXYZRGB>();
+}
+
+TEST(ConvertFiltered, PoolMatchesSingleThreadWithNormals)
+{
+  expectFilteredPoolMatchesSingleThread<depthimage_to_pointcloud2::PointXYZRGBNormal>();
+}
+
+// Voxel centroids are summed per band and merged, so on the pool they may only
+// differ by the order of the float additions
+TEST(ConvertVoxels, PoolMatchesSingleThread)
+{
+  const sensor_msgs::msg::CameraInfo info = test_frames::makeCameraInfo(kWidth, kHeight);
+  const ProjectionCache projection(info);
+  const auto image = test_frames::makeSceneImage<float>(kWidth, kHeight);
+  ConversionOptions options;
+  options.voxel_size = 0.1f;
+  sensor_msgs::msg::PointCloud2 expected =
+    convertImage<depthimage_to_pointcloud2::PointXYZRGB, float>(image, projection, options);
+  WorkerPool pool(3);
+  sensor_msgs::msg::PointCloud2 actual =
+    convertImage<depthimage_to_pointcloud2::PointXYZRGB, float>(
+    image, projection, options, nullptr, &pool);
+  ASSERT_EQ(actual.width, expected.width);
+  ASSERT_GT(actual.width, 0u);
+  auto sorted = [](const sensor_msgs::msg::PointCloud2 & cloud) {
+      std::vector<std::array<float, 3>> points(cloud.width);
+      for (size_t i = 0; i < cloud.width; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+          points[i][axis] = floatAt(&cloud.data[i * kPointStep], axis * sizeof(float));
+        }
+      }
+      std::sort(points.begin(), points.end());
+      return points;
+    };
+  const std::vector<std::array<float, 3>> a = sorted(actual);
+  const std::vector<std::array<float, 3>> b = sorted(expected);
+  for (size_t i = 0; i < a.size(); ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      EXPECT_NEAR(a[i][axis], b[i][axis], 1e-5f) << "centroid " << i;
+    }
+  }
+}
+
+// Cameras converting on threads of their own share the node's pool; every
+// convert() has to get only its own bands back, on the paths whose bands leave
+// results behind for after parallelFor() returns
+TEST(ConvertSharedPool, ConcurrentCallsKeepTheirBands)
+{
+  WorkerPool pool(3);
+  ConversionOptions voxels;
+  voxels.voxel_size = 0.1f;
+  ConversionOptions clipped;
+  clipped.output_dense = true;
+  clipped.range_min = 1.2;
+  const ConversionOptions all[] = {voxels, clipped};
+
+  struct Camera
+  {
+    ProjectionCache projection;
+    sensor_msgs::msg::Image::SharedPtr image;
+    sensor_msgs::msg::PointCloud2 expected[2];
+  };
+  // Of different sizes, so mixed up bands show in the sizes too
+  std::vector<Camera> cameras;
+  for (uint32_t scale : {1u, 2u}) {
+    const uint32_t width = kWidth * scale;
+    const uint32_t height = kHeight * scale;
+    cameras.push_back(
+      Camera{ProjectionCache(test_frames::makeCameraInfo(width, height)),
+        test_frames::makeSceneImage<uint16_t>(width, height, scale), {}});
+  }
+  for (Camera & camera : cameras) {
+    for (size_t i = 0; i < 2; ++i) {
+      camera.expected[i] = convertImage<depthimage_to_pointcloud2::PointXYZRGB, uint16_t>(
+        camera.image, camera.projection, all[i], nullptr, &pool);
+    }
+  }
+
+  std::atomic<size_t> mismatches{0};
+  auto convert_repeatedly = [&](const Camera & camera) {
+      for (int frame = 0; frame < 200; ++frame) {
+        const size_t i = frame % 2;
+        const sensor_msgs::msg::PointCloud2 cloud =
+          convertImage<depthimage_to_pointcloud2::PointXYZRGB, uint16_t>(
+          camera.image, camera.projection, all[i], nullptr, &pool);
+        if (!test_frames::sameClouds(cloud, camera.expected[i])) {
+          ++mismatches;
+        }
+      }
+    };
+  std::thread first(convert_repeatedly, std::cref(cameras[0]));
+  std::thread second(convert_repeatedly, std::cref(cameras[1]));
+  first.join();
+  second.join();
+  EXPECT_EQ(mismatches.load(), 0u);
+}
+
+float halfToFloat(uint16_t half)
+{
+  const int exponent = (half >> 10) & 0x1f;
+  const int mantissa = half & 0x3ff;
+  const float sign = (half & 0x8000) != 0 ? -1.0f : 1.0f;
+  if (exponent == 0x1f) {
+    return mantissa != 0 ? std::numeric_limits<float>::quiet_NaN() :
+           sign * std::numeric_limits<float>::infinity();
+  }
+  if (exponent == 0) {
+    return sign * std::ldexp(static_cast<float>(mantissa), -24);
+  }
+  return sign * std::ldexp(static_cast<float>(mantissa + 1024), exponent - 25);
+}
+
+// The compact formats are the xyz of PointXYZRGB, packed
+class PointFormatTest : public ::testing::Test
+{
+protected:
+  PointFormatTest()
+  : info(test_frames::makeCameraInfo(kWidth, kHeight)),
+    image(test_frames::makeSceneImage<uint16_t>(kWidth, kHeight)),
+    projection(info)
+  {
+    options.range_max = 5.0;
+    options.use_quiet_nan = true;
+    color = test_frames::makeColorImage(kWidth, kHeight, sensor_msgs::image_encodings::BGR8);
+    reference = convertImage<depthimage_to_pointcloud2::PointXYZRGB, uint16_t>(
+      image, projection, options, color);
+  }
+
+  template<typename Format>
+  sensor_msgs::msg::PointCloud2 convertTo(WorkerPool * pool = nullptr)
+  {
+    sensor_msgs::msg::PointCloud2 cloud = convertImage<Format, uint16_t>(
+      image, projection, options, color, pool);
+    EXPECT_TRUE(Format::hasFields(cloud));
+    EXPECT_EQ(cloud.point_step, static_cast<uint32_t>(Format::point_step));
+    EXPECT_EQ(cloud.width, kWidth);
+    EXPECT_EQ(cloud.height, kHeight);
+    return cloud;
+  }
+
+  float referenceAt(size_t i, int axis) const
+  {
+    return floatAt(&reference.data[i * kPointStep], axis * sizeof(float));
+  }
+
+  const sensor_msgs::msg::CameraInfo info;
+  const sensor_msgs::msg::Image::SharedPtr image;
+  const ProjectionCache projection;
+  ConversionOptions options;
+  cv_bridge::CvImageConstPtr color;
+  sensor_msgs::msg::PointCloud2 reference;
+};
+
+TEST_F(PointFormatTest, XYZIsExact)
+{
+  const sensor_msgs::msg::PointCloud2 cloud = convertTo<depthimage_to_pointcloud2::PointXYZ>();
+  for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+    EXPECT_TRUE(
+      test_frames::sameFloats(
+        &cloud.data[i * 12], &reference.data[i * kPointStep], 3, "point " + std::to_string(i)));
+  }
+}
+
+TEST_F(PointFormatTest, HalfIsWithinHalfPrecision)
+{
+  const sensor_msgs::msg::PointCloud2 cloud = convertTo<depthimage_to_pointcloud2::PointXYZHalf>();
+  for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      uint16_t half;
+      std::memcpy(&half, &cloud.data[i * 6 + axis * 2], sizeof(half));
+      const float expected = referenceAt(i, axis);
+      if (std::isnan(expected)) {
+        EXPECT_TRUE(std::isnan(halfToFloat(half))) << "point " << i;
+      } else {
+        // 11 significant bits, rounded to nearest
+        const float tolerance = std::ldexp(std::fabs(expected), -11) + std::ldexp(1.0f, -24);
+        EXPECT_NEAR(halfToFloat(half), expected, tolerance) << "point " << i;
+      }
+    }
+  }
+}
+
+// Decoded as a subscriber would, with only the cloud: the scale is carried once
+// in its fields, not in the points
+TEST_F(PointFormatTest, QuantizedIsWithinHalfAStep)
+{
+  sensor_msgs::msg::PointCloud2 cloud = convertTo<depthimage_to_pointcloud2::PointXYZQuantized>();
+  EXPECT_EQ(depthimage_to_pointcloud2::quantizationScale(cloud), 0.001f);
+  options.quantization_scale = 0.002f;
+  cloud = convertTo<depthimage_to_pointcloud2::PointXYZQuantized>();
+  const float scale = depthimage_to_pointcloud2::quantizationScale(cloud);
+  ASSERT_EQ(scale, 0.002f);
+  const int16_t invalid = depthimage_to_pointcloud2::PointXYZQuantized::kInvalidQuantized;
+  for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+    const uint8_t * point = &cloud.data[i * cloud.point_step];
+    for (int axis = 0; axis < 3; ++axis) {
+      int16_t quantized;
+      std::memcpy(&quantized, point + cloud.fields[axis].offset, sizeof(quantized));
+      const float expected = referenceAt(i, axis);
+      if (std::isnan(expected)) {
+        EXPECT_EQ(quantized, invalid) << "point " << i;
+      } else {
+        EXPECT_NEAR(quantized * scale, expected, 0.001f + 1e-6f) << "point " << i;
+      }
+    }
+  }
+  EXPECT_TRUE(std::isnan(depthimage_to_pointcloud2::quantizationScale(reference)));
+}
+
+TEST_F(PointFormatTest, NormalFormatKeepsPointsAndColor)
+{
+  WorkerPool pool(3);
+  const sensor_msgs::msg::PointCloud2 cloud =
+    convertTo<depthimage_to_pointcloud2::PointXYZRGBNormal>();
+  EXPECT_TRUE(
+    test_frames::sameClouds(
+      convertTo<depthimage_to_pointcloud2::PointXYZRGBNormal>(&pool), cloud));
+  for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+    const uint8_t * point = &cloud.data[i * 48];
+    EXPECT_TRUE(
+      test_frames::sameFloats(point, &reference.data[i * kPointStep], 3, std::to_string(i)));
+    EXPECT_TRUE(
+      test_frames::sameFloats(
+        point + 32, &reference.data[i * kPointStep + kRgbOffset], 1, std::to_string(i)));
+  }
+}
+
+// The normals of a plane seen at an angle are the plane's, facing the camera,
+// with no curvature; at its edges too, from one-sided differences
+TEST(Normals, OfPlaneFaceTheCamera)
+{
+  const sensor_msgs::msg::CameraInfo info = test_frames::makeCameraInfo(kWidth, kHeight);
+  const ProjectionCache projection(info);
+  // n . p = 2 for the unit normal n, which points away from the camera
+  const double n[3] = {0.3, -0.4, std::sqrt(1.0 - 0.09 - 0.16)};
+  auto image = std::make_shared<sensor_msgs::msg::Image>();
+  image->width = kWidth;
+  image->height = kHeight;
+  image->encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+  image->step = kWidth * sizeof(float);
+  image->data.resize(static_cast<size_t>(image->step) * kHeight);
+  float * depths = reinterpret_cast<float *>(image->data.data());
+  for (uint32_t v = 0; v < kHeight; ++v) {
+    for (uint32_t u = 0; u < kWidth; ++u) {
+      const double ray[3] = {projection.rayX()[u], projection.rayY(v), 1.0};
+      depths[v * kWidth + u] =
+        static_cast<float>(2.0 / (n[0] * ray[0] + n[1] * ray[1] + n[2] * ray[2]));
+    }
+  }
+  for (bool dense : {false, true}) {
+    ConversionOptions options;
+    options.output_dense = dense;
+    const sensor_msgs::msg::PointCloud2 cloud =
+      convertImage<depthimage_to_pointcloud2::PointXYZRGBNormal, float>(
+      image, projection, options);
+    ASSERT_EQ(cloud.width * cloud.height, kWidth * kHeight);
+    for (size_t i = 0; i < static_cast<size_t>(kWidth) * kHeight; ++i) {
+      const uint8_t * point = &cloud.data[i * 48];
+      for (int axis = 0; axis < 3; ++axis) {
+        EXPECT_NEAR(floatAt(point, 16 + axis * sizeof(float)), -n[axis], 1e-3) << "point " << i;
+      }
+      EXPECT_NEAR(floatAt(point, 36), 0.0f, 1e-4f) << "point " << i;
+    }
+  }
+}
+
+}  // namespace
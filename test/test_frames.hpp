@@ -0,0 +1,211 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TEST_FRAMES_HPP_
+#define TEST_FRAMES_HPP_
+
+#include <gtest/gtest.h>
+
+#include <cv_bridge/cv_bridge.h>
+
+#include <depthimage_to_pointcloud2/depth_traits.hpp>
+#include <depthimage_to_pointcloud2/row_kernels.hpp>
+
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+
+// Deterministic frames and comparisons shared by the tests of the conversion
+
+namespace test_frames
+{
+
+using depthimage_to_pointcloud2::DepthTraits;
+
+inline sensor_msgs::msg::CameraInfo makeCameraInfo(uint32_t width, uint32_t height)
+{
+  sensor_msgs::msg::CameraInfo info;
+  info.header.frame_id = "depth_optical_frame";
+  info.width = width;
+  info.height = height;
+  const double f = width * 0.8;
+  // Off center, so swapped or mirrored axes show
+  const double cx = width * 0.47;
+  const double cy = height * 0.53;
+  info.k = {f, 0.0, cx, 0.0, f * 1.01, cy, 0.0, 0.0, 1.0};
+  info.p = {f, 0.0, cx, 0.0, 0.0, f * 1.01, cy, 0.0, 0.0, 0.0, 1.0, 0.0};
+  info.r = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+  info.distortion_model = "plumb_bob";
+  info.d = {0.0, 0.0, 0.0, 0.0, 0.0};
+  return info;
+}
+
+template<typename T>
+std::string depthEncoding()
+{
+  namespace enc = sensor_msgs::image_encodings;
+  return sizeof(T) == 2 ? enc::TYPE_16UC1 :
+         std::is_same<T, int32_t>::value ? enc::TYPE_32SC1 :
+         std::is_same<T, double>::value ? enc::TYPE_64FC1 : enc::TYPE_32FC1;
+}
+
+// A scene every conversion path has something to do on: a slanted wall from
+// 1 to 4 m with a box in front of it, a tenth of the pixels invalid and a few
+// beyond 6 m, so range_max 5.0 cuts them off
+template<typename T>
+sensor_msgs::msg::Image::SharedPtr makeSceneImage(
+  uint32_t width, uint32_t height, uint32_t seed = 42)
+{
+  auto image = std::make_shared<sensor_msgs::msg::Image>();
+  image->header.frame_id = "depth_optical_frame";
+  image->width = width;
+  image->height = height;
+  image->encoding = depthEncoding<T>();
+  image->step = width * sizeof(T);
+  image->data.resize(static_cast<size_t>(image->step) * height);
+
+  std::mt19937 random(seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_real_distribution<double> far(6.0, 8.0);
+  // quiet_NaN() is 0 for the integer types, i.e. invalid for any type
+  const T invalid = std::numeric_limits<T>::has_quiet_NaN ?
+    std::numeric_limits<T>::quiet_NaN() : T(0);
+  for (uint32_t v = 0; v < height; ++v) {
+    T * row = reinterpret_cast<T *>(&image->data[static_cast<size_t>(v) * image->step]);
+    for (uint32_t u = 0; u < width; ++u) {
+      double z = 1.0 + 3.0 * u / width + 0.5 * v / height;
+      if (u > width / 4 && u < width / 2 && v > height / 3 && v < 2 * height / 3) {
+        z = 0.8;
+      }
+      const int roll = percent(random);
+      if (roll < 10) {
+        row[u] = invalid;
+      } else if (roll < 13) {
+        row[u] = DepthTraits<T>::fromMeters(far(random));
+      } else {
+        row[u] = DepthTraits<T>::fromMeters(z);
+      }
+    }
+  }
+  return image;
+}
+
+// A color image of the given encoding where every pixel has a color of its own
+inline cv_bridge::CvImageConstPtr makeColorImage(
+  uint32_t width, uint32_t height, const std::string & encoding)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  const int channels = encoding == enc::MONO8 ? 1 :
+    encoding == enc::BGRA8 || encoding == enc::RGBA8 ? 4 : 3;
+  auto color = std::make_shared<cv_bridge::CvImage>();
+  color->encoding = encoding;
+  color->image = cv::Mat(
+    static_cast<int>(height), static_cast<int>(width), CV_MAKETYPE(CV_8U, channels));
+  for (uint32_t v = 0; v < height; ++v) {
+    uint8_t * row = color->image.ptr<uint8_t>(static_cast<int>(v));
+    for (uint32_t i = 0; i < width * channels; ++i) {
+      row[i] = static_cast<uint8_t>((v * 7 + i * 13 + i / channels * 3) & 0xff);
+    }
+  }
+  return color;
+}
+
+// The rgb field the pixel (u, v) of color should give
+inline uint32_t expectedColor(const cv_bridge::CvImage & color, uint32_t u, uint32_t v)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  const int channels = color.image.channels();
+  const uint8_t * pixel =
+    color.image.ptr<uint8_t>(static_cast<int>(v)) + static_cast<size_t>(u) * channels;
+  if (channels == 1) {
+    return (static_cast<uint32_t>(pixel[0]) << 16) | (static_cast<uint32_t>(pixel[0]) << 8) |
+           pixel[0];
+  }
+  const bool rgb_order = color.encoding == enc::RGB8 || color.encoding == enc::RGBA8;
+  const uint8_t r = rgb_order ? pixel[0] : pixel[2];
+  const uint8_t b = rgb_order ? pixel[2] : pixel[0];
+  return (static_cast<uint32_t>(r) << 16) | (static_cast<uint32_t>(pixel[1]) << 8) | b;
+}
+
+inline float floatAt(const uint8_t * data, size_t offset)
+{
+  float value;
+  std::memcpy(&value, data + offset, sizeof(value));
+  return value;
+}
+
+inline uint32_t uintAt(const uint8_t * data, size_t offset)
+{
+  uint32_t value;
+  std::memcpy(&value, data + offset, sizeof(value));
+  return value;
+}
+
+// Bit for bit, except that any NaN matches any NaN
+inline bool sameFloat(float a, float b)
+{
+  if (std::isnan(a) || std::isnan(b)) {
+    return std::isnan(a) && std::isnan(b);
+  }
+  return std::memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// count floats starting at a and b, reporting the first mismatch with what
+inline ::testing::AssertionResult sameFloats(
+  const uint8_t * a, const uint8_t * b, size_t count, const std::string & what)
+{
+  for (size_t i = 0; i < count; ++i) {
+    const float x = floatAt(a, i * sizeof(float));
+    const float y = floatAt(b, i * sizeof(float));
+    if (!sameFloat(x, y)) {
+      return ::testing::AssertionFailure() << what << ": float " << i << " is " << x <<
+             " instead of " << y;
+    }
+  }
+  return ::testing::AssertionSuccess();
+}
+
+// The same size, fields and data, NaNs matching any NaN
+inline ::testing::AssertionResult sameClouds(
+  const sensor_msgs::msg::PointCloud2 & a, const sensor_msgs::msg::PointCloud2 & b)
+{
+  if (a.width != b.width || a.height != b.height || a.point_step != b.point_step ||
+    a.row_step != b.row_step || a.is_dense != b.is_dense || a.fields.size() != b.fields.size() ||
+    a.data.size() != b.data.size())
+  {
+    return ::testing::AssertionFailure() << "clouds of " << a.width << "x" << a.height <<
+           " and " << b.width << "x" << b.height << " points differ in their layout";
+  }
+  for (const sensor_msgs::msg::PointField & field : a.fields) {
+    if (field.datatype != sensor_msgs::msg::PointField::FLOAT32) {
+      return a.data == b.data ? ::testing::AssertionSuccess() :
+             ::testing::AssertionFailure() << "cloud data differs";
+    }
+  }
+  return sameFloats(a.data.data(), b.data.data(), a.data.size() / sizeof(float), "cloud");
+}
+
+}  // namespace test_frames
+
+#endif  // TEST_FRAMES_HPP_
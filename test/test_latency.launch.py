@@ -0,0 +1,171 @@
+# Copyright 2017 Open Source Robotics Foundation, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# End to end throughput and latency of the node: 640x480 16UC1 frames are
+# published at 30 Hz, and the test fails if fewer than 90% of them come back as
+# clouds or if the 95th percentile of the time from a frame's stamp to its cloud
+# arriving is over the budget. Both can be set for slower machines with
+# DEPTHIMAGE_TO_POINTCLOUD2_MIN_RATIO and DEPTHIMAGE_TO_POINTCLOUD2_LATENCY_BUDGET
+# (in seconds).
+
+import os
+import time
+import unittest
+
+from launch import LaunchDescription
+import launch_testing
+import launch_testing.actions
+import launch_testing.asserts
+from launch_ros.actions import Node
+import pytest
+import rclpy
+from rclpy.qos import qos_profile_sensor_data
+from rclpy.time import Time
+from sensor_msgs.msg import CameraInfo, Image, PointCloud2
+
+WIDTH = 640
+HEIGHT = 480
+RATE = 30.0
+FRAMES = 300
+MIN_RATIO = float(os.environ.get('DEPTHIMAGE_TO_POINTCLOUD2_MIN_RATIO', '0.9'))
+LATENCY_BUDGET = float(os.environ.get('DEPTHIMAGE_TO_POINTCLOUD2_LATENCY_BUDGET', '0.05'))
+
+
+@pytest.mark.launch_test
+def generate_test_description():
+    node = Node(
+        package='depthimage_to_pointcloud2',
+        executable='depthimage_to_pointcloud2_node',
+        name='depth2pc2',
+        parameters=[{'range_max': 5.0}],
+        remappings=[
+            ('depth', '/latency_test/image'),
+            ('depth_camera_info', '/latency_test/camera_info'),
+            ('pointcloud2', '/latency_test/pointcloud2'),
+        ])
+    return LaunchDescription([node, launch_testing.actions.ReadyToTest()]), {'node': node}
+
+
+def make_camera_info():
+    info = CameraInfo()
+    info.header.frame_id = 'depth_optical_frame'
+    info.width = WIDTH
+    info.height = HEIGHT
+    f = WIDTH * 0.8
+    info.k = [f, 0.0, WIDTH / 2.0, 0.0, f, HEIGHT / 2.0, 0.0, 0.0, 1.0]
+    info.p = [f, 0.0, WIDTH / 2.0, 0.0, 0.0, f, HEIGHT / 2.0, 0.0, 0.0, 0.0, 1.0, 0.0]
+    info.r = [1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0]
+    info.distortion_model = 'plumb_bob'
+    info.d = [0.0] * 5
+    return info
+
+
+def make_depth_image():
+    # A wall from 1 to 4 m, every 7th pixel invalid
+    image = Image()
+    image.header.frame_id = 'depth_optical_frame'
+    image.width = WIDTH
+    image.height = HEIGHT
+    image.encoding = '16UC1'
+    image.step = WIDTH * 2
+    data = bytearray(image.step * HEIGHT)
+    for v in range(HEIGHT):
+        for u in range(WIDTH):
+            depth = 0 if (u + v) % 7 == 0 else 1000 + 3000 * u // WIDTH
+            i = (v * WIDTH + u) * 2
+            data[i] = depth & 0xff
+            data[i + 1] = depth >> 8
+    image.data = bytes(data)
+    return image
+
+
+class TestLatency(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        rclpy.init()
+
+    @classmethod
+    def tearDownClass(cls):
+        rclpy.shutdown()
+
+    def setUp(self):
+        self.node = rclpy.create_node('latency_test')
+
+    def tearDown(self):
+        self.node.destroy_node()
+
+    def test_throughput_and_latency(self):
+        latencies = {}
+
+        def cloud_cb(cloud):
+            stamp = Time.from_msg(cloud.header.stamp)
+            latencies[stamp.nanoseconds] = (
+                self.node.get_clock().now() - stamp).nanoseconds * 1e-9
+
+        self.node.create_subscription(
+            PointCloud2, '/latency_test/pointcloud2', cloud_cb, qos_profile_sensor_data)
+        image_pub = self.node.create_publisher(Image, '/latency_test/image', 10)
+        info_pub = self.node.create_publisher(CameraInfo, '/latency_test/camera_info', 10)
+        image = make_depth_image()
+        info = make_camera_info()
+
+        # Until the node converts, so discovery and the first projection are not timed
+        deadline = time.monotonic() + 30.0
+        while not latencies and time.monotonic() < deadline:
+            stamp = self.node.get_clock().now().to_msg()
+            info.header.stamp = stamp
+            image.header.stamp = stamp
+            info_pub.publish(info)
+            image_pub.publish(image)
+            rclpy.spin_once(self.node, timeout_sec=0.1)
+        self.assertTrue(latencies, 'no point cloud within 30 s')
+        latencies.clear()
+
+        start = time.monotonic()
+        for frame in range(FRAMES):
+            stamp = self.node.get_clock().now().to_msg()
+            info.header.stamp = stamp
+            image.header.stamp = stamp
+            info_pub.publish(info)
+            image_pub.publish(image)
+            next_frame = start + (frame + 1) / RATE
+            while True:
+                remaining = next_frame - time.monotonic()
+                if remaining <= 0.0:
+                    break
+                rclpy.spin_once(self.node, timeout_sec=remaining)
+        # The last clouds may still be on their way
+        drain = time.monotonic() + 1.0
+        while time.monotonic() < drain:
+            rclpy.spin_once(self.node, timeout_sec=0.05)
+
+        received = sorted(latencies.values())
+        print('received %d of %d clouds' % (len(received), FRAMES))
+        self.assertGreaterEqual(
+            len(received), MIN_RATIO * FRAMES,
+            'only %d of %d frames were converted' % (len(received), FRAMES))
+        p95 = received[int(0.95 * (len(received) - 1))]
+        print('latency p50 %.1f ms, p95 %.1f ms' % (
+            received[len(received) // 2] * 1e3, p95 * 1e3))
+        self.assertLessEqual(
+            p95, LATENCY_BUDGET,
+            'p95 latency %.1f ms is over the %.1f ms budget' % (p95 * 1e3, LATENCY_BUDGET * 1e3))
+
+
+@launch_testing.post_shutdown_test()
+class TestShutdown(unittest.TestCase):
+
+    def test_exit_code(self, proc_info):
+        launch_testing.asserts.assertExitCodes(proc_info, allowable_exit_codes=[0, -2, -15])
@@ -0,0 +1,224 @@
+// Copyright 2017 Open Source Robotics Foundation, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include <depthimage_to_pointcloud2/depth_traits.hpp>
+#include <depthimage_to_pointcloud2/row_kernels.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "test_frames.hpp"
+
+// Every vectorized row kernel the CPU runs has to write exactly what
+// projectRowScalar() writes, for row widths that exercise the vector body and
+// every length of scalar tail
+
+namespace
+{
+
+using depthimage_to_pointcloud2::RowLimits;
+using depthimage_to_pointcloud2::SimdLevel;
+using depthimage_to_pointcloud2::kPointStep;
+
+// The instruction sets this CPU can run, the scalar kernel included
+std::vector<SimdLevel> supportedLevels()
+{
+  std::vector<SimdLevel> levels = {SimdLevel::SCALAR};
+  const SimdLevel best = depthimage_to_pointcloud2::detectSimdLevel();
+  if (best == SimdLevel::AVX2) {
+    levels.push_back(SimdLevel::SSE41);
+  }
+  if (best != SimdLevel::SCALAR) {
+    levels.push_back(best);
+  }
+  return levels;
+}
+
+const char * levelName(SimdLevel level)
+{
+  switch (level) {
+    case SimdLevel::SSE41: return "sse4.1";
+    case SimdLevel::AVX2: return "avx2";
+    case SimdLevel::NEON: return "neon";
+    default: return "scalar";
+  }
+}
+
+// Depths in [0.2, 7] m with invalid ones, and a few right at 5 m, the
+// range_max of the limits below
+template<typename T>
+std::vector<T> makeRow(uint32_t width, uint32_t seed)
+{
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<float> depth(0.2f, 7.0f);
+  std::uniform_int_distribution<int> percent(0, 99);
+  const T invalid = std::numeric_limits<T>::has_quiet_NaN ?
+    std::numeric_limits<T>::quiet_NaN() : T(0);
+  std::vector<T> row(width);
+  for (T & value : row) {
+    const int roll = percent(random);
+    value = roll < 15 ? invalid :
+      roll < 20 ? depthimage_to_pointcloud2::DepthTraits<T>::fromMeters(5.0f) :
+      depthimage_to_pointcloud2::DepthTraits<T>::fromMeters(depth(random));
+  }
+  if (std::is_floating_point<T>::value && width > 2) {
+    row[1] = std::numeric_limits<T>::infinity();
+    row[2] = -std::numeric_limits<T>::infinity();
+  }
+  return row;
+}
+
+std::vector<float> makeRays(size_t count, uint32_t seed)
+{
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<float> ray(-0.8f, 0.8f);
+  std::vector<float> rays(count);
+  for (float & value : rays) {
+    value = ray(random);
+  }
+  return rays;
+}
+
+// No range_max, range_max with NaN and range_max with clamping, in the unit of
+// the depth type and in a quarter of it
+template<typename T>
+std::vector<RowLimits> limitsFor()
+{
+  std::vector<RowLimits> limits;
+  for (double depth_scale : {1.0, 0.25}) {
+    limits.push_back(RowLimits::make<T>(0.0, true, depth_scale));
+    limits.push_back(RowLimits::make<T>(5.0, true, depth_scale));
+    limits.push_back(RowLimits::make<T>(5.0, false, depth_scale));
+  }
+  return limits;
+}
+
+const uint32_t kWidths[] = {0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 640, 1283};
+
+template<typename T>
+class RowKernelTest : public ::testing::Test {};
+
+typedef ::testing::Types<uint16_t, int32_t, float, double> DepthTypes;
+TYPED_TEST_SUITE(RowKernelTest, DepthTypes);
+
+TYPED_TEST(RowKernelTest, MatchesScalarKernel)
+{
+  typedef TypeParam T;
+  for (SimdLevel level : supportedLevels()) {
+    const auto kernel = depthimage_to_pointcloud2::selectRowKernel<T>(level);
+    for (uint32_t width : kWidths) {
+      const std::vector<T> depths = makeRow<T>(width, width);
+      const std::vector<float> ray_x = makeRays(width, width + 1);
+      for (const RowLimits & limits : limitsFor<T>()) {
+        // Filled with garbage, every byte has to be written
+        std::vector<uint8_t> expected(static_cast<size_t>(width) * kPointStep + 1, 0xab);
+        std::vector<uint8_t> actual(expected.size(), 0xcd);
+        depthimage_to_pointcloud2::projectRowScalar<T, float>(
+          depths.data(), ray_x.data(), -0.3f, width, limits, expected.data());
+        kernel(depths.data(), ray_x.data(), -0.3f, width, limits, actual.data());
+        EXPECT_TRUE(
+          test_frames::sameFloats(
+            actual.data(), expected.data(), width * kPointStep / sizeof(float),
+            std::string(levelName(level)) + " width " + std::to_string(width)));
+        EXPECT_EQ(actual.back(), 0xcd) << "wrote past the row";
+      }
+    }
+  }
+}
+
+TYPED_TEST(RowKernelTest, RectifiedMatchesScalarKernel)
+{
+  typedef TypeParam T;
+  for (SimdLevel level : supportedLevels()) {
+    const auto kernel = depthimage_to_pointcloud2::selectRectifiedRowKernel<T>(level);
+    for (uint32_t width : kWidths) {
+      const std::vector<T> depths = makeRow<T>(width, width + 2);
+      const std::vector<float> ray_x = makeRays(width, width + 3);
+      const std::vector<float> ray_y = makeRays(width, width + 4);
+      for (const RowLimits & limits : limitsFor<T>()) {
+        std::vector<uint8_t> expected(static_cast<size_t>(width) * kPointStep, 0xab);
+        std::vector<uint8_t> actual(expected.size(), 0xcd);
+        depthimage_to_pointcloud2::projectRowScalar<T, const float *>(
+          depths.data(), ray_x.data(), ray_y.data(), width, limits, expected.data());
+        kernel(depths.data(), ray_x.data(), ray_y.data(), width, limits, actual.data());
+        EXPECT_TRUE(
+          test_frames::sameFloats(
+            actual.data(), expected.data(), width * kPointStep / sizeof(float),
+            std::string(levelName(level)) + " width " + std::to_string(width)));
+      }
+    }
+  }
+}
+
+// The dense two pass conversion sizes the cloud with countGoodPoints() before
+// the kernels run, so both have to agree on every depth
+TYPED_TEST(RowKernelTest, CountsTheGoodPointsTheKernelWrites)
+{
+  typedef TypeParam T;
+  const uint32_t width = 1283;
+  const std::vector<T> depths = makeRow<T>(width, 7);
+  const std::vector<float> ray_x = makeRays(width, 8);
+  for (const RowLimits & limits : limitsFor<T>()) {
+    std::vector<uint8_t> points(static_cast<size_t>(width) * kPointStep);
+    depthimage_to_pointcloud2::selectRowKernel<T>(depthimage_to_pointcloud2::detectSimdLevel())(
+      depths.data(), ray_x.data(), 0.1f, width, limits, points.data());
+    uint32_t good = 0;
+    for (uint32_t u = 0; u < width; ++u) {
+      good += std::isnan(test_frames::floatAt(points.data(), u * kPointStep + 8)) ? 0 : 1;
+    }
+    EXPECT_EQ(depthimage_to_pointcloud2::countGoodPoints(depths.data(), width, limits), good);
+  }
+}
+
+// The reference itself, against the conversion of depth_image_proc
+TEST(ScalarKernel, ProjectsThroughTheRays)
+{
+  const uint16_t depths[] = {0, 1000, 4999, 5000, 5001, 65535};
+  const float ray_x[] = {0.5f, -0.25f, 0.0f, 0.125f, 1.0f, 2.0f};
+  const std::vector<RowLimits> limits = {
+    RowLimits::make<uint16_t>(0.0, true), RowLimits::make<uint16_t>(5.0, true),
+    RowLimits::make<uint16_t>(5.0, false)};
+  std::vector<uint8_t> out(6 * kPointStep);
+  for (size_t l = 0; l < limits.size(); ++l) {
+    depthimage_to_pointcloud2::projectRowScalar<uint16_t, float>(
+      depths, ray_x, 0.5f, 6, limits[l], out.data());
+    for (size_t u = 0; u < 6; ++u) {
+      const float z = test_frames::floatAt(out.data(), u * kPointStep + 8);
+      const bool too_far = limits[l].check_max && depths[u] > 5000;
+      if (depths[u] == 0 || too_far) {
+        if (limits[l].clamp_invalid) {
+          EXPECT_FLOAT_EQ(z, 5.0f) << "limits " << l << " pixel " << u;
+        } else {
+          EXPECT_TRUE(std::isnan(z)) << "limits " << l << " pixel " << u;
+          EXPECT_TRUE(std::isnan(test_frames::floatAt(out.data(), u * kPointStep + 16)));
+          continue;
+        }
+      } else {
+        EXPECT_FLOAT_EQ(z, depths[u] * 0.001f) << "limits " << l << " pixel " << u;
+      }
+      EXPECT_FLOAT_EQ(test_frames::floatAt(out.data(), u * kPointStep), ray_x[u] * z);
+      EXPECT_FLOAT_EQ(test_frames::floatAt(out.data(), u * kPointStep + 4), 0.5f * z);
+      EXPECT_EQ(test_frames::uintAt(out.data(), u * kPointStep + 16), 0u);
+    }
+  }
+}
+
+}  // namespace